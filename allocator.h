@@ -2,18 +2,33 @@
  * -----------------
  * Interface file for the custom heap allocator.
  */
-#ifndef _ALLOCATOR_H
-#define _ALLOCATOR_H
+#ifndef _MYALLOCATOR_H
+#define _MYALLOCATOR_H
 
 #include <stdbool.h> // for bool
 #include <stddef.h>  // for size_t
 
-// Alignment requirement for all blocks
+// Alignment requirement for all blocks, a power of two of at least 8. Set at build time ("make ALIGNMENT=16"
+// for payloads holding SSE vectors or long doubles)
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
+#if ALIGNMENT < 8 || (ALIGNMENT & (ALIGNMENT - 1)) != 0
+#error "ALIGNMENT must be a power of two of at least 8"
+#endif
 
 // maximum size of block that must be accommodated
 #define MAX_REQUEST_SIZE (1 << 30)
 
+// how long a block is expected to stay allocated, see mymalloc_hint
+typedef enum {
+    LIFETIME_SHORT,     // freed soon after it is allocated
+    LIFETIME_LONG       // kept for much of the run
+} lifetime_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 /* Function: myinit
@@ -34,6 +49,25 @@ bool myinit(void *segment_start, size_t segment_size);
 void *mymalloc(size_t size);
 
 
+/* Function: mymalloc_hint
+ * -----------------------
+ * Custom version of malloc for a block the caller expects to be
+ * short-lived (freed soon after) or long-lived. An allocator may use the
+ * hint to keep blocks of different lifetimes apart, so that long-lived
+ * blocks don't end up pinned between short-lived ones; one that doesn't
+ * treats this as mymalloc. The block is released with myfree.
+ */
+void *mymalloc_hint(size_t size, lifetime_t lifetime);
+
+
+/* Function: mycalloc
+ * ------------------
+ * Custom version of calloc. Returns a zeroed block of nmemb * size bytes,
+ * or NULL if the product is zero, overflows or cannot be satisfied.
+ */
+void *mycalloc(size_t nmemb, size_t size);
+
+
 /* Function: myrealloc
  * -------------------
  * Custom version of realloc.
@@ -48,6 +82,26 @@ void *myrealloc(void *ptr, size_t new_size);
 void myfree(void *ptr);
 
 
+/* Function: myaligned_alloc
+ * -------------------------
+ * Custom version of aligned_alloc. Returns a block of at least size bytes
+ * whose address is a multiple of alignment, or NULL if alignment is not a
+ * power of two or the request cannot be satisfied. Alignments at or below
+ * ALIGNMENT behave like mymalloc. The block is released with myfree.
+ */
+void *myaligned_alloc(size_t alignment, size_t size);
+
+
+/* Function: myposix_memalign
+ * --------------------------
+ * Custom version of posix_memalign. Stores an alignment-aligned block of
+ * size bytes in *memptr and returns 0, or returns EINVAL if alignment is
+ * not a power of two multiple of sizeof(void *), or ENOMEM if the request
+ * cannot be satisfied (in which case *memptr is left untouched).
+ */
+int myposix_memalign(void **memptr, size_t alignment, size_t size);
+
+
 /* Function: validate_heap
  * -----------------------
  * This is the hook for your heap consistency checker. Returns true
@@ -57,4 +111,17 @@ void myfree(void *ptr);
  */
 bool validate_heap(void);
 
+
+/* Function: heap_snapshot
+ * -----------------------
+ * Writes a binary snapshot of the heap's block map (the offset, size and
+ * status of every block, see heap_snapshot.h) to the file descriptor fd,
+ * for offline analysis with heapsnap. Returns false if writing fails.
+ */
+bool heap_snapshot(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
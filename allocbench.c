@@ -0,0 +1,955 @@
+/*
+ * File: allocbench.c
+ * ------------------
+ * Runs the same scripts through several allocators in one process and
+ * compares their throughput and utilization side by side.
+ *
+ *     allocbench [-n trials] [-a name,name,...] [-j out.json] [-b baseline.json] [-t] script...
+ *
+ * The allocators all export the same mymalloc family, so each one is built
+ * into its own bench_<name>.so and loaded with dlopen, and every allocator
+ * is driven through an allocator_ops table of function pointers. Next to
+ * the allocators in this repo, the table is also filled in for the system
+ * malloc (glibc) and for jemalloc when libjemalloc.so.2 can be loaded.
+ *
+ * Each script is replayed trials times per allocator and the fastest trial
+ * is reported. Payloads are not written or checked, so only the allocator's
+ * own work is timed (test_harness checks correctness). Utilization is peak
+ * payload over the heap's footprint at that point: the extent of the heap
+ * segment used for the allocators in this repo, and the arena and mmapped
+ * bytes mallinfo2 reports for glibc. jemalloc's is not measured. One more
+ * replay times every request on its own for latency percentiles; those
+ * include the ~20 ns a clock read costs, so it is kept apart from the
+ * trials.
+ *
+ * -j writes every trial, the percentiles and the utilization as JSON. -b
+ * reads such a file back as a baseline and flags each allocator and script
+ * that now fails or whose utilization dropped, and then exits with status 1.
+ * Only utilization measured on the heap segment counts: glibc's varies from
+ * run to run with the state mallinfo2 sees. Throughput changes that are
+ * significant (Welch's t-test over the trials) are shown, but on a shared
+ * machine the whole run can drift by tens of percent, so they only fail
+ * the comparison with -t and at least MIN_GATED_TRIALS trials on both
+ * sides. "make bench" runs the corpus in bench/ this way.
+ */
+
+#define _GNU_SOURCE // for aligned_alloc under -std=gnu99
+#include <dlfcn.h>
+#include <error.h>
+#include <getopt.h>
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "allocator.h"
+
+
+/* TYPE DECLARATIONS */
+
+
+// most trials a run (and so a baseline) can have
+#define MAX_TRIALS 100
+
+
+// one request of a script, in the same format test_harness reads
+enum request_type {
+    ALLOC = 1,
+    FREE,
+    REALLOC,
+    ALIGNED_ALLOC,
+    CALLOC
+};
+typedef struct {
+    enum request_type op;
+    int id;
+    size_t size;
+    size_t alignment;
+    char lifetime;      // 's' or 'l' for a hinted alloc, else 0
+} request_t;
+
+typedef struct {
+    char name[128];
+    request_t *ops;
+    int num_ops;
+    int num_ids;
+    size_t peak_size;   // payload bytes in use at the peak
+    int peak_req;       // request after which the peak is reached
+} script_t;
+
+// function table through which an allocator is driven
+typedef struct {
+    const char *name;
+    void *handle;       // from dlopen, NULL for the system malloc
+
+    void *(*malloc)(size_t size);
+    void *(*calloc)(size_t nmemb, size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*aligned_alloc)(size_t alignment, size_t size);
+    void (*free)(void *ptr);
+
+    // only for the allocators in this repo, which run on a heap segment (hinted allocs go to malloc for the others)
+    void *(*malloc_hint)(size_t size, lifetime_t lifetime);
+    void *(*init_heap_segment)(size_t total_size);
+    void *(*heap_segment_start)(void);
+    size_t (*heap_segment_size)(void);
+    bool (*myinit)(void *heap_start, size_t heap_size);
+
+    // how the footprint is measured, see measure_footprint
+    enum { FOOTPRINT_SEGMENT, FOOTPRINT_MALLINFO, FOOTPRINT_NONE } footprint;
+} allocator_ops;
+
+// latency percentiles of single requests, in nanoseconds
+typedef struct {
+    uint64_t p50, p90, p99, p999, max;
+} latency_t;
+
+// result of running one script through one allocator
+typedef struct {
+    bool ok;
+    double seconds;         // fastest trial
+    double *trial_seconds;  // every trial, in order
+    int trials;
+    latency_t latency;
+    size_t footprint;       // bytes of heap in use at the script's peak, 0 if unknown
+} result_t;
+
+// result read back from a baseline file, see read_baseline
+typedef struct {
+    char allocator[32];
+    char script[128];
+    double ops_per_sec[MAX_TRIALS];
+    int trials;
+    double utilization;     // negative if not measured
+} baseline_t;
+
+// a trial replays its script for at least this long
+#define MIN_TRIAL_SECONDS 0.05
+
+// a throughput change counts when it is at least this large and this unlikely to be noise
+#define MIN_CHANGE 0.05
+#define SIGNIFICANCE 0.01
+
+// fewer trials than this on either side never fail the comparison, even with -t
+#define MIN_GATED_TRIALS 5
+
+// a drop in utilization of more than this many points counts
+#define MAX_UTIL_DROP 0.01
+
+// allocators in this repo, each loaded from bench_<name>.so
+static const char *const REPO_ALLOCATORS[] = { "bump", "implicit", "explicit", "outofband" };
+
+#define MAX_ALLOCATORS 8
+
+const size_t HEAP_SIZE = 1UL << 32;
+
+const int MAX_SCRIPT_LINE_LEN = 1024;
+
+
+/* FUNCTION PROTOTYPES */
+
+
+static bool load_repo_allocator(allocator_ops *ops, const char *name, const char *dir);
+static void load_system_allocator(allocator_ops *ops);
+static bool load_jemalloc(allocator_ops *ops);
+static bool selected(const char *name, const char *list);
+static script_t parse_script(const char *path);
+static result_t run_script(const allocator_ops *ops, const script_t *script, int trials);
+static bool start_trial(const allocator_ops *ops, void **blocks, const script_t *script);
+static void end_trial(const allocator_ops *ops, void **blocks, const script_t *script);
+static bool replay(const allocator_ops *ops, const script_t *script, void **blocks, size_t *footprint,
+    uint64_t *latencies);
+static size_t measure_footprint(const allocator_ops *ops, void *heap_end, size_t base);
+static size_t base_footprint(const allocator_ops *ops);
+static double now(void);
+static uint64_t now_ns(void);
+static latency_t percentiles(uint64_t *latencies, int count);
+static double mean(const double *values, int count);
+static double variance(const double *values, int count);
+static double welch_p_value(const double *a, int na, const double *b, int nb);
+static double incomplete_beta(double a, double b, double x);
+static void write_json(const char *path, const allocator_ops *allocators, int num_allocators,
+    const script_t *scripts, int num_scripts, const result_t *results);
+static int read_baseline(const char *path, baseline_t **baselines);
+static int compare_baseline(const char *path, const allocator_ops *allocators, int num_allocators,
+    const script_t *scripts, int num_scripts, const result_t *results, bool gate_throughput);
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    int trials = 3;
+    const char *only = NULL;
+    const char *json_path = NULL;
+    const char *baseline_path = NULL;
+    bool gate_throughput = false;
+    while ((c = getopt(argc, argv, "n:a:j:b:t")) != EOF) {
+        if (c == 'n') {
+            trials = atoi(optarg);
+        } else if (c == 'a') {
+            only = optarg;
+        } else if (c == 'j') {
+            json_path = optarg;
+        } else if (c == 'b') {
+            baseline_path = optarg;
+        } else if (c == 't') {
+            gate_throughput = true;
+        }
+    }
+    if (optind >= argc || trials <= 0 || trials > MAX_TRIALS) {
+        error(1, 0, "Usage: allocbench [-n trials] [-a name,name,...] [-j out.json] [-b baseline.json] [-t] script...");
+    }
+
+    // the bench_<name>.so libraries are looked for next to this program
+    char dir[PATH_MAX] = ".";
+    const char *slash = strrchr(argv[0], '/');
+    if (slash != NULL) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - argv[0]), argv[0]);
+    }
+
+    allocator_ops allocators[MAX_ALLOCATORS];
+    int num_allocators = 0;
+    for (size_t i = 0; i < sizeof(REPO_ALLOCATORS) / sizeof(REPO_ALLOCATORS[0]); i++) {
+        if (selected(REPO_ALLOCATORS[i], only) &&
+            load_repo_allocator(&allocators[num_allocators], REPO_ALLOCATORS[i], dir)) {
+            num_allocators++;
+        }
+    }
+    if (selected("glibc", only)) {
+        load_system_allocator(&allocators[num_allocators++]);
+    }
+    if (selected("jemalloc", only) && load_jemalloc(&allocators[num_allocators])) {
+        num_allocators++;
+    }
+    if (num_allocators == 0) {
+        error(1, 0, "No allocators to run.");
+    }
+
+    int num_scripts = argc - optind;
+    script_t *scripts = malloc(num_scripts * sizeof(script_t));
+    for (int i = 0; i < num_scripts; i++) {
+        scripts[i] = parse_script(argv[optind + i]);
+    }
+
+    result_t *results = calloc(num_scripts, num_allocators * sizeof(result_t));
+
+    printf("%-22s %-10s %10s %12s %8s %8s %6s\n", "script", "allocator", "ops", "Kops/s", "p50 ns", "p99 ns", "util");
+    for (int a = 0; a < num_allocators; a++) {
+        long total_ops = 0;
+        double total_seconds = 0;
+        int total_util = 0, num_util = 0;
+        bool all_ok = true;
+
+        for (int i = 0; i < num_scripts; i++) {
+            result_t result = run_script(&allocators[a], &scripts[i], trials);
+            results[a * num_scripts + i] = result;
+            if (!result.ok) {
+                printf("%-22s %-10s %10d %12s %8s %8s %6s\n", scripts[i].name, allocators[a].name,
+                    scripts[i].num_ops, "failed", "-", "-", "-");
+                all_ok = false;
+                continue;
+            }
+
+            char util[16] = "-";
+            if (result.footprint > 0) {
+                int percent = (int)(100 * scripts[i].peak_size / result.footprint);
+                snprintf(util, sizeof(util), "%d%%", percent);
+                total_util += percent;
+                num_util++;
+            }
+            printf("%-22s %-10s %10d %12.0f %8lu %8lu %6s\n", scripts[i].name, allocators[a].name,
+                scripts[i].num_ops, scripts[i].num_ops / result.seconds / 1000,
+                result.latency.p50, result.latency.p99, util);
+            total_ops += scripts[i].num_ops;
+            total_seconds += result.seconds;
+        }
+
+        // totals only cover the scripts the allocator got through
+        char util[16] = "-";
+        if (num_util > 0) {
+            snprintf(util, sizeof(util), "%d%%", total_util / num_util);
+        }
+        printf("%-22s %-10s %10ld %12.0f %8s %8s %6s%s\n\n", "TOTAL", allocators[a].name, total_ops,
+            total_seconds > 0 ? total_ops / total_seconds / 1000 : 0, "", "", util,
+            all_ok ? "" : "  (some scripts failed)");
+    }
+
+    if (json_path != NULL) {
+        write_json(json_path, allocators, num_allocators, scripts, num_scripts, results);
+    }
+    int regressions = 0;
+    if (baseline_path != NULL) {
+        regressions = compare_baseline(baseline_path, allocators, num_allocators, scripts, num_scripts, results,
+            gate_throughput);
+    }
+
+    for (int i = 0; i < num_allocators * num_scripts; i++) {
+        free(results[i].trial_seconds);
+    }
+    free(results);
+
+    for (int i = 0; i < num_scripts; i++) {
+        free(scripts[i].ops);
+    }
+    free(scripts);
+    return regressions > 0;
+}
+
+
+/* ALLOCATOR LOADING */
+
+
+/* Function: load_repo_allocator
+ * -----------------------------
+ * Loads dir/bench_<name>.so and looks up its entry points. The library is
+ * opened RTLD_LOCAL and linked -Bsymbolic, so its symbols never resolve to
+ * another allocator's. Returns false (with a warning) if it can't be loaded.
+ */
+static bool load_repo_allocator(allocator_ops *ops, const char *name, const char *dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/bench_%s.so", dir, name);
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        fprintf(stderr, "allocbench: skipping %s: %s\n", name, dlerror());
+        return false;
+    }
+
+    *ops = (allocator_ops){
+        .name = name,
+        .handle = handle,
+        .malloc = dlsym(handle, "mymalloc"),
+        .calloc = dlsym(handle, "mycalloc"),
+        .realloc = dlsym(handle, "myrealloc"),
+        .aligned_alloc = dlsym(handle, "myaligned_alloc"),
+        .free = dlsym(handle, "myfree"),
+        .malloc_hint = dlsym(handle, "mymalloc_hint"),
+        .init_heap_segment = dlsym(handle, "init_heap_segment"),
+        .heap_segment_start = dlsym(handle, "heap_segment_start"),
+        .heap_segment_size = dlsym(handle, "heap_segment_size"),
+        .myinit = dlsym(handle, "myinit"),
+        .footprint = FOOTPRINT_SEGMENT,
+    };
+    if (!ops->malloc || !ops->calloc || !ops->realloc || !ops->aligned_alloc || !ops->free ||
+        !ops->malloc_hint || !ops->init_heap_segment || !ops->heap_segment_start || !ops->heap_segment_size || !ops->myinit) {
+        fprintf(stderr, "allocbench: skipping %s: %s is missing part of the allocator interface\n", name, path);
+        dlclose(handle);
+        return false;
+    }
+    return true;
+}
+
+static void load_system_allocator(allocator_ops *ops) {
+    *ops = (allocator_ops){
+        .name = "glibc",
+        .malloc = malloc,
+        .calloc = calloc,
+        .realloc = realloc,
+        .aligned_alloc = aligned_alloc,
+        .free = free,
+        .footprint = FOOTPRINT_MALLINFO,
+    };
+}
+
+/* Function: load_jemalloc
+ * -----------------------
+ * jemalloc exports the unprefixed malloc family, which dlsym finds in its
+ * own handle rather than glibc's. Returns false if it isn't installed.
+ */
+static bool load_jemalloc(allocator_ops *ops) {
+    void *handle = dlopen("libjemalloc.so.2", RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        return false;
+    }
+
+    *ops = (allocator_ops){
+        .name = "jemalloc",
+        .handle = handle,
+        .malloc = dlsym(handle, "malloc"),
+        .calloc = dlsym(handle, "calloc"),
+        .realloc = dlsym(handle, "realloc"),
+        .aligned_alloc = dlsym(handle, "aligned_alloc"),
+        .free = dlsym(handle, "free"),
+        .footprint = FOOTPRINT_NONE,
+    };
+    if (!ops->malloc || !ops->calloc || !ops->realloc || !ops->aligned_alloc || !ops->free) {
+        dlclose(handle);
+        return false;
+    }
+    return true;
+}
+
+// whether name is on the comma-separated list (everything is, without a list)
+static bool selected(const char *name, const char *list) {
+    if (list == NULL) {
+        return true;
+    }
+    size_t len = strlen(name);
+    for (const char *cur = list; cur != NULL; cur = strchr(cur, ',') ? strchr(cur, ',') + 1 : NULL) {
+        if (strncmp(cur, name, len) == 0 && (cur[len] == ',' || cur[len] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* REPLAY */
+
+
+/* Function: run_script
+ * --------------------
+ * Replays the script trials times on a fresh heap each time, keeping the
+ * time per replay of every trial, and then once more timing each request for the
+ * latency percentiles. Fails if the allocator ever returns NULL.
+ */
+static result_t run_script(const allocator_ops *ops, const script_t *script, int trials) {
+    result_t result = { .ok = false, .trial_seconds = calloc(trials, sizeof(double)) };
+    void **blocks = calloc(script->num_ids, sizeof(void *));
+    uint64_t *latencies = malloc(script->num_ops * sizeof(uint64_t));
+
+    for (int trial = 0; trial <= trials; trial++) {
+        // the last replay is the one timed request by request
+        bool timing_requests = trial == trials;
+
+        // a trial replays a short script until it has run for MIN_TRIAL_SECONDS, so it isn't mostly timer noise
+        size_t footprint = 0;
+        double seconds = 0;
+        int replays = 0;
+        bool ok;
+        do {
+            ok = start_trial(ops, blocks, script);
+            if (!ok) {
+                break;
+            }
+            double start = now();
+            ok = replay(ops, script, blocks, &footprint, timing_requests ? latencies : NULL);
+            seconds += now() - start;
+            end_trial(ops, blocks, script);
+            replays++;
+        } while (ok && !timing_requests && seconds < MIN_TRIAL_SECONDS);
+        if (!ok) {
+            result.ok = false;
+            break;
+        }
+        seconds /= replays;
+
+        if (timing_requests) {
+            result.latency = percentiles(latencies, script->num_ops);
+            break;
+        }
+        result.trial_seconds[result.trials++] = seconds;
+        if (!result.ok || seconds < result.seconds) {
+            result.seconds = seconds;
+        }
+        result.footprint = footprint;
+        result.ok = true;
+    }
+
+    free(latencies);
+    free(blocks);
+    return result;
+}
+
+// sets up a fresh heap (for the allocators in this repo) and forgets the blocks of the last trial
+static bool start_trial(const allocator_ops *ops, void **blocks, const script_t *script) {
+    memset(blocks, 0, script->num_ids * sizeof(void *));
+    if (ops->init_heap_segment == NULL) {
+        return true;
+    }
+    return ops->init_heap_segment(HEAP_SIZE) != NULL &&
+        ops->myinit(ops->heap_segment_start(), ops->heap_segment_size());
+}
+
+// hands back whatever the script left allocated, unless the next trial starts a fresh heap anyway
+static void end_trial(const allocator_ops *ops, void **blocks, const script_t *script) {
+    if (ops->init_heap_segment == NULL) {
+        for (int id = 0; id < script->num_ids; id++) {
+            ops->free(blocks[id]);
+        }
+    }
+}
+
+/* Function: replay
+ * ----------------
+ * Sends each request of the script to the allocator, keeping the blocks it
+ * returns by id. The footprint is measured right after the peak request.
+ * With latencies, the time each request takes is stored in it.
+ */
+static bool replay(const allocator_ops *ops, const script_t *script, void **blocks, size_t *footprint,
+    uint64_t *latencies) {
+    void *heap_end = NULL;
+    size_t base = base_footprint(ops);
+
+    for (int req = 0; req < script->num_ops; req++) {
+        const request_t *request = &script->ops[req];
+        void *p = NULL;
+
+        uint64_t start = latencies != NULL ? now_ns() : 0;
+        switch (request->op) {
+        case ALLOC:
+            if (request->lifetime && ops->malloc_hint != NULL) {
+                p = ops->malloc_hint(request->size, request->lifetime == 's' ? LIFETIME_SHORT : LIFETIME_LONG);
+            } else {
+                p = ops->malloc(request->size);
+            }
+            break;
+        case CALLOC:
+            p = ops->calloc(request->size, 1);
+            break;
+        case ALIGNED_ALLOC:
+            p = ops->aligned_alloc(request->alignment, request->size);
+            break;
+        case REALLOC:
+            p = ops->realloc(blocks[request->id], request->size);
+            break;
+        case FREE:
+            ops->free(blocks[request->id]);
+            break;
+        }
+        if (latencies != NULL) {
+            latencies[req] = now_ns() - start;
+        }
+
+        if (request->op != FREE) {
+            if (p == NULL && request->size != 0) {
+                return false;
+            }
+            if ((char *)p + request->size > (char *)heap_end) {
+                heap_end = (char *)p + request->size;
+            }
+        }
+        blocks[request->id] = p;
+
+        if (req == script->peak_req) {
+            *footprint = measure_footprint(ops, heap_end, base);
+        }
+    }
+    return true;
+}
+
+/* Function: measure_footprint
+ * ---------------------------
+ * Returns how many bytes of heap the allocator is using: up to heap_end of
+ * the heap segment, or for glibc the arena and mmapped bytes mallinfo2
+ * reports, less base for the bench's own allocations. Returns 0 where it
+ * isn't known.
+ */
+static size_t measure_footprint(const allocator_ops *ops, void *heap_end, size_t base) {
+    if (ops->footprint == FOOTPRINT_SEGMENT) {
+        return heap_end == NULL ? 0 : (char *)heap_end - (char *)ops->heap_segment_start();
+    } else if (ops->footprint == FOOTPRINT_MALLINFO) {
+        struct mallinfo2 info = mallinfo2();
+        size_t total = info.arena + info.hblkhd;
+        return total > base ? total - base : 0;
+    }
+    return 0;
+}
+
+/* Function: base_footprint
+ * ------------------------
+ * For glibc, hands the free memory earlier runs left behind back to the OS
+ * and returns the bytes the bench itself still has allocated, which
+ * measure_footprint leaves out.
+ */
+static size_t base_footprint(const allocator_ops *ops) {
+    if (ops->footprint != FOOTPRINT_MALLINFO) {
+        return 0;
+    }
+    malloc_trim(0);
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* STATISTICS */
+
+
+static int compare_latencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// sorts the latencies in place to pick out the percentiles
+static latency_t percentiles(uint64_t *latencies, int count) {
+    if (count == 0) {
+        return (latency_t){ 0 };
+    }
+    qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+    return (latency_t){
+        .p50 = latencies[count / 2],
+        .p90 = latencies[(int)(count * 0.9)],
+        .p99 = latencies[(int)(count * 0.99)],
+        .p999 = latencies[(int)(count * 0.999)],
+        .max = latencies[count - 1],
+    };
+}
+
+static double mean(const double *values, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += values[i];
+    }
+    return count > 0 ? sum / count : 0;
+}
+
+// sample variance
+static double variance(const double *values, int count) {
+    double avg = mean(values, count), sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += (values[i] - avg) * (values[i] - avg);
+    }
+    return count > 1 ? sum / (count - 1) : 0;
+}
+
+/* Function: welch_p_value
+ * -----------------------
+ * Two-sided p-value of Welch's t-test for the means of a and b, which don't
+ * need equal variances. It takes at least two samples on each side, so with
+ * fewer the difference is never significant (1 is returned).
+ */
+static double welch_p_value(const double *a, int na, const double *b, int nb) {
+    if (na < 2 || nb < 2) {
+        return 1;
+    }
+    double va = variance(a, na) / na;
+    double vb = variance(b, nb) / nb;
+    double diff = mean(a, na) - mean(b, nb);
+    if (va + vb <= 0) {
+        return fabs(diff) > 0 ? 0 : 1;
+    }
+
+    double t = diff / sqrt(va + vb);
+    double df = (va + vb) * (va + vb) / (va * va / (na - 1) + vb * vb / (nb - 1));
+
+    // the tails of Student's t beyond |t| are the regularized incomplete beta at df/(df + t^2)
+    return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+/* Function: incomplete_beta
+ * -------------------------
+ * Regularized incomplete beta function I_x(a, b), from its continued
+ * fraction evaluated with Lentz's method. The fraction converges quickly
+ * for x below (a + 1) / (a + b + 2); above it, I_x(a, b) = 1 - I_1-x(b, a).
+ */
+static double incomplete_beta(double a, double b, double x) {
+    if (x <= 0 || x >= 1) {
+        return x <= 0 ? 0 : 1;
+    }
+    if (x > (a + 1) / (a + b + 2)) {
+        return 1 - incomplete_beta(b, a, 1 - x);
+    }
+
+    const double tiny = 1e-30;
+    double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1 - x)) / a;
+    double f = 1, c = 1, d = 0;
+    for (int i = 0; i <= 300; i++) {
+        int m = i / 2;
+        double numerator;
+        if (i == 0) {
+            numerator = 1;
+        } else if (i % 2 == 0) {
+            numerator = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+        } else {
+            numerator = -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+        }
+
+        d = 1 + numerator * d;
+        d = 1 / (fabs(d) < tiny ? tiny : d);
+        c = 1 + numerator / c;
+        c = fabs(c) < tiny ? tiny : c;
+        f *= c * d;
+        if (fabs(1 - c * d) < 1e-12) {
+            break;
+        }
+    }
+    return front * (f - 1);
+}
+
+
+/* RESULTS FILES */
+
+
+/* Function: write_json
+ * --------------------
+ * Writes the results out as JSON, one result per line so read_baseline can
+ * pick them back up without a JSON parser:
+ *
+ *     {"trials": 5, "results": [
+ *       {"allocator": "explicit", "script": "churn.script", "ops": 31156, "ok": true,
+ *        "ops_per_sec": [...], "mean_ops_per_sec": ..., "latency_ns": {"p50": ..., ...},
+ *        "utilization": 0.50},
+ *       ...
+ *     ]}
+ *
+ * Utilization is null where it isn't measured.
+ */
+static void write_json(const char *path, const allocator_ops *allocators, int num_allocators,
+    const script_t *scripts, int num_scripts, const result_t *results) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        error(1, 0, "Could not write results to \"%s\".", path);
+    }
+
+    int trials = 0;
+    for (int i = 0; i < num_allocators * num_scripts; i++) {
+        if (results[i].trials > trials) {
+            trials = results[i].trials;
+        }
+    }
+
+    fprintf(fp, "{\"trials\": %d, \"results\": [\n", trials);
+    for (int a = 0; a < num_allocators; a++) {
+        for (int i = 0; i < num_scripts; i++) {
+            const result_t *result = &results[a * num_scripts + i];
+            fprintf(fp, "  {\"allocator\": \"%s\", \"script\": \"%s\", \"ops\": %d, \"ok\": %s, \"ops_per_sec\": [",
+                allocators[a].name, scripts[i].name, scripts[i].num_ops, result->ok ? "true" : "false");
+
+            double ops_per_sec[MAX_TRIALS];
+            for (int t = 0; t < result->trials; t++) {
+                ops_per_sec[t] = scripts[i].num_ops / result->trial_seconds[t];
+                fprintf(fp, "%s%.0f", t > 0 ? ", " : "", ops_per_sec[t]);
+            }
+            fprintf(fp, "], \"mean_ops_per_sec\": %.0f, ", mean(ops_per_sec, result->trials));
+            fprintf(fp, "\"latency_ns\": {\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}, ",
+                result->latency.p50, result->latency.p90, result->latency.p99, result->latency.p999,
+                result->latency.max);
+            if (result->ok && result->footprint > 0) {
+                fprintf(fp, "\"utilization\": %.4f}", (double)scripts[i].peak_size / result->footprint);
+            } else {
+                fprintf(fp, "\"utilization\": null}");
+            }
+            fprintf(fp, "%s\n", a == num_allocators - 1 && i == num_scripts - 1 ? "" : ",");
+        }
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+}
+
+/* Function: read_baseline
+ * -----------------------
+ * Reads the results in a file written by write_json into a new array, and
+ * returns how many there are. Only the lines write_json writes are
+ * understood; results that failed come back with no trials.
+ */
+static int read_baseline(const char *path, baseline_t **baselines) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        error(1, 0, "Could not open baseline \"%s\".", path);
+    }
+
+    int count = 0, nallocated = 0;
+    *baselines = NULL;
+    char line[16384];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        baseline_t baseline = { .trials = 0, .utilization = -1 };
+        const char *allocator = strstr(line, "\"allocator\": \"");
+        const char *script = strstr(line, "\"script\": \"");
+        if (allocator == NULL || script == NULL ||
+            sscanf(allocator, "\"allocator\": \"%31[^\"]", baseline.allocator) != 1 ||
+            sscanf(script, "\"script\": \"%127[^\"]", baseline.script) != 1) {
+            continue;
+        }
+
+        const char *cur = strstr(line, "\"ops_per_sec\": [");
+        if (cur != NULL && strstr(line, "\"ok\": true") != NULL) {
+            cur += strlen("\"ops_per_sec\": [");
+            char *end;
+            while (baseline.trials < MAX_TRIALS) {
+                double value = strtod(cur, &end);
+                if (end == cur) {
+                    break;
+                }
+                baseline.ops_per_sec[baseline.trials++] = value;
+                cur = end + strspn(end, ", ");
+            }
+        }
+        const char *util = strstr(line, "\"utilization\": ");
+        if (util != NULL && strncmp(util + strlen("\"utilization\": "), "null", 4) != 0) {
+            baseline.utilization = strtod(util + strlen("\"utilization\": "), NULL);
+        }
+
+        if (count == nallocated) {
+            nallocated = nallocated ? nallocated * 2 : 16;
+            *baselines = realloc(*baselines, nallocated * sizeof(baseline_t));
+        }
+        (*baselines)[count++] = baseline;
+    }
+    fclose(fp);
+    return count;
+}
+
+/* Function: compare_baseline
+ * --------------------------
+ * Prints how each result compares with the same allocator and script in the
+ * baseline at path, and returns how many regressed. A result regresses if
+ * it now fails or if its utilization on the heap segment dropped by more
+ * than MAX_UTIL_DROP. A change in mean throughput of at least MIN_CHANGE
+ * with p below SIGNIFICANCE is pointed out; a slowdown only regresses with
+ * gate_throughput and at least MIN_GATED_TRIALS trials on both sides.
+ */
+static int compare_baseline(const char *path, const allocator_ops *allocators, int num_allocators,
+    const script_t *scripts, int num_scripts, const result_t *results, bool gate_throughput) {
+    baseline_t *baselines;
+    int num_baselines = read_baseline(path, &baselines);
+    int regressions = 0;
+
+    printf("Compared with %s:\n", path);
+    printf("%-22s %-10s %12s %12s %8s %8s %13s\n", "script", "allocator", "base Kops/s", "Kops/s",
+        "change", "p", "util");
+    for (int a = 0; a < num_allocators; a++) {
+        for (int i = 0; i < num_scripts; i++) {
+            const result_t *result = &results[a * num_scripts + i];
+            const baseline_t *baseline = NULL;
+            for (int b = 0; b < num_baselines; b++) {
+                if (strcmp(baselines[b].allocator, allocators[a].name) == 0 &&
+                    strcmp(baselines[b].script, scripts[i].name) == 0) {
+                    baseline = &baselines[b];
+                }
+            }
+            if (baseline == NULL || baseline->trials == 0) {
+                continue;
+            }
+            if (!result->ok) {
+                printf("%-22s %-10s %12s %12s %8s %8s %13s  REGRESSION\n", scripts[i].name,
+                    allocators[a].name, "", "failed", "", "", "");
+                regressions++;
+                continue;
+            }
+
+            double ops_per_sec[MAX_TRIALS];
+            for (int t = 0; t < result->trials; t++) {
+                ops_per_sec[t] = scripts[i].num_ops / result->trial_seconds[t];
+            }
+            double before = mean(baseline->ops_per_sec, baseline->trials);
+            double after = mean(ops_per_sec, result->trials);
+            double change = (after - before) / before;
+            double p = welch_p_value(ops_per_sec, result->trials, baseline->ops_per_sec, baseline->trials);
+            bool significant = p < SIGNIFICANCE && fabs(change) >= MIN_CHANGE;
+            bool gated = gate_throughput && result->trials >= MIN_GATED_TRIALS &&
+                baseline->trials >= MIN_GATED_TRIALS;
+
+            char util[32] = "-";
+            bool util_dropped = false;
+            if (baseline->utilization >= 0 && result->footprint > 0) {
+                double now_util = (double)scripts[i].peak_size / result->footprint;
+                snprintf(util, sizeof(util), "%.0f%% -> %.0f%%", 100 * baseline->utilization, 100 * now_util);
+                util_dropped = allocators[a].footprint == FOOTPRINT_SEGMENT &&
+                    now_util < baseline->utilization - MAX_UTIL_DROP;
+            }
+
+            const char *verdict = "";
+            if ((significant && change < 0 && gated) || util_dropped) {
+                verdict = "  REGRESSION";
+                regressions++;
+            } else if (significant && change < 0) {
+                verdict = "  slower";
+            } else if (significant) {
+                verdict = "  improved";
+            }
+            printf("%-22s %-10s %12.0f %12.0f %+7.1f%% %8.3f %13s%s\n", scripts[i].name, allocators[a].name,
+                before / 1000, after / 1000, 100 * change, p, util, verdict);
+        }
+    }
+    printf("%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+
+    free(baselines);
+    return regressions;
+}
+
+
+/* SCRIPT PARSING */
+
+
+/* Function: parse_script
+ * ----------------------
+ * Reads a script in test_harness's format (a/c/m/r/f requests, lifetime hints, # comments)
+ * and finds the request after which the most payload is in use.
+ */
+static script_t parse_script(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        error(1, 0, "Could not open script file \"%s\".", path);
+    }
+
+    script_t script = { .ops = NULL, .num_ops = 0, .peak_req = -1 };
+    const char *basename = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    snprintf(script.name, sizeof(script.name), "%s", basename);
+
+    int nallocated = 0;
+    int maxid = 0;
+    int lineno = 0;
+    char buffer[MAX_SCRIPT_LINE_LEN];
+    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+        lineno++;
+        char ch;
+        if (sscanf(buffer, " %c", &ch) != 1 || ch == '#') {
+            continue;
+        }
+
+        request_t request = { .op = 0, .size = 0, .alignment = 0 };
+        int nscanned = sscanf(buffer, " %c %d %zu %zu", &ch, &request.id, &request.size, &request.alignment);
+        if (ch == 'a' && nscanned == 3) {
+            request.op = ALLOC;
+            if (sscanf(buffer, " %*c %*d %*s %c", &request.lifetime) == 1 &&
+                request.lifetime != 's' && request.lifetime != 'l') {
+                request.op = 0;
+            }
+        } else if (ch == 'm' && nscanned == 4) {
+            request.op = ALIGNED_ALLOC;
+        } else if (ch == 'c' && nscanned == 3) {
+            request.op = CALLOC;
+        } else if (ch == 'r' && nscanned == 3) {
+            request.op = REALLOC;
+        } else if (ch == 'f' && nscanned == 2) {
+            request.op = FREE;
+        }
+        if (!request.op || request.id < 0) {
+            error(1, 0, "Line %d of script file '%s' is malformed.", lineno, script.name);
+        }
+
+        if (script.num_ops == nallocated) {
+            nallocated = nallocated ? nallocated * 2 : 1024;
+            script.ops = realloc(script.ops, nallocated * sizeof(request_t));
+            if (script.ops == NULL) {
+                error(1, 0, "Libc heap exhausted. Cannot continue.");
+            }
+        }
+        script.ops[script.num_ops++] = request;
+        if (request.id > maxid) {
+            maxid = request.id;
+        }
+    }
+    fclose(fp);
+    script.num_ids = maxid + 1;
+
+    // replay the sizes to find the peak
+    size_t *sizes = calloc(script.num_ids, sizeof(size_t));
+    size_t cur_size = 0;
+    for (int req = 0; req < script.num_ops; req++) {
+        int id = script.ops[req].id;
+        cur_size -= sizes[id];
+        sizes[id] = script.ops[req].op == FREE ? 0 : script.ops[req].size;
+        cur_size += sizes[id];
+        if (cur_size > script.peak_size) {
+            script.peak_size = cur_size;
+            script.peak_req = req;
+        }
+    }
+    free(sizes);
+    return script;
+}
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+# Regenerates the workload corpus in bench/ that "make bench" replays. The seeds are fixed,
+# so running it again reproduces the committed scripts byte for byte; change a seed or a
+# parameter only together with a new baseline (make bench-baseline).
+import os, random
+DIR = os.path.dirname(os.path.abspath(__file__))
+def write(name, header, out):
+    open(os.path.join(DIR, name),"w").write("".join("# "+h+"\n" for h in header)+"\n".join(out)+"\n")
+
+# small-object churn: a working set of ~2000 small blocks, constantly replaced
+r=random.Random(41); out=[]; live=[]; nid=0
+for i in range(30000):
+    if len(live) > 2000 or (live and r.random() < 0.48):
+        k=live.pop(r.randrange(len(live))); out.append(f"f {k}")
+    else:
+        s=r.choice([8,16,24,32,48,64,96,128,r.randint(1,256)])
+        out.append(f"{'c' if r.random()<0.1 else 'a'} {nid} {s}"); live.append(nid); nid+=1
+for k in live: out.append(f"f {k}")
+write("churn.script", ["small-object churn: ~2000 live blocks of 1-256 bytes, constantly replaced"], out)
+
+# realloc chains: buffers grown a step at a time (vectors, strings), then released
+r=random.Random(42); out=[]; nid=0
+for chain in range(30):
+    bufs={}
+    for b in range(4):
+        bufs[nid]=r.randint(1,64); out.append(f"a {nid} {bufs[nid]}"); nid+=1
+    steps=r.randint(50,200)
+    for s in range(steps):
+        k=r.choice(list(bufs))
+        if r.random()<0.05:
+            bufs[k]=max(1,bufs[k]//2)
+        else:
+            bufs[k]=min(bufs[k]+r.randint(1,bufs[k]//4+64), 1<<18)
+        out.append(f"r {k} {bufs[k]}")
+        if r.random()<0.3:
+            out.append(f"a {nid} {r.randint(16,128)}"); out.append(f"f {nid}") if r.random()<0.5 else None; nid+=1
+    for k in bufs: out.append(f"f {k}")
+out=[o for o in out if o]
+# the small blocks left allocated by the chains stay until the end
+ids=set(); freed=set()
+for o in out:
+    p=o.split()
+    if p[0]=='a': ids.add(int(p[1]))
+    if p[0]=='f': freed.add(int(p[1]))
+for k in sorted(ids-freed): out.append(f"f {k}")
+write("realloc_chains.script", ["realloc chains: buffers grown a little at a time up to 256 KiB between small allocations"], out)
+
+# fragmentation stress: fill with mixed sizes, free every other block, then ask for bigger ones
+r=random.Random(43); out=[]; nid=0; live=[]
+for rnd in range(6):
+    batch=[]
+    for i in range(2500):
+        s=r.choice([r.randint(16,128), r.randint(128,1024)])
+        out.append(f"a {nid} {s}"); batch.append(nid); nid+=1
+    for i,k in enumerate(batch):
+        if i%2==0: out.append(f"f {k}")
+        else: live.append(k)
+    for i in range(600):
+        out.append(f"a {nid} {r.randint(1024,8192)}"); live.append(nid); nid+=1
+    r.shuffle(live)
+    for k in live[:len(live)//3]: out.append(f"f {k}")
+    live=live[len(live)//3:]
+for k in live: out.append(f"f {k}")
+write("fragmentation.script", ["fragmentation stress: mixed sizes with every other block freed, then larger requests"], out)
+
+# phase-based: per-request phases allocate and then drop everything, while a few long-lived blocks accumulate
+r=random.Random(44); out=[]; nid=0; longlived=[]
+for phase in range(40):
+    scratch=[]
+    for i in range(r.randint(200,800)):
+        s=r.choice([r.randint(8,64)]*3+[r.randint(64,4096)])
+        out.append(f"a {nid} {s}"); scratch.append(nid); nid+=1
+        if r.random()<0.02:
+            out.append(f"a {nid} {r.randint(32,512)}"); longlived.append(nid); nid+=1
+    for k in reversed(scratch): out.append(f"f {k}")
+    if len(longlived)>200:
+        for k in longlived[:50]: out.append(f"f {k}")
+        longlived=longlived[50:]
+for k in longlived: out.append(f"f {k}")
+write("phases.script", ["phase-based: request phases that free everything they allocated, next to slowly turning over long-lived blocks"], out)
+
+# lifetime hints: short-lived temporaries between a trickle of long-lived blocks, most kept to the end
+r=random.Random(3); out=[]; live={}; nid=0; short=[]
+for step in range(15000):
+    if r.random() < 0.08:
+        out.append(f"a {nid} {r.randint(16, 400)} l"); live[nid] = 'l'; nid += 1
+    out.append(f"a {nid} {r.randint(8, 600)} s"); short.append((step + r.randint(1, 40), nid)); nid += 1
+    short.sort()
+    while short and short[0][0] <= step:
+        out.append(f"f {short.pop(0)[1]}")
+    if r.random() < 0.01 and live:
+        k = r.choice(list(live)); del live[k]; out.append(f"f {k}")
+for _, k in short: out.append(f"f {k}")
+write("lifetimes.script", ["lifetime hints: temporaries hinted short-lived (s) between a trickle of blocks hinted long-lived (l), most kept to the end"], out)
@@ -1,23 +1,50 @@
  /* File: bump.c
  * ------------
- * A "bump" allocator that allocates memory only by tacking on 
- * at the end of the heap.  Free is a no-op: blocks are never coalesced
- * or reused.  Realloc is implemented using malloc/memcpy/free. Operations
- * are fast, but utilization is very poor. It is also missing
- * attention to robustness.
+ * A "bump" allocator that allocates memory only by tacking on
+ * at the end of the current region chunk.  Individual frees are a no-op
+ * (except for the most recent block, which is popped back off): instead,
+ * mymark takes a checkpoint and myrelease bulk-frees everything allocated
+ * since it.  This suits per-request or per-frame phases well.
  *
- * This shows the very simplest of approaches; there are better options!
+ * The segment is handed out in chunks that are chained together as the
+ * region grows.  Chunks given back by myrelease are kept for reuse, so a
+ * full segment can still serve new phases.  Realloc grows the most recent
+ * block in place, and otherwise falls back to malloc/memcpy.  Each block
+ * is preceded by a word holding its size, so that copy never reads past
+ * the old block.
  */
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "allocator.h"
+#include "bump.h"
 #include "debug_break.h"
+#include "heap_snapshot.h"
+
+// smallest chunk carved off the segment; larger requests get a chunk of their own size
+#define CHUNK_SIZE (64 * 1024)
+
+// header at the front of every chunk, chaining it to the chunk that was current before it
+typedef struct chunk {
+    struct chunk *prev;
+    size_t size;    // bytes available after the header
+    size_t nused;   // bytes bumped so far
+} chunk;
+
+#define CHUNK_HEADER_SIZE roundup(sizeof(chunk), ALIGNMENT)
+
+// room in front of every block, whose last word holds the block's size
+#define BLOCK_HEADER_SIZE roundup(sizeof(size_t), ALIGNMENT)
 
 static void *segment_start;
 static size_t segment_size;
-static size_t nused;
+static size_t ncarved;      // bytes of the segment carved into chunks so far
+static chunk *current;      // chunk being bumped into, whose prev chain is the whole region
+static chunk *spare;        // released chunks, chained through prev, waiting to be reused
+static void *last_block;    // most recently bumped block, if it is still the last one in current
 
 
 /* Function: roundup
@@ -29,6 +56,58 @@ size_t roundup(size_t sz, size_t mult) {
     return (sz + mult - 1) & ~(mult - 1);
 }
 
+/* Function: chunk_payload
+ * -----------------------
+ * This function returns the address of the first byte after a chunk's header.
+ */
+static char *chunk_payload(chunk *ch) {
+    return (char *)ch + CHUNK_HEADER_SIZE;
+}
+
+/* Function: block_size
+ * ---------------------
+ * This function returns the size of the block at ptr, kept in the word
+ * right before it.
+ */
+static size_t *block_size(void *ptr) {
+    return (size_t *)ptr - 1;
+}
+
+/* Function: push_chunk
+ * --------------------
+ * This function makes a chunk with at least needed bytes the current one,
+ * chaining the old current chunk behind it.  A released chunk that is big
+ * enough is reused first; otherwise a new one is carved off the untouched
+ * end of the segment.  Returns false if neither is possible.
+ */
+static bool push_chunk(size_t needed) {
+    chunk **link = &spare;
+    while (*link != NULL && (*link)->size < needed) {
+        link = &(*link)->prev;
+    }
+
+    chunk *ch = *link;
+    if (ch != NULL) {
+        *link = ch->prev;
+    } else {
+        size_t size = needed > CHUNK_SIZE ? needed : CHUNK_SIZE;
+        if (CHUNK_HEADER_SIZE + size > segment_size - ncarved) {
+            size = segment_size - ncarved - CHUNK_HEADER_SIZE;
+            if (CHUNK_HEADER_SIZE > segment_size - ncarved || size < needed) {
+                return false;
+            }
+        }
+        ch = (chunk *)((char *)segment_start + ncarved);
+        ch->size = size;
+        ncarved += CHUNK_HEADER_SIZE + size;
+    }
+
+    ch->prev = current;
+    ch->nused = 0;
+    current = ch;
+    return true;
+}
+
 /* Function: myinit
  * ----------------
  * This function initializes our global variables based on the specified
@@ -36,76 +115,265 @@ size_t roundup(size_t sz, size_t mult) {
  */
 bool myinit(void *start, size_t size) {
     segment_start = start;
-    segment_size = size;
-    nused = 0;
+    segment_size = size & ~(size_t)(ALIGNMENT - 1);
+    ncarved = 0;
+    current = NULL;
+    spare = NULL;
+    last_block = NULL;
     return true;
 }
 
 /* Function: mymalloc
  * ------------------
  * This function satisfies an allocation request by placing
- * the allocated block at the end of the heap.  No search means
- * it is fast, but no memory recycling means very poor utilization.
+ * the allocated block at the end of the current chunk, chaining
+ * on a new chunk when it is full.  No search means it is fast,
+ * but memory is only recycled a region at a time.
  */
 void *mymalloc(size_t requestedsz) {
     size_t needed = roundup(requestedsz, ALIGNMENT);
-    if (needed + nused > segment_size) {
+    if (current == NULL || BLOCK_HEADER_SIZE + needed > current->size - current->nused) {
+        if (!push_chunk(BLOCK_HEADER_SIZE + needed)) {
+            return NULL;
+        }
+    }
+    void *ptr = chunk_payload(current) + current->nused + BLOCK_HEADER_SIZE;
+    *block_size(ptr) = needed;
+    current->nused += BLOCK_HEADER_SIZE + needed;
+    last_block = ptr;
+    return ptr;
+}
+
+/* Function: mymalloc_hint
+ * -----------------------
+ * Every block is reclaimed along with its whole region anyway, so the
+ * lifetime hint changes nothing here.
+ */
+void *mymalloc_hint(size_t requestedsz, lifetime_t lifetime) {
+    (void)lifetime;
+    return mymalloc(requestedsz);
+}
+
+/* Function: mycalloc
+ * ------------------
+ * This function allocates with mymalloc and clears the payload.
+ */
+void *mycalloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > MAX_REQUEST_SIZE / size) {
         return NULL;
     }
-    void *ptr = (char *)segment_start + nused;
-    nused += needed;
+    void *ptr = mymalloc(nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
     return ptr;
 }
 
 /* Function: myfree
  * ----------------
- * This function does nothing - fast!... but lame :(
+ * This function pops the most recently allocated block back off the
+ * current chunk.  Freeing anything else does nothing; it is reclaimed
+ * when its region is released.
  */
-void myfree(void *ptr) {}
+void myfree(void *ptr) {
+    if (ptr != NULL && ptr == last_block) {
+        current->nused = (char *)ptr - BLOCK_HEADER_SIZE - chunk_payload(current);
+        last_block = NULL;
+    }
+}
 
 /* Function: realloc
  * -----------------
- * This function satisfies requests for resizing previously-allocated memory
- * blocks by allocating a new block of the requested size and moving the
- * existing contents to that region.  It's not particularly efficient.
+ * This function grows or shrinks the most recently allocated block in
+ * place when the current chunk has room.  Any other request is satisfied
+ * by allocating a new block of the requested size and moving the existing
+ * contents to that region, as much of them as fits in newsz.
  */
 void *myrealloc(void *oldptr, size_t newsz) {
+    if (oldptr != NULL && oldptr == last_block) {
+        size_t offset = (char *)oldptr - chunk_payload(current);
+        size_t needed = roundup(newsz, ALIGNMENT);
+        if (needed <= current->size - offset) {
+            current->nused = offset + needed;
+            *block_size(oldptr) = needed;
+            return oldptr;
+        }
+    }
+
     void *newptr = mymalloc(newsz);
-    memcpy(newptr, oldptr, newsz);
-    myfree(oldptr);
+    if (newptr == NULL) {
+        return NULL;
+    }
+    if (oldptr != NULL) {
+        size_t oldsz = *block_size(oldptr);
+        memcpy(newptr, oldptr, newsz < oldsz ? newsz : oldsz);
+    }
     return newptr;
 }
 
+/* Function: myaligned_alloc
+ * -------------------------
+ * This function bumps the end of the current chunk up to the next
+ * multiple of alignment before placing the block there, chaining on a
+ * chunk with room for the padding when it doesn't fit.  The skipped
+ * padding is reclaimed along with the rest of the region.
+ */
+void *myaligned_alloc(size_t alignment, size_t requestedsz) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment < ALIGNMENT) {
+        alignment = ALIGNMENT;
+    }
+    size_t needed = roundup(requestedsz, ALIGNMENT);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (current != NULL) {
+            uintptr_t base = (uintptr_t)chunk_payload(current);
+            size_t start = roundup(base + current->nused + BLOCK_HEADER_SIZE, alignment) - base;
+            if (start <= current->size && needed <= current->size - start) {
+                void *ptr = (char *)base + start;
+                *block_size(ptr) = needed;
+                current->nused = start + needed;
+                last_block = ptr;
+                return ptr;
+            }
+        }
+        if (attempt == 0 && !push_chunk(BLOCK_HEADER_SIZE + needed + alignment)) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Function: myposix_memalign
+ * --------------------------
+ * This function wraps myaligned_alloc with posix_memalign's argument
+ * checking and error codes.
+ */
+int myposix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+    void *ptr = myaligned_alloc(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+/* Function: mymark
+ * ----------------
+ * This function records the current end of the region.
+ */
+region_mark mymark(void) {
+    region_mark mark = { .chunk = current, .nused = current != NULL ? current->nused : 0 };
+    return mark;
+}
+
+/* Function: myrelease
+ * -------------------
+ * This function frees everything allocated since mark was taken by
+ * unwinding the chunk chain back to the marked chunk (setting the
+ * chunks after it aside for reuse) and resetting its bump pointer.
+ */
+void myrelease(region_mark mark) {
+    while (current != mark.chunk) {
+        chunk *released = current;
+        current = released->prev;
+        released->prev = spare;
+        released->nused = 0;
+        spare = released;
+    }
+    if (current != NULL) {
+        current->nused = mark.nused;
+    }
+    last_block = NULL;
+}
+
 /* Function: validate_heap
  * -----------------------
  * This function checks for potential errors/inconsistencies in the heap data
  * structures and returns false if there were issues, or true otherwise.
  * This implementation checks if the allocator has used more space than is
- * available.
+ * available, and that every chunk in the region and on the spare list lies
+ * within the carved part of the segment and hasn't bumped past its end.
  */
 bool validate_heap() {
-    if (nused > segment_size) {
+    if (ncarved > segment_size) {
         printf("Oops! Have used more heap than total available?!\n");
         breakpoint();   // call this function to stop in gdb to poke around
         return false;
     }
+    chunk *lists[] = { current, spare };
+    for (int i = 0; i < 2; i++) {
+        for (chunk *ch = lists[i]; ch != NULL; ch = ch->prev) {
+            if ((char *)ch < (char *)segment_start ||
+                chunk_payload(ch) + ch->size > (char *)segment_start + ncarved) {
+                printf("Chunk %p lies outside the carved segment!\n", (void *)ch);
+                breakpoint();
+                return false;
+            }
+            if (ch->nused > ch->size) {
+                printf("Chunk %p has bumped past its end!\n", (void *)ch);
+                breakpoint();
+                return false;
+            }
+        }
+    }
     return true;
 }
 
+/* Function: heap_snapshot
+ * -----------------------
+ * This function writes the region to fd in the binary format of
+ * heap_snapshot.h.  Bump blocks can't be walked one by one (aligned
+ * blocks leave gaps of padding between them), so each chunk is
+ * reported as one allocated block covering what has been bumped so far
+ * and one free block for the rest of it (spare chunks are all free),
+ * followed by the uncarved end of the segment.
+ */
+bool heap_snapshot(int fd) {
+    snapshot_writer writer;
+    if (!snapshot_begin(&writer, fd, segment_size)) {
+        return false;
+    }
+    size_t offset = 0;
+    while (offset < ncarved) {
+        chunk *ch = (chunk *)((char *)segment_start + offset);
+        size_t payload_offset = chunk_payload(ch) - (char *)segment_start;
+        if (ch->nused > 0) {
+            snapshot_block(&writer, payload_offset, ch->nused, true);
+        }
+        if (ch->nused < ch->size) {
+            snapshot_block(&writer, payload_offset + ch->nused, ch->size - ch->nused, false);
+        }
+        offset += CHUNK_HEADER_SIZE + ch->size;
+    }
+    if (ncarved < segment_size) {
+        snapshot_block(&writer, ncarved, segment_size - ncarved, false);
+    }
+    return snapshot_end(&writer);
+}
+
 /* Function: dump_heap
  * -------------------
- * This function dumps the raw heap contents.
+ * This function dumps the raw contents of the region, one chunk at a
+ * time starting from the current chunk.
  * This function is not called from anywhere, it is just here to
  * demonstrate how such a function might be a useful debugging aid.
  */
 void dump_heap() {
-    printf("Heap segment starts at address %p, ends at %p. %lu bytes currently used.", 
-        segment_start, (char *)segment_start + segment_size, nused);
-    for (int i = 0; i < nused; i++) {
-        unsigned char *cur = (unsigned char *)segment_start + i;
-        if (i % 32 == 0) {
-            printf("\n%p: ", cur);
+    printf("Heap segment starts at address %p, ends at %p. %lu bytes carved into chunks.",
+        segment_start, (char *)segment_start + segment_size, ncarved);
+    for (chunk *ch = current; ch != NULL; ch = ch->prev) {
+        printf("\nChunk %p: %lu of %lu bytes used.", (void *)ch, ch->nused, ch->size);
+        for (int i = 0; i < ch->nused; i++) {
+            unsigned char *cur = (unsigned char *)chunk_payload(ch) + i;
+            if (i % 32 == 0) {
+                printf("\n%p: ", cur);
+            }
+            printf("%02x ", *cur);
         }
-        printf("%02x ", *cur);
     }
 }
@@ -0,0 +1,41 @@
+/* File: bump.h
+ * ------------
+ * Interface for the region checkpoints the bump allocator offers on top
+ * of allocator.h. Only bump.c implements these.
+ */
+#ifndef _BUMP_H
+#define _BUMP_H
+
+#include <stddef.h>  // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// checkpoint of the end of the region, as returned by mymark
+typedef struct {
+    void *chunk;    // chunk being bumped into when the mark was taken
+    size_t nused;   // bytes used in that chunk at that point
+} region_mark;
+
+/* Function: mymark
+ * ----------------
+ * Returns a checkpoint of the region as it stands, to later pass to
+ * myrelease. Marks nest: releasing an outer mark also releases every
+ * mark taken after it.
+ */
+region_mark mymark(void);
+
+/* Function: myrelease
+ * -------------------
+ * Frees every block allocated since mark was taken, all at once. Blocks
+ * from before the mark are untouched. The mark must not have been
+ * released already by an earlier mark.
+ */
+void myrelease(region_mark mark);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
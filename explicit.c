@@ -2,29 +2,148 @@
  * This file contains an implicit allocator, which allocates memory for a client and hosts three client-facing features: mallocing, freeing, and reallocing.
  */
 #include "allocator.h"
+#include "explicit.h"
+#include "segment.h"
 #include "debug_break.h"
+#include "heap_snapshot.h"
+#include "heap_stats.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// status bits kept in the low bits of a header's size
+#define ALLOCATED 0x1
+#define ZEROED 0x2 // free block whose payload past its freelist links is known to be zero
+#define GROWN 0x4  // allocated block with room reserved for myrealloc to grow it into (see in_use_size)
+#define SAMPLED 0x2 // allocated block tracked by a heap profiler; shares ZEROED's bit, which only free blocks use
+#define AGED 0x4    // free block mymaintain has passed over once without purging; GROWN's bit, which only allocated blocks use
+
+// a block carved from a short-lived region (see mymalloc_hint) has ALLOCATED clear, which no other block handed to
+// the client has. Its header keeps SAMPLED, its payload size in the low word and the distance back to the region's
+// own block in the high word
+#define DEAD 0x4    // block in a region that has been freed; GROWN's bit, which region blocks never use
+
+// smallest page size of the heap segment, and smallest stale span worth handing back to the OS on free
+#define PAGE_SIZE 4096
+#define PURGE_THRESHOLD (256 * 1024)
+
+// units of mymaintain's budget that purging a block costs, visiting one costing a single unit
+#define PURGE_COST 64
+
+// moving a block costs a unit of mymaintain's budget per this many bytes, about what visiting one touches
+#define MOVE_UNIT 64
+
+// entries the handle table starts with; it doubles whenever it runs out
+#define HANDLE_TABLE_SLOTS 64
+
+// short-lived requests of up to SHORT_OBJECT_MAX bytes are carved from regions of SHORT_REGION_SIZE bytes. Up to
+// SPARE_REGIONS regions that emptied out are kept for reuse instead of being freed
+#define SHORT_REGION_SIZE (16 * 1024)
+#define SHORT_OBJECT_MAX (SHORT_REGION_SIZE / 4)
+#define SPARE_REGIONS 4
+
+// calloc requests at least this large are zeroed with non-temporal stores to avoid flushing the cache
+#define NONTEMPORAL_THRESHOLD (1024 * 1024)
 
 // header struct
 typedef struct header {
     size_t sizenstatus;
 } header;
 
-// node struct that includes a header and two node pointers
+// node struct that includes a header and the offsets of the neighboring free blocks (see node_at)
 typedef struct node {
     header hdr;
-    struct node *prev;
-    struct node *next;
+    uint64_t prev;
+    uint64_t next;
 } node;
 
+// marks the start of a heap set up by myinit, so myattach can recognize one
+#define HEAP_MAGIC 0x3570616568707865ULL // "expheap5"
+
+// superblock at the very front of the heap holding all of its state, so a heap in a file-backed
+// segment can be re-attached by a later run. Like the freelist links, everything in it that refers
+// to a block is an offset from the superblock (0 for none), so the heap can be mapped anywhere.
+typedef struct superblock {
+    uint64_t magic;
+    uint64_t heap_size;     // bytes from the superblock to the end of the heap
+    uint64_t alignment;     // ALIGNMENT the heap was laid out with, which a build attaching to it must share
+    uint64_t min_block_size;    // and MIN_BLOCK_SIZE
+    uint64_t first_free;    // head of the freelist
+    uint64_t free_blocks;   // number of blocks on the freelist
+    uint64_t grown_blocks;  // number of allocated blocks marked GROWN, so reclaim_slack knows when there is nothing to reclaim
+    uint64_t root;          // payload of the client's root block, see myset_root
+    uint64_t flags;         // HEAP_SHARED if set up by myinit_shared
+    uint64_t first_region;  // head of the list of short-lived regions in use
+    uint64_t short_region;  // the region new short-lived blocks are carved from
+    uint64_t spare_regions; // head of the list of empty regions kept for reuse (linked through next)
+    uint64_t spares;        // number of regions on it
+    uint64_t handle_table;  // payload of the handle table, an array of handle_slot (see myhandle_alloc)
+    uint64_t handle_slots;  // entries in it
+    uint64_t free_handles;  // first unused entry's handle, the rest linked through their pins
+    pthread_mutex_t lock;   // robust process-shared lock, only used with HEAP_SHARED
+} superblock;
+
+// header at the front of the payload of a short-lived region, an allocated block that short-lived requests are
+// carved from one after another. Once every block carved from it is freed, the region is reused from the start
+// (if new blocks still go there), kept as a spare for the next region, or freed as a whole
+typedef struct region {
+    uint64_t prev;          // neighbors on the superblock's list of regions
+    uint64_t next;
+    uint64_t live;          // blocks carved from it that aren't freed yet
+    uint64_t top;           // bytes of its payload used so far, counting this header
+} region;
+
+// entry of the handle table for the handle one past its index: where the handle's block is now, and how many pins keep
+// it there. An unused entry has no block, and its pins field holds the next unused entry's handle instead
+typedef struct handle_slot {
+    uint64_t block;         // payload of the handle's block, 0 if the entry is unused
+    uint64_t pins;
+} handle_slot;
+
+// superblock flag for heaps that several processes use at once
+#define HEAP_SHARED 0x1
+
+// every block's header and payload together take a multiple of ALIGNMENT bytes, and the first payload starts aligned,
+// so every payload stays aligned behind a header of a single word. This is the payload of such a block for size bytes
+#define BLOCK_ROUNDUP(size) ((((size) + sizeof(header) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1)) - sizeof(header))
+
+// smallest payload of a block, which needs room for the freelist links once the block is freed. Builds may raise it
+#ifndef MIN_BLOCK_SIZE
+#define MIN_BLOCK_SIZE BLOCK_ROUNDUP(sizeof(node) - sizeof(header))
+#endif
+_Static_assert(MIN_BLOCK_SIZE >= sizeof(node) - sizeof(header) && BLOCK_ROUNDUP(MIN_BLOCK_SIZE) == MIN_BLOCK_SIZE,
+    "MIN_BLOCK_SIZE must hold the freelist links and keep blocks aligned");
+
+// room taken by the superblock, so that the first block's payload is aligned
+#define SUPERBLOCK_SIZE BLOCK_ROUNDUP(sizeof(superblock))
+
+// where a region's first block starts in its payload, past the region header
+#define REGION_START BLOCK_ROUNDUP(sizeof(region))
+
 // variables
-static void *segment_begin;
+static superblock *super;
+static void *segment_begin; // first block, right after the superblock
 static size_t segment_size; // size of initial payload
 static void *segment_end;
-static size_t free_blocks; // take out if necessary
-static node *first_freenode;
-static size_t free_blocks;
+static size_t purge_page_size; // pages are handed back to the OS in units of this, so huge pages are never split
+static int purge_advice; // how they are handed back: MADV_REMOVE for shared mappings, which MADV_DONTNEED wouldn't zero
+static bool shared_heap; // whether calls have to take the superblock's lock
+static bool deferred_purging; // whether myfree leaves large stale spans for mymaintain to purge
+static node *maintain_cursor; // block mymaintain picks up at, NULL to start from the front
+
+// live counters, and the page mypublish_stats copies them to every STATS_PUBLISH_INTERVAL calls (NULL for none).
+// Copying them in batches keeps seqlock sections off the fast path, and readers from being starved by them
+static heap_stats stats;
+static heap_stats *published_stats;
+static unsigned calls_since_publish;
+#define STATS_PUBLISH_INTERVAL 1024
 
 // helper functions
 size_t extract_size(node *newnode);
@@ -34,43 +153,330 @@ void remove_freeblock(node *newnode);
 bool is_free (node *newnode);
 void coalesce_right (node *newnode);
 size_t roundup(size_t sz, size_t mult);
+size_t block_size_for(size_t requested_size);
+size_t heap_extent(size_t heap_size);
 node *get_hdrptr(void *ptr);
+node *node_at(uint64_t offset);
+uint64_t offset_of(void *ptr);
+void attach_segment(void *heap_start, size_t heap_size);
+node *take_freeblock(size_t needed);
+bool is_zeroed(node *newnode);
+void purge_block(node *newnode, char *dirty_end, bool keep_zeroed, bool release_pages);
+char *coalesce_free_run(node *newnode, bool *absorbed_zeroed);
+void zero_payload(void *ptr, size_t size);
+bool is_grown(node *newnode);
+size_t *grown_mark(node *newnode);
+size_t in_use_size(node *newnode);
+void *finish_growth(node *currnode, size_t needed);
+node *reclaim_slack(size_t needed);
+bool lock_heap(void);
+void unlock_heap(void);
+bool rebuild_freelist(void);
+void count_in_use(size_t size, bool allocated);
+void count_resize(size_t old_size, node *newnode);
+void reset_stats(void);
+void publish_counters(void);
+void count_call(void);
+bool in_region(node *newnode);
+size_t object_size(node *object);
+node *region_block(node *object);
+region *region_of(node *block);
+node *new_region(void);
+void retire_region(node *block);
+void free_object(node *object);
+handle_slot *slot_of(heap_handle handle);
+uint64_t *handle_mark(node *block);
+bool is_movable(node *block);
+bool grow_handle_table(void);
+node *slide_down(node *free_block, node *block);
+
+// the allocator proper; the public functions wrap these in lock_heap/unlock_heap
+static void *malloc_unlocked(size_t requested_size);
+static void *malloc_short_unlocked(size_t requested_size);
+static void *calloc_unlocked(size_t nmemb, size_t size);
+static void free_unlocked(void *ptr);
+static void *realloc_unlocked(void *old_ptr, size_t new_size);
+static void *aligned_alloc_unlocked(size_t alignment, size_t requested_size);
+static bool validate_unlocked(void);
+static bool snapshot_unlocked(int fd);
+static size_t maintain_unlocked(size_t budget);
+static heap_handle handle_alloc_unlocked(size_t requested_size);
+static void handle_free_unlocked(heap_handle handle);
 
 /* Function: mynit
  * -----------------
  * This function initializes a heap given a starting pointer and heap size,
  * which is guaranteed to be a multiple of ALIGNMENT. The intialized heap is
- * one free block with a header of length heap_size - sizeof(header). Returns
- * true if heap is able to be initialized.
+ * the superblock followed by one free block with a header. Returns
+ * true if heap is able to be initialized. When the heap is page aligned (as
+ * the mappings from segment.c are), its pages are handed back to the OS so
+ * the initial block starts out known-zero for mycalloc.
  */
 bool myinit(void *heap_start, size_t heap_size) {
 
-    if (heap_size < (ALIGNMENT * 3)) {
+    if (heap_size < SUPERBLOCK_SIZE + sizeof(header) + MIN_BLOCK_SIZE + ALIGNMENT) {
         return false;
     }
-    
-    first_freenode = heap_start;
-    segment_begin = heap_start;
-    segment_size = heap_size - sizeof(header);
-    free_blocks = 1;
+
+    attach_segment(heap_start, heap_size);
+    segment_size = heap_extent(heap_size) - SUPERBLOCK_SIZE - sizeof(header);
+
+    // discard stale contents from a previous run, so the whole segment reads back as zero
+    bool zeroed = (uintptr_t)heap_start % PAGE_SIZE == 0 && heap_size % PAGE_SIZE == 0 &&
+        madvise(heap_start, heap_size, purge_advice) == 0;
+
+    super->magic = HEAP_MAGIC;
+    super->heap_size = heap_size;
+    super->alignment = ALIGNMENT;
+    super->min_block_size = MIN_BLOCK_SIZE;
+    super->root = 0;
+    super->flags = 0;
+    super->first_free = 0;
+    super->free_blocks = 0;
+    super->grown_blocks = 0;
+    super->first_region = 0;
+    super->short_region = 0;
+    super->spare_regions = 0;
+    super->spares = 0;
+    super->handle_table = 0;
+    super->handle_slots = 0;
+    super->free_handles = 0;
+    shared_heap = false;
 
     // stores heap size in header, with last 3 bits designating free or alloc
-    (first_freenode->hdr).sizenstatus = segment_size;
-    first_freenode->prev = NULL;
-    first_freenode->next = NULL;
+    node *first_freenode = segment_begin;
+    (first_freenode->hdr).sizenstatus = segment_size + (zeroed ? ZEROED : 0);
+    add_freeblock(first_freenode);
 
-    segment_end = (char *)heap_start + heap_size;
-    
+    maintain_cursor = NULL;
+    reset_stats();
     return true;
     
 }
 
+/* Function: myattach
+ * -----------------
+ * Picks up a heap that myinit set up earlier in the same memory, typically a file-backed segment
+ * mapped again by a later run. Nothing in the heap is an absolute address, so it may be mapped
+ * anywhere. Returns false unless the superblock is intact, the heap was laid out with this build's
+ * ALIGNMENT and MIN_BLOCK_SIZE, and it passes validate_heap.
+ */
+bool myattach(void *heap_start, size_t heap_size) {
+
+    superblock *found = heap_start;
+    if (heap_size < SUPERBLOCK_SIZE + sizeof(header) + MIN_BLOCK_SIZE + ALIGNMENT || found->magic != HEAP_MAGIC ||
+        found->heap_size != heap_size || found->alignment != ALIGNMENT || found->min_block_size != MIN_BLOCK_SIZE) {
+        return false;
+    }
+
+    attach_segment(heap_start, heap_size);
+    segment_size = heap_extent(heap_size) - SUPERBLOCK_SIZE - sizeof(header);
+    shared_heap = (found->flags & HEAP_SHARED) != 0;
+    maintain_cursor = NULL;
+    reset_stats();
+    return validate_heap();
+}
+
+/* Function: myinit_shared
+ * -----------------
+ * Like myinit, but for a heap in memory that several processes map at once (such as a segment from
+ * init_heap_segment_shm). Other processes join with myattach. Every call then takes a robust,
+ * process-shared lock kept in the superblock, and processes exchange blocks as offsets
+ * (myoffset_of/myptr_at) since each may map the heap at a different address.
+ */
+bool myinit_shared(void *heap_start, size_t heap_size) {
+
+    if (!myinit(heap_start, heap_size)) {
+        return false;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int result = pthread_mutex_init(&super->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (result != 0) {
+        return false;
+    }
+
+    super->flags |= HEAP_SHARED;
+    shared_heap = true;
+    return true;
+}
+
+/* Functions: myoffset_of, myptr_at
+ * -----------------
+ * Convert between a block and its offset in the heap, which unlike the address means the same thing
+ * in every process attached to the heap. NULL and offset 0 map to each other.
+ */
+uint64_t myoffset_of(void *ptr) {
+    return offset_of(ptr);
+}
+
+void *myptr_at(uint64_t offset) {
+    return offset ? (char *)super + offset : NULL;
+}
+
+/* Functions: myget_root, myset_root
+ * -----------------
+ * The root block is where a client keeps whatever it needs to find its data again after
+ * re-attaching to a heap. It is stored as an offset, so it stays valid if the heap moves.
+ */
+void *myget_root(void) {
+    return myptr_at(super->root);
+}
+
+void myset_root(void *ptr) {
+    super->root = offset_of(ptr);
+}
+
+/* Functions: mymark_sampled, myis_sampled
+ * -----------------
+ * The sampled mark lives in the block's header, so a profiler can tell on free whether it has to
+ * look the block up without keeping any table of its own for the blocks it didn't sample.
+ */
+void mymark_sampled(void *ptr) {
+    if (!lock_heap()) {
+        return;
+    }
+    (get_hdrptr(ptr)->hdr).sizenstatus |= SAMPLED;
+    unlock_heap();
+}
+
+bool myis_sampled(void *ptr) {
+    return ptr != NULL && ((get_hdrptr(ptr)->hdr).sizenstatus & SAMPLED) != 0;
+}
+
+/* Functions: mystats, mypublish_stats, mysync_stats
+ * -----------------
+ * The heap's live counters (see heap_stats.h) are kept in private memory, where the caller can add
+ * its own (the lock counters) with the heap serialized. mypublish_stats names the page, typically a
+ * page of shared memory, that they are copied to every STATS_PUBLISH_INTERVAL calls, or right away
+ * with mysync_stats.
+ */
+heap_stats *mystats(void) {
+    stats.free_blocks = super->free_blocks;
+    stats.free_bytes = stats.heap_bytes - (stats.in_use_blocks + stats.free_blocks) * sizeof(header) - stats.in_use_bytes;
+    return &stats;
+}
+
+void mypublish_stats(heap_stats *page) {
+    if (!lock_heap()) {
+        return;
+    }
+    memset(page, 0, sizeof(*page));
+    published_stats = page;
+    unlock_heap();
+    mysync_stats();
+}
+
+void mysync_stats(void) {
+    if (published_stats == NULL || !lock_heap()) {
+        return;
+    }
+    publish_counters();
+    unlock_heap();
+}
+
+/* Functions: mymalloc, mymalloc_hint, mycalloc, myfree, myrealloc, myaligned_alloc, validate_heap, heap_snapshot
+ * -----------------
+ * Entry points of the allocator. Each runs its *_unlocked implementation below under the heap's
+ * lock, which is only taken for a heap shared between processes. If the lock can't be taken
+ * because the heap was left beyond repair, allocations fail and frees are dropped. The calls that
+ * change the heap update its counters in one seqlock section each.
+ */
+void *mymalloc(size_t requested_size) {
+    if (!lock_heap()) {
+        return NULL;
+    }
+    void *ptr = malloc_unlocked(requested_size);
+    stats.mallocs += ptr != NULL;
+    count_call();
+    unlock_heap();
+    return ptr;
+}
+
+void *mymalloc_hint(size_t requested_size, lifetime_t lifetime) {
+    if (!lock_heap()) {
+        return NULL;
+    }
+    // regions are left out of shared heaps, whose lock holder can die halfway through updating their list
+    bool short_lived = lifetime == LIFETIME_SHORT && !shared_heap;
+    void *ptr = short_lived ? malloc_short_unlocked(requested_size) : malloc_unlocked(requested_size);
+    stats.mallocs += ptr != NULL;
+    count_call();
+    unlock_heap();
+    return ptr;
+}
+
+void *mycalloc(size_t nmemb, size_t size) {
+    if (!lock_heap()) {
+        return NULL;
+    }
+    void *ptr = calloc_unlocked(nmemb, size);
+    stats.mallocs += ptr != NULL;
+    count_call();
+    unlock_heap();
+    return ptr;
+}
+
+void myfree(void *ptr) {
+    if (!lock_heap()) {
+        return;
+    }
+    free_unlocked(ptr);
+    stats.frees += ptr != NULL;
+    count_call();
+    unlock_heap();
+}
+
+void *myrealloc(void *old_ptr, size_t new_size) {
+    if (!lock_heap()) {
+        return NULL;
+    }
+    void *ptr = realloc_unlocked(old_ptr, new_size);
+    stats.reallocs++;
+    count_call();
+    unlock_heap();
+    return ptr;
+}
+
+void *myaligned_alloc(size_t alignment, size_t requested_size) {
+    if (!lock_heap()) {
+        return NULL;
+    }
+    void *ptr = aligned_alloc_unlocked(alignment, requested_size);
+    stats.mallocs += ptr != NULL;
+    count_call();
+    unlock_heap();
+    return ptr;
+}
+
+bool validate_heap() {
+    if (!lock_heap()) {
+        return false;
+    }
+    bool valid = validate_unlocked();
+    unlock_heap();
+    return valid;
+}
+
+bool heap_snapshot(int fd) {
+    if (!lock_heap()) {
+        return false;
+    }
+    bool written = snapshot_unlocked(fd);
+    unlock_heap();
+    return written;
+}
+
 /* Function: mymalloc
  * -----------------
  * Allocates new memory space with size of requested_size by iterating through a linked list of
  * free blocks to see if a free block exists that is large enough to host the request.
  */
-void *mymalloc(size_t requested_size) {
+static void *malloc_unlocked(size_t requested_size) {
 
     // requested amount of memory to malloc has to be less than the max and greater than 0
     if (requested_size > MAX_REQUEST_SIZE || requested_size == 0) {
@@ -78,33 +484,96 @@ void *mymalloc(size_t requested_size) {
     }
 
     // round up requested size to a properly aligned multiple
-    size_t needed = requested_size <= ALIGNMENT * 2 ? ALIGNMENT * 2 : roundup(requested_size, ALIGNMENT);
+    size_t needed = block_size_for(requested_size);
 
-    node *currnode = first_freenode;
-    
-    while (currnode != NULL) {
+    node *currnode = take_freeblock(needed);
+    if (currnode == NULL) {
+        return NULL;
+    }
 
-        // if enough space exists for an allocation
-        if (extract_size(currnode) >= needed) {
-            // if enough space exists for another allocation after allocating current block
-            split_block_if_poss(currnode, needed);
+    // allocate block by changing header, dropping any free block status bits
+    (currnode->hdr).sizenstatus = extract_size(currnode) + ALLOCATED;
+    count_in_use(extract_size(currnode), true);
 
-            // remove newly allocated block from freelist, decrementing number of free blocks
-            remove_freeblock(currnode); 
+    // return
+    char *return_ptr = (char *)(currnode) + sizeof(header);
+    return return_ptr;
+}
 
-            // allocate block by changing header
-            (currnode->hdr).sizenstatus += 1;
+/* Function: mymalloc_hint
+ * -----------------
+ * Allocates a block expected to be freed soon after it is allocated. Rather than taking a free block
+ * where long-lived blocks could end up on either side of it, small requests are carved one after
+ * another from the current short-lived region. Blocks in a region are never reused one by one: the
+ * region is reused from the start once all of them are freed, or freed as a whole (coalescing and
+ * purging like any other block) if new blocks have moved on to another region by then. Requests
+ * too large for a region, or that can't get one, are served by mymalloc.
+ */
+static void *malloc_short_unlocked(size_t requested_size) {
+
+    if (requested_size > SHORT_OBJECT_MAX || requested_size == 0) {
+        return malloc_unlocked(requested_size);
+    }
+
+    size_t needed = block_size_for(requested_size);
 
-            // return
-            char *return_ptr = (char *)(currnode) + sizeof(header);
-            return return_ptr;
+    // set up a new region when the current one is full
+    node *block = node_at(super->short_region);
+    if (block == NULL || region_of(block)->top + sizeof(header) + needed > extract_size(block)) {
+        block = new_region();
+        if (block == NULL) {
+            return malloc_unlocked(requested_size);
         }
+    }
 
-        // iterate
-        currnode = currnode->next;
+    // carve the request off the region's unused end
+    region *owner = region_of(block);
+    node *object = (node *)((char *)owner + owner->top);
+    (object->hdr).sizenstatus = ((size_t)((char *)object - (char *)block) << 32) | needed;
+    owner->top += sizeof(header) + needed;
+    owner->live++;
+
+    return (char *)(object) + sizeof(header);
+}
+
+/* Function: mycalloc
+ * -----------------
+ * Allocates zeroed memory for nmemb elements of size bytes each. Free blocks that are known to be
+ * zero (the never-used tail of the segment, and blocks whose pages were purged on free) only need
+ * their freelist links cleared, so fresh pages are never touched. Anything else is zeroed in full.
+ */
+static void *calloc_unlocked(size_t nmemb, size_t size) {
+
+    // nmemb * size must not overflow, and is bounded by the max request size
+    if (size != 0 && nmemb > MAX_REQUEST_SIZE / size) {
+        return NULL;
+    }
+    size_t requested_size = nmemb * size;
+    if (requested_size == 0) {
+        return NULL;
     }
 
-    return NULL;
+    size_t needed = block_size_for(requested_size);
+
+    node *currnode = take_freeblock(needed);
+    if (currnode == NULL) {
+        return NULL;
+    }
+    bool zeroed = is_zeroed(currnode);
+
+    // allocate block by changing header, dropping any free block status bits
+    (currnode->hdr).sizenstatus = extract_size(currnode) + ALLOCATED;
+    count_in_use(extract_size(currnode), true);
+
+    char *return_ptr = (char *)(currnode) + sizeof(header);
+    if (zeroed) {
+        // only the freelist links at the front of the payload can be non-zero
+        size_t links = sizeof(node) - sizeof(header);
+        memset(return_ptr, 0, requested_size < links ? requested_size : links);
+    } else {
+        zero_payload(return_ptr, requested_size);
+    }
+    return return_ptr;
 }
 
 /* Function: myfree
@@ -112,7 +581,7 @@ void *mymalloc(size_t requested_size) {
  * When passed in a pointer to a specific spot in memory, frees that block. Adds this free block
  * to the free list.
  */
-void myfree(void *ptr) {
+static void free_unlocked(void *ptr) {
 
     // no freeing if the pointer is NULL
     if (ptr == NULL) {
@@ -123,81 +592,418 @@ void myfree(void *ptr) {
     void *head = (char *)(ptr) - sizeof(header);
     node *newnode = (node *)head;
 
-    // free the block
-    (newnode->hdr).sizenstatus -= 1;
+    // blocks carved from a region are given back to the region
+    if (in_region(newnode)) {
+        free_object(newnode);
+        return;
+    }
+
+    // free the block, along with any room it had reserved to grow into (and its sampled mark, which would read as ZEROED)
+    count_in_use(extract_size(newnode), false);
+    super->grown_blocks -= is_grown(newnode);
+    (newnode->hdr).sizenstatus &= ~(size_t)(ALLOCATED | GROWN | SAMPLED);
 
     // add newfreeblock to the linked list, incrementing number of free blocks
     add_freeblock(newnode);
 
-    // check if right neighbor is free and coalesce if necessary
-    node *right_neighbor = (node *)((char *)(newnode) + sizeof(header) + extract_size(newnode));
-    while ( (void *)right_neighbor != segment_end && is_free(right_neighbor)) {
-        coalesce_right(newnode);
-        //iterate
-        right_neighbor = (node *)((char *)(newnode) + sizeof(header) + extract_size(newnode));
+    // coalesce with any free blocks to the right
+    bool absorbed_zeroed = false;
+    char *dirty_end = coalesce_free_run(newnode, &absorbed_zeroed);
+
+    // return large stale spans to the OS (unless mymaintain does that), and keep zero blocks (like the segment
+    // tail) known-zero
+    purge_block(newnode, dirty_end, absorbed_zeroed, !deferred_purging);
+}
+
+/* Function: mymaintain
+ * -----------------
+ * Does up to budget units of the work that can be put off from the other calls, picking up where the
+ * last call left off and wrapping around the heap. Visiting a block costs one unit. Runs of free blocks
+ * (frees only coalesce to the right, so a block freed after its left neighbor is left next to it) are
+ * coalesced, and large free blocks that are still stale the second time around are handed back to the
+ * OS at PURGE_COST units each, which myfree leaves to this under mydefer_purging. A handle's block
+ * with no pins that follows a free block is slid down in front of it, at a unit per MOVE_UNIT bytes,
+ * so that free space is pushed up the heap until it runs into and merges with the next free block.
+ * A pass only overruns its budget to move a single block bigger than the whole budget. Returns how
+ * many blocks were coalesced, purged or moved. Shared heaps are left alone, as other processes may
+ * change them. A private heap has no lock, so the caller serializes this with every other call.
+ */
+size_t mymaintain(size_t budget) {
+    if (!lock_heap()) {
+        return 0;
+    }
+    size_t changed = shared_heap ? 0 : maintain_unlocked(budget);
+    unlock_heap();
+    return changed;
+}
+
+void mydefer_purging(bool defer) {
+    deferred_purging = defer;
+}
+
+static size_t maintain_unlocked(size_t budget) {
+    size_t changed = 0;
+    if (maintain_cursor == NULL) {
+        maintain_cursor = segment_begin;
+    }
+
+    for (size_t work = 0; work < budget; work++) {
+        node *current = maintain_cursor;
+        node *right_neighbor = (node *)((char *)(current) + sizeof(header) + extract_size(current));
+
+        if (is_free(current) && (void *)right_neighbor != segment_end && is_free(right_neighbor)) {
+            // the merged block is stale all the way through; it can be purged once it has aged like any other
+            (current->hdr).sizenstatus &= ~(size_t)(ZEROED | AGED);
+            bool absorbed_zeroed = false;
+            char *dirty_end = coalesce_free_run(current, &absorbed_zeroed);
+            purge_block(current, dirty_end, absorbed_zeroed, false);
+            changed++;
+        } else if (is_free(current) && (void *)right_neighbor != segment_end && is_movable(right_neighbor)) {
+            // a move that doesn't fit in what is left of the budget is where the next pass starts
+            size_t cost = extract_size(right_neighbor) / MOVE_UNIT;
+            if (work > 0 && work + cost > budget) {
+                break;
+            }
+            current = slide_down(current, right_neighbor);
+            changed++;
+            work += cost;
+        } else if (is_free(current) && !is_zeroed(current) && extract_size(current) >= PURGE_THRESHOLD) {
+            if (((current->hdr).sizenstatus & AGED) == 0) {
+                (current->hdr).sizenstatus |= AGED;
+            } else {
+                (current->hdr).sizenstatus &= ~(size_t)AGED;
+                purge_block(current, (char *)right_neighbor, false, true);
+                changed++;
+                work += PURGE_COST;
+            }
+        }
+
+        right_neighbor = (node *)((char *)(current) + sizeof(header) + extract_size(current));
+        maintain_cursor = (void *)right_neighbor == segment_end ? segment_begin : right_neighbor;
+    }
+    return changed;
+}
+
+/* Functions: myhandle_alloc, myhandle_pin, myhandle_unpin, myhandle_free
+ * -----------------
+ * Blocks reached through a handle, which mymaintain may move while they aren't pinned. A handle is
+ * one past the index of its entry in the handle table, a block of the heap that grows as needed and
+ * records where each handle's block is. The block's last word names its handle back, which is how
+ * mymaintain tells handles' blocks apart from the others (see is_movable).
+ */
+heap_handle myhandle_alloc(size_t requested_size) {
+    if (!lock_heap()) {
+        return 0;
+    }
+    heap_handle handle = handle_alloc_unlocked(requested_size);
+    stats.mallocs += handle != 0;
+    count_call();
+    unlock_heap();
+    return handle;
+}
+
+void *myhandle_pin(heap_handle handle) {
+    if (handle == 0 || !lock_heap()) {
+        return NULL;
+    }
+    handle_slot *slot = slot_of(handle);
+    slot->pins++;
+    void *ptr = myptr_at(slot->block);
+    unlock_heap();
+    return ptr;
+}
+
+void myhandle_unpin(heap_handle handle) {
+    if (handle == 0 || !lock_heap()) {
+        return;
     }
+    handle_slot *slot = slot_of(handle);
+    assert(slot->pins > 0);
+    slot->pins--;
+    unlock_heap();
+}
+
+void myhandle_free(heap_handle handle) {
+    if (handle == 0 || !lock_heap()) {
+        return;
+    }
+    handle_free_unlocked(handle);
+    stats.frees++;
+    count_call();
+    unlock_heap();
+}
+
+// allocates a block with room past requested_size for its handle, and gives it the first unused entry of the table
+static heap_handle handle_alloc_unlocked(size_t requested_size) {
+    if (requested_size > MAX_REQUEST_SIZE - sizeof(uint64_t) || requested_size == 0) {
+        return 0;
+    }
+    if (super->free_handles == 0 && !grow_handle_table()) {
+        return 0;
+    }
+    void *ptr = malloc_unlocked(requested_size + sizeof(uint64_t));
+    if (ptr == NULL) {
+        return 0;
+    }
+
+    heap_handle handle = super->free_handles;
+    handle_slot *slot = slot_of(handle);
+    super->free_handles = slot->pins;
+    slot->block = offset_of(ptr);
+    slot->pins = 0;
+    *handle_mark(get_hdrptr(ptr)) = handle;
+    return handle;
+}
+
+// frees a handle's block, pinned or not, and puts its entry back on the list of unused ones
+static void handle_free_unlocked(heap_handle handle) {
+    handle_slot *slot = slot_of(handle);
+    free_unlocked(myptr_at(slot->block));
+    slot->block = 0;
+    slot->pins = super->free_handles;
+    super->free_handles = handle;
+}
+
+/* Function: myfree_sized
+ * -----------------
+ * Frees a block whose size the caller knows. The header still has to be read to flip its status
+ * and find the right neighbor to coalesce with, so the size only serves as a consistency check.
+ */
+void myfree_sized(void *ptr, size_t size) {
+    assert(ptr == NULL || size <= myusable_size(ptr));
+    myfree(ptr);
 }
 
 /* Function: myrealloc
  * -----------------
  * Reallocates existing memory to new memory of a new size by calling mymalloc. Also hosts an
  * in-place realloc by coalescing right blocks until there is enough space to host the request.
+ * A block that realloc grows is marked GROWN, and growing it again reserves half as much again
+ * as requested, so a buffer grown a little at a time is only copied O(log n) times. Until the
+ * block shrinks, the reservation is kept whole and growing into it costs nothing; under memory
+ * pressure take_freeblock hands it back (see reclaim_slack).
  */
-void *myrealloc(void *old_ptr, size_t new_size) {
+static void *realloc_unlocked(void *old_ptr, size_t new_size) {
     // if pointer to block passed in is NULL, malloc a new_size
     if (old_ptr == NULL) {
-        return mymalloc(new_size);
+        return malloc_unlocked(new_size);
     // if new_size is 0, free the block being passed in
     } else if (new_size == 0) {
-        myfree(old_ptr);
+        free_unlocked(old_ptr);
         return NULL;
     } else {
 
     // otherwise reallocate as normal
     
     // roundup new_size requested as necessary
-    size_t needed = new_size < ALIGNMENT * 2 ? ALIGNMENT * 2 : roundup(new_size, ALIGNMENT);
+    size_t needed = block_size_for(new_size);
 
     node *currnode = get_hdrptr(old_ptr);
 
+    // REGION REALLOC
+
+    // a block in a region keeps its size, and moves out of the region if it has to grow
+    if (in_region(currnode)) {
+        size_t object_bytes = object_size(currnode);
+        if (needed <= object_bytes) {
+            return old_ptr;
+        }
+        void *reallocated = malloc_unlocked(new_size);
+        if (reallocated == NULL) {
+            return NULL;
+        }
+        memcpy(reallocated, old_ptr, object_bytes);
+        free_object(currnode);
+        return reallocated;
+    }
+    size_t in_use = in_use_size(currnode);
+    size_t old_size = extract_size(currnode);
+    bool grown = is_grown(currnode);
+
+    // GROWTH SLACK
+
+    // a grown block takes any size up to its reservation by moving its mark, and gives the reservation up once it shrinks
+    if (grown && needed + sizeof(size_t) <= extract_size(currnode)) {
+        if (needed >= in_use) {
+            *grown_mark(currnode) = needed;
+            return old_ptr;
+        }
+        (currnode->hdr).sizenstatus &= ~(size_t)GROWN;
+        super->grown_blocks--;
+        grown = false;
+    }
+
     // IN-PLACE REALLOC
 
     // new_size shrinks, stays equal, or enough padding exists to accomodate an expansion
-    if (extract_size(currnode) >= needed) {
+    if (!grown && extract_size(currnode) >= needed) {
         // if enough space exists for another allocation after allocating current block
         split_block_if_poss(currnode, needed);
+        count_resize(old_size, currnode);
         return old_ptr;
-    } else { // if client requests more space, check to see if you can coalesce (coalesces as many blocks as possible)
-        node *right_neighbor = (node *)((char *)(currnode) + sizeof(header) + extract_size(currnode));
-        while ( (void *)right_neighbor != segment_end && is_free(right_neighbor)) {
-            coalesce_right(currnode);
-            // check if coalescing provides enough space
-            if (extract_size(currnode) >= needed) {
-                // if coalesced more space than needed where after allocation, further space exists for another allocation
-                split_block_if_poss(currnode, needed);
-                
-                return old_ptr;
+    }
+
+    // the block is growing: the first time it only needs room for its mark, after that it gets headroom
+    size_t reserve = block_size_for((grown ? needed + needed / 2 : needed) + sizeof(size_t));
+
+    // its mark is about to move to the new end of the block, so it isn't trusted until rewritten
+    (currnode->hdr).sizenstatus &= ~(size_t)GROWN;
+    super->grown_blocks -= grown;
+
+    // check to see if you can coalesce (coalesces as many blocks as possible)
+    node *right_neighbor = (node *)((char *)(currnode) + sizeof(header) + extract_size(currnode));
+    while ( (void *)right_neighbor != segment_end && is_free(right_neighbor)) {
+        // past its links, a zeroed neighbor stays zero for whatever is split back off of it
+        char *zero_from = is_zeroed(right_neighbor) ? (char *)right_neighbor + sizeof(node) : NULL;
+        coalesce_right(currnode);
+        // check if coalescing provides enough space
+        if (extract_size(currnode) >= reserve) {
+            // if coalesced more space than needed where after allocation, further space exists for another allocation
+            size_t coalesced_size = extract_size(currnode);
+            split_block_if_poss(currnode, reserve);
+
+            // the chopped block is known-zero if it lies entirely past the zeroed neighbor's links
+            node *chopped_node = (node *)((char *)(currnode) + sizeof(header) + extract_size(currnode));
+            if (extract_size(currnode) != coalesced_size && zero_from != NULL && (char *)chopped_node >= zero_from) {
+                (chopped_node->hdr).sizenstatus |= ZEROED;
             }
 
-            // iterate
-            right_neighbor = (node *)((char *)(currnode) + sizeof(header) + extract_size(currnode));
+            count_resize(old_size, currnode);
+            return finish_growth(currnode, needed);
         }
 
-        // at this point, not enough space to realloc in-place
+        // iterate
+        right_neighbor = (node *)((char *)(currnode) + sizeof(header) + extract_size(currnode));
+    }
+
+    // the neighbors fell short of the reservation, but may still hold the request
+    if (extract_size(currnode) >= needed) {
+        count_resize(old_size, currnode);
+        return finish_growth(currnode, needed);
     }
 
     // MOVE REALLOC
-    
-    void *reallocated = NULL;
-    reallocated = mymalloc(new_size);
-    memcpy(reallocated, old_ptr, new_size);
-    myfree(old_ptr);
-    
-    return reallocated;
-    
+
+    // the block may have absorbed neighbors above, which it frees along with itself
+    count_resize(old_size, currnode);
+
+    // settle for just the request if the reservation can't be had
+    void *reallocated = malloc_unlocked(reserve);
+    if (reallocated == NULL) {
+        reallocated = malloc_unlocked(new_size);
+    }
+    if (reallocated == NULL) {
+        return NULL;
+    }
+    // only the old payload is copied over, as the new block may sit right after it
+    memcpy(reallocated, old_ptr, in_use < new_size ? in_use : new_size);
+    free_unlocked(old_ptr);
+
+    return finish_growth(get_hdrptr(reallocated), needed);
+    }
+}
+
+/* Function: myaligned_alloc
+ * -----------------
+ * Allocates a block whose payload starts at a multiple of alignment by walking the free list for
+ * a block that can fit an aligned payload of the requested size. Rather than over-allocating, the
+ * leading padding in front of the aligned payload stays behind as its own free block (so it must
+ * either be empty or big enough to hold a free node), and any trailing padding is split off and
+ * added to the free list as usual.
+ */
+static void *aligned_alloc_unlocked(size_t alignment, size_t requested_size) {
+
+    // alignment has to be a power of 2
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+
+    // every block is already aligned to ALIGNMENT
+    if (alignment <= ALIGNMENT) {
+        return malloc_unlocked(requested_size);
+    }
+
+    if (requested_size > MAX_REQUEST_SIZE || requested_size == 0) {
+        return NULL;
+    }
+
+    size_t needed = block_size_for(requested_size);
+
+    node *currnode = node_at(super->first_free);
+
+    while (currnode != NULL) {
+
+        // first aligned payload address inside this block
+        uintptr_t payload = (uintptr_t)currnode + sizeof(header);
+        uintptr_t aligned = roundup(payload, alignment);
+
+        // a leading gap too small to become a free block pushes the payload to the next aligned address
+        if (aligned != payload && aligned - payload < sizeof(header) + MIN_BLOCK_SIZE) {
+            aligned = roundup(payload + sizeof(header) + MIN_BLOCK_SIZE, alignment);
+        }
+        size_t leading = aligned - payload;
+
+        // if enough space exists for the leading padding and the allocation
+        if (extract_size(currnode) >= leading + needed) {
+            if (leading == 0) {
+                remove_freeblock(currnode);
+            } else {
+                // carve the aligned block out of currnode, which stays on the freelist holding the leading padding
+                size_t zeroed = (currnode->hdr).sizenstatus & ZEROED;
+                node *aligned_node = get_hdrptr((void *)aligned);
+                (aligned_node->hdr).sizenstatus = extract_size(currnode) - leading + zeroed;
+                (currnode->hdr).sizenstatus = leading - sizeof(header) + zeroed;
+                currnode = aligned_node;
+            }
+
+            // return trailing padding to the freelist
+            split_block_if_poss(currnode, needed);
+
+            // allocate block by changing header, dropping any free block status bits
+            (currnode->hdr).sizenstatus = extract_size(currnode) + ALLOCATED;
+            count_in_use(extract_size(currnode), true);
+
+            return (void *)aligned;
+        }
+
+        // iterate
+        currnode = node_at(currnode->next);
+    }
+
     return NULL;
-    
+}
+
+/* Function: myposix_memalign
+ * -----------------
+ * Wrapper around myaligned_alloc with posix_memalign's argument checking and error reporting.
+ */
+int myposix_memalign(void **memptr, size_t alignment, size_t size) {
+
+    // alignment has to be a power of 2 and a multiple of sizeof(void *)
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+
+    void *ptr = myaligned_alloc(alignment, size);
+    if (ptr == NULL && size != 0) {
+        return ENOMEM;
     }
+
+    *memptr = ptr;
+    return 0;
+}
+
+/* Function: myusable_size
+ * -----------------
+ * Returns the payload size of the allocated block at ptr, which is at least what was requested.
+ * The room a grown block has reserved past that isn't included, as reclaim_slack may take it back.
+ */
+size_t myusable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    node *block = get_hdrptr(ptr);
+    return in_region(block) ? object_size(block) : in_use_size(block);
 }
 
 /* Function: validate_heap
@@ -211,9 +1017,18 @@ void *myrealloc(void *old_ptr, size_t new_size) {
  * called mymalloc, myrealloc, and myfree. The third check is to see whether the header from each
  * iteration is a valid one (meaning its last bit is either 0 or 1). The fourth check is to see
  * if the total memory counted up from iterating sequentially is properly aligned. The fifth
- * check is to see if this total memory matches up with the inital heap_size given to us.
+ * check is to see if this total memory matches up with the inital heap_size given to us. As
+ * myattach runs this on heaps left behind by another process, no block or freelist link is
+ * followed outside the heap, and the superblock is checked first.
  */
-bool validate_heap() {
+static bool validate_unlocked(void) {
+
+    if (super->magic != HEAP_MAGIC || super->alignment != ALIGNMENT || super->min_block_size != MIN_BLOCK_SIZE ||
+        heap_extent(super->heap_size) != (size_t)((char *)segment_end - (char *)super)) {
+        printf("Superblock is corrupt!\n");
+        breakpoint();
+        return false;
+    }
 
     // total bytes of memory in heap, accumulated after iterating over each block sequentially
     size_t total_mem = 0;
@@ -222,6 +1037,10 @@ bool validate_heap() {
     node *seq_iterator = segment_begin;
     // free block counter for sequential iteration
     size_t free_seq_list = 0;
+    // allocated blocks and their payload, for checking the live counters
+    size_t allocated_seq = 0;
+    size_t in_use_seq = 0;
+    size_t grown_seq = 0;
 
     // SEQUENTIAL ITERATION
     while ((void *)seq_iterator < segment_end) {
@@ -229,40 +1048,78 @@ bool validate_heap() {
         // if block is free, add to the free_seq_list
         if (is_free(seq_iterator)) {
             free_seq_list++;
+        } else {
+            allocated_seq++;
+            in_use_seq += extract_size(seq_iterator);
+            grown_seq += is_grown(seq_iterator);
         }
 
-        // check for properly aligned and valid header, meaning that block size is a multiple of alignment and that least three significant bits are either 0 or 1
-        if ( ((seq_iterator->hdr).sizenstatus & 0x7) > 2) {
-            printf("Error! Header is misaligned, or status bit (LSB) is invalid.\n");
+        // check for a properly aligned and valid header: the block size must be one a block can have, and the status
+        // bits a combination some path sets. GROWN and SAMPLED on allocated blocks reuse the bits of AGED and ZEROED
+        // on free ones, so any mix of those is fine there, but a free block is only aged while it is stale (not
+        // zeroed) and big enough to purge
+        size_t status = (seq_iterator->hdr).sizenstatus & 0x7;
+        size_t size = extract_size(seq_iterator);
+        if (size < MIN_BLOCK_SIZE || BLOCK_ROUNDUP(size) != size ||
+            ((status & ALLOCATED) == 0 && (status & AGED) && ((status & ZEROED) || size < PURGE_THRESHOLD))) {
+            printf("Error! Header is misaligned, or its status bits are an invalid combination.\n");
+            breakpoint();
+            return false;
         }
 
         // increment total_mem
         total_mem += sizeof(header) + extract_size(seq_iterator);
 
+        // check that the block doesn't run past the end of the heap
+        if (extract_size(seq_iterator) > (size_t)((char *)segment_end - (char *)segment_begin) ||
+            total_mem > (size_t)((char *)segment_end - (char *)segment_begin)) {
+            printf("Block runs past the end of the heap!\n");
+            breakpoint();
+            return false;
+        }
+
+        // check that a grown block's mark leaves room for itself and covers a valid allocation
+        if ((status & (ALLOCATED | GROWN)) == (ALLOCATED | GROWN) && (extract_size(seq_iterator) < sizeof(size_t) ||
+            in_use_size(seq_iterator) > extract_size(seq_iterator) - sizeof(size_t) ||
+            in_use_size(seq_iterator) < MIN_BLOCK_SIZE || block_size_for(in_use_size(seq_iterator)) != in_use_size(seq_iterator))) {
+            printf("Grown block's in-use mark is out of range!\n");
+            breakpoint();
+            return false;
+        }
+
         // iterate
         seq_iterator = (node *)((char *)segment_begin + total_mem);
     }
 
     // linked list iterator
-    node *currnode = first_freenode;
+    node *currnode = node_at(super->first_free);
     // free block counter for linked list iteration
     size_t free_linked_list = 0;
+    size_t steps = 0;
 
     // LINKED LIST ITERATION
     while (currnode != NULL) {
+        // check that the link stays inside the heap, and that a cycle can't keep the walk going forever
+        if ((void *)currnode < segment_begin || (void *)currnode >= segment_end || steps++ > free_seq_list) {
+            printf("Freelist leaves the heap or loops!\n");
+            breakpoint();
+            return false;
+        }
+
         if (is_free(currnode)) {
             free_linked_list++;
         }
         
         // check if each free block is listed only once
-        if (currnode == currnode->next) {
+        if (currnode == node_at(currnode->next)) {
             printf("Free block counted twice!\n");
             breakpoint();
         }
 
-        currnode = currnode->next;
+        currnode = node_at(currnode->next);
     }
     size_t heap_size = segment_size + sizeof(header);
+    size_t free_blocks = super->free_blocks;
 
     // checks to see if free block counter from linked list iteration matches total number of free blocks from commands
     if (free_linked_list != free_blocks) {
@@ -291,6 +1148,134 @@ bool validate_heap() {
         breakpoint();
         return false;
     }
+
+    // checks that the grown blocks reclaim_slack counts on are all there are
+    if (grown_seq != super->grown_blocks) {
+        printf("Grown blocks don't match up with their count!\n");
+        breakpoint();
+        return false;
+    }
+
+    // REGION ITERATION
+
+    // every region must be an allocated block, tiled up to its top by the blocks carved from it, as many of which
+    // are live as it counts
+    node *region_iterator = node_at(super->first_region);
+    size_t regions = 0;
+    bool short_region_listed = super->short_region == 0;
+    while (region_iterator != NULL) {
+        if ((void *)region_iterator < segment_begin || (char *)region_iterator + sizeof(header) + REGION_START > (char *)segment_end ||
+            regions++ >= allocated_seq || is_free(region_iterator)) {
+            printf("Region list leaves the heap or loops!\n");
+            breakpoint();
+            return false;
+        }
+
+        region *owner = region_of(region_iterator);
+        size_t capacity = extract_size(region_iterator);
+        size_t offset = REGION_START;
+        size_t live = 0;
+        while (offset < owner->top && owner->top <= capacity) {
+            node *object = (node *)((char *)owner + offset);
+            if (!in_region(object) || region_block(object) != region_iterator ||
+                object_size(object) < MIN_BLOCK_SIZE || object_size(object) > capacity - offset - sizeof(header)) {
+                break;
+            }
+            live += ((object->hdr).sizenstatus & DEAD) == 0;
+            offset += sizeof(header) + object_size(object);
+        }
+        if (offset != owner->top || live != owner->live) {
+            printf("Region's blocks don't add up!\n");
+            breakpoint();
+            return false;
+        }
+
+        short_region_listed |= super->short_region == offset_of(region_iterator);
+        region_iterator = node_at(owner->next);
+    }
+    if (!short_region_listed) {
+        printf("Current region isn't on the list of regions!\n");
+        breakpoint();
+        return false;
+    }
+
+    // spare regions must be allocated blocks with nothing carved from them
+    node *spare_iterator = node_at(super->spare_regions);
+    size_t spares = 0;
+    while (spare_iterator != NULL) {
+        if ((void *)spare_iterator < segment_begin || (char *)spare_iterator + sizeof(header) + REGION_START > (char *)segment_end ||
+            regions++ >= allocated_seq || is_free(spare_iterator) || region_of(spare_iterator)->live != 0 ||
+            region_of(spare_iterator)->top != REGION_START) {
+            printf("Spare regions are corrupt!\n");
+            breakpoint();
+            return false;
+        }
+        spares++;
+        spare_iterator = node_at(region_of(spare_iterator)->next);
+    }
+    if (spares != super->spares) {
+        printf("Spare regions don't match up with their count!\n");
+        breakpoint();
+        return false;
+    }
+
+    // HANDLE TABLE ITERATION
+
+    // every handle in use must name an allocated block that names it back, and the unused ones must all be listed
+    if (super->handle_table != 0) {
+        node *table = get_hdrptr(myptr_at(super->handle_table));
+        if ((void *)table < segment_begin || (void *)table >= segment_end || is_free(table) ||
+            super->handle_slots > (size_t)((char *)segment_end - (char *)table) / sizeof(handle_slot) ||
+            in_use_size(table) < super->handle_slots * sizeof(handle_slot)) {
+            printf("Handle table is corrupt!\n");
+            breakpoint();
+            return false;
+        }
+
+        size_t unused = 0;
+        for (heap_handle handle = 1; handle <= super->handle_slots; handle++) {
+            handle_slot *slot = slot_of(handle);
+            if (slot->block == 0) {
+                unused++;
+                continue;
+            }
+            node *block = get_hdrptr(myptr_at(slot->block));
+            if ((void *)block < segment_begin || (char *)block + sizeof(header) + MIN_BLOCK_SIZE > (char *)segment_end ||
+                is_free(block) || extract_size(block) > (size_t)((char *)segment_end - (char *)block) - sizeof(header) ||
+                *handle_mark(block) != handle) {
+                printf("Handle doesn't lead to its block!\n");
+                breakpoint();
+                return false;
+            }
+        }
+
+        size_t listed = 0;
+        heap_handle free_handle = super->free_handles;
+        while (free_handle != 0) {
+            if (free_handle > super->handle_slots || slot_of(free_handle)->block != 0 || listed++ >= unused) {
+                printf("Unused handles are corrupt!\n");
+                breakpoint();
+                return false;
+            }
+            free_handle = slot_of(free_handle)->pins;
+        }
+        if (listed != unused) {
+            printf("Unused handles don't match up with their list!\n");
+            breakpoint();
+            return false;
+        }
+    } else if (super->handle_slots != 0 || super->free_handles != 0) {
+        printf("Handle table is corrupt!\n");
+        breakpoint();
+        return false;
+    }
+
+    // checks that the live counters add up to the blocks found (other processes sharing a heap aren't counted)
+    if (!shared_heap && (stats.in_use_blocks != allocated_seq || stats.in_use_bytes != in_use_seq)) {
+        printf("Heap stats don't add up to the heap!\n");
+        breakpoint();
+        return false;
+    }
     
     return true;
 }
@@ -311,6 +1296,27 @@ void dump_heap() {
     }      
 }
 
+/* Function: heap_snapshot
+ * -----------------
+ * Streams every block of the heap, in address order, to fd in the binary format of heap_snapshot.h.
+ * Offsets are measured from the first block, past the superblock. Unlike dump_heap this stays usable
+ * on heaps with millions of blocks, since the result is analyzed offline.
+ */
+static bool snapshot_unlocked(int fd) {
+
+    snapshot_writer writer;
+    if (!snapshot_begin(&writer, fd, (char *)segment_end - (char *)segment_begin)) {
+        return false;
+    }
+    node *iterator = segment_begin;
+    while ((void *)iterator < segment_end) {
+        size_t offset = (char *)iterator + sizeof(header) - (char *)segment_begin;
+        snapshot_block(&writer, offset, extract_size(iterator), !is_free(iterator));
+        iterator = (node *)((char *)(iterator) + sizeof(header) + extract_size(iterator));
+    }
+    return snapshot_end(&writer);
+}
+
 // HELPER FUNCTIONS
 
 /* Function: roundup
@@ -322,59 +1328,76 @@ size_t roundup(size_t sz, size_t mult) {
     return (sz + mult - 1) & ~(mult - 1);
 }
 
+// payload of the block that holds a request of requested_size bytes. Everything but the comparison folds into
+// constants, so this is an add and a mask
+size_t block_size_for(size_t requested_size) {
+    return requested_size <= MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : BLOCK_ROUNDUP(requested_size);
+}
+
+// bytes of a heap of heap_size bytes that its blocks tile: the tail too short to keep the last block aligned is left out
+size_t heap_extent(size_t heap_size) {
+    return heap_size - (heap_size - SUPERBLOCK_SIZE) % ALIGNMENT;
+}
+
 // get size of the block
 size_t extract_size(node *newnode) {
-    return ((newnode->hdr).sizenstatus) & 0xfffffffe;
+    return ((newnode->hdr).sizenstatus) & ~(size_t)0x7;
 }
 
 // add a freeblock, incrementing number of free blocks
 void add_freeblock(node *newnode) {
 
-    // rewire pointers to add newnode to front of free list
-    if (first_freenode) {
-        first_freenode->prev = newnode;
-        newnode->next = first_freenode;
-        newnode->prev = NULL;
-        first_freenode = newnode;
+    // rewire links to add newnode to front of free list
+    if (super->first_free) {
+        node_at(super->first_free)->prev = offset_of(newnode);
+        newnode->next = super->first_free;
+        newnode->prev = 0;
+        super->first_free = offset_of(newnode);
     } else { // if list is empty
-        first_freenode = newnode;
+        newnode->next = 0;
+        newnode->prev = 0;
+        super->first_free = offset_of(newnode);
     }
 
-    free_blocks++;
+    super->free_blocks++;
 }
 
 // remove a freeblock, decrementing number of free blocks
 void remove_freeblock(node *newnode) {
    if (newnode->prev) {
-       (newnode->prev)->next = newnode->next;
+       node_at(newnode->prev)->next = newnode->next;
    }
 
    if (newnode->next) {
-       (newnode->next)->prev = newnode->prev;
+       node_at(newnode->next)->prev = newnode->prev;
    }
 
    // update head of freelist if necessary
-   if (first_freenode == newnode) {
-       first_freenode = newnode->next;
+   if (super->first_free == offset_of(newnode)) {
+       super->first_free = newnode->next;
    }
 
    // decrement number of free blocks
-   free_blocks--;
+   super->free_blocks--;
 }
 
 // if block is large enough to host an allocation and another free block, splits block into two, with rightmost block being free block
 void split_block_if_poss(node *currnode, size_t needed) {
-    if (extract_size(currnode) - needed >= sizeof(header) + ALIGNMENT * 2) {
+    if (extract_size(currnode) - needed >= sizeof(header) + MIN_BLOCK_SIZE) {
         size_t remaining = extract_size(currnode);
                 
-        // update currnode_head while maintaining status in left block
-        (currnode->hdr).sizenstatus = needed + ( ((currnode->hdr).sizenstatus) & 0x1);
+        size_t status = ((currnode->hdr).sizenstatus) & 0x7;
 
         // chopped free block
         node *chopped_node = (node *)((char *)currnode + sizeof(header) + needed);
 
-        // update chopped node size
-        (chopped_node->hdr).sizenstatus = remaining - needed - sizeof(header);
+        // update chopped node size, staying known-zero if it was carved out of a zeroed free block. It is
+        // written before currnode shrinks, so the heap can be walked at any point (see rebuild_freelist)
+        size_t zeroed = (status & (ALLOCATED | ZEROED)) == ZEROED ? ZEROED : 0;
+        (chopped_node->hdr).sizenstatus = remaining - needed - sizeof(header) + zeroed;
+
+        // update currnode_head while maintaining status in left block
+        (currnode->hdr).sizenstatus = needed + status;
 
         // add chopped node (freeblock) to freelist
         add_freeblock(chopped_node);
@@ -393,6 +1416,11 @@ void coalesce_right (node *newnode) {
     // sever right neighbor from freelist
     remove_freeblock(right_neighbor);
 
+    // mymaintain must not pick up in the middle of the merged block
+    if (right_neighbor == maintain_cursor) {
+        maintain_cursor = newnode;
+    }
+
     // update newnode's payload size
     size_t rightneighbor_size = extract_size(right_neighbor);
     (newnode->hdr).sizenstatus += sizeof(header) + rightneighbor_size;
@@ -402,3 +1430,465 @@ void coalesce_right (node *newnode) {
 node *get_hdrptr(void *ptr) {
     return (node *)((char *)(ptr) - sizeof(header));
 }
+
+// turn an offset from the superblock back into a block, or NULL for 0
+node *node_at(uint64_t offset) {
+    return offset ? (node *)((char *)super + offset) : NULL;
+}
+
+// the offset from the superblock that refers to ptr, or 0 for NULL
+uint64_t offset_of(void *ptr) {
+    return ptr ? (uint64_t)((char *)ptr - (char *)super) : 0;
+}
+
+// points the allocator's variables at the heap in heap_start, and picks how it returns pages to the OS
+void attach_segment(void *heap_start, size_t heap_size) {
+    super = heap_start;
+    segment_begin = (char *)heap_start + SUPERBLOCK_SIZE;
+    segment_end = (char *)heap_start + heap_extent(heap_size);
+
+    // a huge-page segment is only ever purged a whole huge page at a time
+    bool in_segment = heap_start == heap_segment_start();
+    purge_page_size = in_segment ? heap_segment_page_size() : PAGE_SIZE;
+    purge_advice = in_segment && heap_segment_shared() ? MADV_REMOVE : MADV_DONTNEED;
+}
+
+// checking if a free block's payload past its links is known to be zero
+bool is_zeroed(node *newnode) {
+    return (((newnode->hdr).sizenstatus) & (ALLOCATED | ZEROED)) == ZEROED;
+}
+
+// finds the first free block that fits needed bytes, splitting off any excess and removing it from the freelist.
+// When none does, the room reserved for grown blocks is taken back before giving up
+node *take_freeblock(size_t needed) {
+
+    node *currnode = node_at(super->first_free);
+
+    // iterate until enough space exists for an allocation
+    while (currnode != NULL && extract_size(currnode) < needed) {
+        currnode = node_at(currnode->next);
+    }
+
+    if (currnode == NULL) {
+        currnode = reclaim_slack(needed);
+        if (currnode == NULL) {
+            return NULL;
+        }
+    }
+
+    // if enough space exists for another allocation after allocating current block
+    split_block_if_poss(currnode, needed);
+
+    // remove newly allocated block from freelist, decrementing number of free blocks
+    remove_freeblock(currnode);
+
+    return currnode;
+}
+
+// checking if an allocated block has room reserved to grow into
+bool is_grown(node *newnode) {
+    return (((newnode->hdr).sizenstatus) & GROWN) != 0;
+}
+
+// the last word of a grown block, which holds how many bytes of it are in use
+size_t *grown_mark(node *newnode) {
+    return (size_t *)((char *)(newnode) + sizeof(header) + extract_size(newnode) - sizeof(size_t));
+}
+
+// bytes of an allocated block the client may use: the whole payload, or for a grown block what its mark says
+size_t in_use_size(node *newnode) {
+    return is_grown(newnode) ? *grown_mark(newnode) : extract_size(newnode);
+}
+
+// marks a block realloc just grew to needed bytes as grown, if it has room past them for the mark; the mark is
+// written before the status bit, so a walk over the heap never finds a grown block without one. Returns its payload
+void *finish_growth(node *currnode, size_t needed) {
+    if (needed + sizeof(size_t) <= extract_size(currnode)) {
+        *grown_mark(currnode) = needed;
+        (currnode->hdr).sizenstatus |= GROWN;
+        super->grown_blocks++;
+    }
+    return (char *)(currnode) + sizeof(header);
+}
+
+// walks the heap splitting the unused reservations off grown blocks and coalescing them into the free blocks
+// after them, until one is big enough for needed bytes. Returns that free block, or NULL if none came of it.
+// The walk stops once no grown block is left, so it costs nothing while there are none
+node *reclaim_slack(size_t needed) {
+    node *iterator = segment_begin;
+    while ((void *)iterator < segment_end && super->grown_blocks > 0) {
+        if (!is_free(iterator) && is_grown(iterator)) {
+            size_t in_use = in_use_size(iterator);
+            size_t reserved = extract_size(iterator);
+            (iterator->hdr).sizenstatus &= ~(size_t)GROWN;
+            super->grown_blocks--;
+            split_block_if_poss(iterator, in_use);
+            count_resize(reserved, iterator);
+
+            if (extract_size(iterator) != reserved) {
+                node *chopped_node = (node *)((char *)(iterator) + sizeof(header) + extract_size(iterator));
+                node *right_neighbor = (node *)((char *)(chopped_node) + sizeof(header) + extract_size(chopped_node));
+                while ((void *)right_neighbor != segment_end && is_free(right_neighbor)) {
+                    coalesce_right(chopped_node);
+                    right_neighbor = (node *)((char *)(chopped_node) + sizeof(header) + extract_size(chopped_node));
+                }
+                if (extract_size(chopped_node) >= needed) {
+                    return chopped_node;
+                }
+            }
+        }
+        iterator = (node *)((char *)(iterator) + sizeof(header) + extract_size(iterator));
+    }
+    return NULL;
+}
+
+// takes the lock of a shared heap (a no-op otherwise). If the last holder died in the middle of a call, the
+// freelist may be half rewired, so it is rebuilt from the block headers before the heap is used again; if even
+// those are broken, the lock is released without being marked consistent, and the heap stays unusable
+bool lock_heap(void) {
+    if (!shared_heap) {
+        return true;
+    }
+    int result = pthread_mutex_lock(&super->lock);
+    if (result == EOWNERDEAD) {
+        if (!rebuild_freelist()) {
+            pthread_mutex_unlock(&super->lock);
+            return false;
+        }
+        pthread_mutex_consistent(&super->lock);
+        result = 0;
+    }
+    return result == 0;
+}
+
+void unlock_heap(void) {
+    if (shared_heap) {
+        pthread_mutex_unlock(&super->lock);
+    }
+}
+
+// rebuilds the freelist, and the count of grown blocks, from a sequential walk over the heap. Every header update keeps the heap walkable, so this
+// recovers from a call that was cut short anywhere (blocks it had allocated for itself stay allocated). Returns
+// false if the headers don't tile the heap exactly
+bool rebuild_freelist(void) {
+    super->first_free = 0;
+    super->free_blocks = 0;
+    super->grown_blocks = 0;
+
+    node *iterator = segment_begin;
+    while ((void *)iterator < segment_end) {
+        if (extract_size(iterator) > (size_t)((char *)segment_end - (char *)iterator) - sizeof(header)) {
+            return false;
+        }
+        if (is_free(iterator)) {
+            add_freeblock(iterator);
+        }
+        super->grown_blocks += !is_free(iterator) && is_grown(iterator);
+        iterator = (node *)((char *)(iterator) + sizeof(header) + extract_size(iterator));
+    }
+    return (void *)iterator == segment_end;
+}
+
+// adds an allocated block of size bytes to the counters, or takes one away
+void count_in_use(size_t size, bool allocated) {
+    int size_class = 63 - __builtin_clzl(size);
+    if (allocated) {
+        stats.in_use_bytes += size;
+        stats.in_use_blocks++;
+        stats.class_blocks[size_class]++;
+    } else {
+        stats.in_use_bytes -= size;
+        stats.in_use_blocks--;
+        stats.class_blocks[size_class]--;
+    }
+}
+
+// accounts for an allocated block that was old_size bytes being resized in place
+void count_resize(size_t old_size, node *newnode) {
+    if (extract_size(newnode) != old_size) {
+        count_in_use(old_size, false);
+        count_in_use(extract_size(newnode), true);
+    }
+}
+
+// starts the counters over for the heap just set up or attached, counting the blocks already allocated in it
+void reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+    stats.magic = HEAP_STATS_MAGIC;
+    stats.version = HEAP_STATS_VERSION;
+    stats.size = sizeof(heap_stats);
+    stats.heap_bytes = (char *)segment_end - (char *)segment_begin;
+
+    // an attached heap can be corrupt, which validate_heap reports; the walk only has to stay inside it
+    node *iterator = segment_begin;
+    while ((void *)iterator < segment_end &&
+        extract_size(iterator) <= (size_t)((char *)segment_end - (char *)iterator) - sizeof(header)) {
+        if (!is_free(iterator)) {
+            count_in_use(extract_size(iterator), true);
+        }
+        iterator = (node *)((char *)(iterator) + sizeof(header) + extract_size(iterator));
+    }
+}
+
+// copies the counters to the published page in one seqlock section
+void publish_counters(void) {
+    mystats();
+    heap_stats_begin(published_stats);
+    stats.sequence = published_stats->sequence;
+    *published_stats = stats;
+    heap_stats_end(published_stats);
+    calls_since_publish = 0;
+}
+
+// counts a call that may have changed the heap, publishing the counters every STATS_PUBLISH_INTERVAL of them
+void count_call(void) {
+    if (published_stats != NULL && ++calls_since_publish >= STATS_PUBLISH_INTERVAL) {
+        publish_counters();
+    }
+}
+
+// coalesces the free block newnode with the free blocks to its right. Returns where the stale bytes of the
+// result end, assuming its own payload is stale, and sets absorbed_zeroed if it took in a known-zero block
+char *coalesce_free_run(node *newnode, bool *absorbed_zeroed) {
+    char *dirty_end = (char *)(newnode) + sizeof(header) + extract_size(newnode);
+
+    node *right_neighbor = (node *)((char *)(newnode) + sizeof(header) + extract_size(newnode));
+    while ( (void *)right_neighbor != segment_end && is_free(right_neighbor)) {
+        if (is_zeroed(right_neighbor)) {
+            // its header and links become stale bytes in the middle of the coalesced block
+            dirty_end = (char *)right_neighbor + sizeof(node);
+            *absorbed_zeroed = true;
+        } else {
+            dirty_end = (char *)right_neighbor + sizeof(header) + extract_size(right_neighbor);
+        }
+        coalesce_right(newnode);
+        //iterate
+        right_neighbor = (node *)((char *)(newnode) + sizeof(header) + extract_size(newnode));
+    }
+    return dirty_end;
+}
+
+// zeroes the stale bytes of a free block (its payload past the links, up to dirty_end) so it can be marked
+// known-zero: whole pages inside large spans are handed back to the OS, and small spans are only cleared by
+// hand when that keeps a zeroed neighbor it absorbed (such as the segment tail) from losing its zero status.
+// Without release_pages, large spans are left stale for mymaintain to purge later
+void purge_block(node *newnode, char *dirty_end, bool keep_zeroed, bool release_pages) {
+    char *dirty_start = (char *)(newnode) + sizeof(node);
+
+    if (dirty_end <= dirty_start) {
+        (newnode->hdr).sizenstatus |= ZEROED;
+        return;
+    }
+
+    size_t dirty = dirty_end - dirty_start;
+    char *page_start = (char *)roundup((uintptr_t)dirty_start, purge_page_size);
+    char *page_end = (char *)((uintptr_t)dirty_end & ~(uintptr_t)(purge_page_size - 1));
+    if (dirty >= PURGE_THRESHOLD && page_end > page_start) {
+        if (!release_pages || madvise(page_start, page_end - page_start, purge_advice) != 0) {
+            return;
+        }
+        stats.purges++;
+        stats.purged_bytes += page_end - page_start;
+
+        // with huge pages the partial pages at either end can be too big to be worth clearing by hand
+        if ((page_start - dirty_start) + (dirty_end - page_end) > PURGE_THRESHOLD) {
+            return;
+        }
+        memset(dirty_start, 0, page_start - dirty_start);
+        memset(page_end, 0, dirty_end - page_end);
+    } else if (keep_zeroed && dirty < PURGE_THRESHOLD) {
+        memset(dirty_start, 0, dirty);
+    } else {
+        return;
+    }
+
+    (newnode->hdr).sizenstatus |= ZEROED;
+}
+
+// zeroes a payload, switching to non-temporal stores for large ones so they don't evict the whole cache
+void zero_payload(void *ptr, size_t size) {
+#ifdef __SSE2__
+    if (size >= NONTEMPORAL_THRESHOLD) {
+        char *curr = ptr;
+        char *end = curr + size;
+
+        // streaming stores need 16-byte alignment
+        char *aligned = (char *)roundup((uintptr_t)curr, 16);
+        memset(curr, 0, aligned - curr);
+
+        __m128i zero = _mm_setzero_si128();
+        for (curr = aligned; curr + 64 <= end; curr += 64) {
+            _mm_stream_si128((__m128i *)curr, zero);
+            _mm_stream_si128((__m128i *)(curr + 16), zero);
+            _mm_stream_si128((__m128i *)(curr + 32), zero);
+            _mm_stream_si128((__m128i *)(curr + 48), zero);
+        }
+        _mm_sfence();
+
+        memset(curr, 0, end - curr);
+        return;
+    }
+#endif
+    memset(ptr, 0, size);
+}
+
+// checking if a block the client holds was carved from a region rather than taken from the freelist
+bool in_region(node *newnode) {
+    return (((newnode->hdr).sizenstatus) & ALLOCATED) == 0;
+}
+
+// payload size of a block carved from a region
+size_t object_size(node *object) {
+    return (uint32_t)((object->hdr).sizenstatus) & ~(size_t)0x7;
+}
+
+// the region's own block, which a block carved from it records the distance back to
+node *region_block(node *object) {
+    return (node *)((char *)(object) - ((object->hdr).sizenstatus >> 32));
+}
+
+// the region header at the front of a region's block
+region *region_of(node *block) {
+    return (region *)((char *)(block) + sizeof(header));
+}
+
+// makes a new region the one short-lived blocks go in, reusing a spare if there is one. The current region is retired
+// if nothing is left in it. Returns the region's block, or NULL if the heap has no room for it
+node *new_region(void) {
+    node *block = node_at(super->spare_regions);
+    if (block != NULL) {
+        super->spare_regions = region_of(block)->next;
+        super->spares--;
+    } else {
+        block = take_freeblock(block_size_for(SHORT_REGION_SIZE));
+        if (block == NULL) {
+            return NULL;
+        }
+        (block->hdr).sizenstatus = extract_size(block) + ALLOCATED;
+        count_in_use(extract_size(block), true);
+    }
+
+    node *current = node_at(super->short_region);
+    super->short_region = 0;
+    if (current != NULL && region_of(current)->live == 0) {
+        retire_region(current);
+    }
+
+    region *owner = region_of(block);
+    owner->prev = 0;
+    owner->next = super->first_region;
+    owner->live = 0;
+    owner->top = REGION_START;
+    if (super->first_region) {
+        region_of(node_at(super->first_region))->prev = offset_of(block);
+    }
+    super->first_region = offset_of(block);
+    super->short_region = offset_of(block);
+    return block;
+}
+
+// takes an emptied region off the list of regions in use, keeping it as a spare or freeing its block
+void retire_region(node *block) {
+    region *owner = region_of(block);
+    if (owner->prev) {
+        region_of(node_at(owner->prev))->next = owner->next;
+    } else {
+        super->first_region = owner->next;
+    }
+    if (owner->next) {
+        region_of(node_at(owner->next))->prev = owner->prev;
+    }
+
+    if (super->spares < SPARE_REGIONS) {
+        owner->prev = 0;
+        owner->next = super->spare_regions;
+        owner->top = REGION_START;
+        super->spare_regions = offset_of(block);
+        super->spares++;
+    } else {
+        free_unlocked((char *)(block) + sizeof(header));
+    }
+}
+
+// the entry of the handle table for handle
+handle_slot *slot_of(heap_handle handle) {
+    return (handle_slot *)myptr_at(super->handle_table) + (handle - 1);
+}
+
+// the last word of a handle's block, which holds the handle
+uint64_t *handle_mark(node *block) {
+    return (uint64_t *)((char *)(block) + sizeof(header) + extract_size(block) - sizeof(uint64_t));
+}
+
+// checking if an allocated block belongs to a handle with no pins, so it can be moved. Any block's last word may
+// happen to hold a valid handle, but only the handle's own block is named back by its entry
+bool is_movable(node *block) {
+    if (is_free(block) || super->handle_table == 0) {
+        return false;
+    }
+    uint64_t handle = *handle_mark(block);
+    if (handle == 0 || handle > super->handle_slots) {
+        return false;
+    }
+    handle_slot *slot = slot_of(handle);
+    return slot->block == offset_of((char *)(block) + sizeof(header)) && slot->pins == 0;
+}
+
+// doubles the handle table (or allocates its first HANDLE_TABLE_SLOTS entries), putting the new entries on the list of
+// unused ones. The table is an ordinary block, which mymaintain never moves. Returns false if the heap has no room
+bool grow_handle_table(void) {
+    size_t old_slots = super->handle_slots;
+    size_t slots = old_slots ? old_slots * 2 : HANDLE_TABLE_SLOTS;
+    if (slots > MAX_REQUEST_SIZE / sizeof(handle_slot)) {
+        return false;
+    }
+    handle_slot *table = realloc_unlocked(myptr_at(super->handle_table), slots * sizeof(handle_slot));
+    if (table == NULL) {
+        return false;
+    }
+
+    for (size_t index = old_slots; index < slots; index++) {
+        table[index].block = 0;
+        table[index].pins = index + 1 < slots ? index + 2 : super->free_handles;
+    }
+    super->handle_table = offset_of(table);
+    super->handle_slots = slots;
+    super->free_handles = old_slots + 1;
+    return true;
+}
+
+// moves the handle's block right after free_block down to where free_block starts, leaving the free space after it
+// instead (stale, as it holds what the block's payload used to). Returns the block at its new place
+node *slide_down(node *free_block, node *block) {
+    size_t free_size = extract_size(free_block);
+    size_t size = extract_size(block);
+    size_t status = (block->hdr).sizenstatus & 0x7;
+
+    // the free block's links are about to be written over
+    remove_freeblock(free_block);
+    memmove((char *)(free_block) + sizeof(header), (char *)(block) + sizeof(header), size);
+    (free_block->hdr).sizenstatus = size + status;
+
+    node *freed = (node *)((char *)(free_block) + sizeof(header) + size);
+    (freed->hdr).sizenstatus = free_size;
+    add_freeblock(freed);
+
+    slot_of(*handle_mark(free_block))->block = offset_of((char *)(free_block) + sizeof(header));
+    return free_block;
+}
+
+// frees a block carved from a region. The last one freed empties the region, which is reused from the start if new
+// blocks still go there, and retired otherwise
+void free_object(node *object) {
+    node *block = region_block(object);
+    region *owner = region_of(block);
+    (object->hdr).sizenstatus = ((object->hdr).sizenstatus & ~(size_t)SAMPLED) | DEAD;
+
+    if (--owner->live == 0) {
+        if (super->short_region == offset_of(block)) {
+            owner->top = REGION_START;
+        } else {
+            retire_region(block);
+        }
+    }
+}
@@ -0,0 +1,145 @@
+/* File: explicit.h
+ * ----------------
+ * Interface for the extensions the explicit allocator offers on top of
+ * allocator.h. Only explicit.c implements these.
+ */
+#ifndef _EXPLICIT_H
+#define _EXPLICIT_H
+
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Function: myusable_size
+ * -----------------------
+ * Returns the number of bytes usable in the allocated block at ptr, which
+ * is at least the size that was requested for it (0 for NULL).
+ */
+size_t myusable_size(void *ptr);
+
+/* Function: myfree_sized
+ * ----------------------
+ * Frees the block at ptr, whose requested size the caller already knows
+ * (as C++ deallocation does). The size must not exceed what was requested
+ * for the block; it is checked against the block's header.
+ */
+void myfree_sized(void *ptr, size_t size);
+
+/* Function: myattach
+ * ------------------
+ * Picks the allocator back up over a heap that myinit set up earlier in
+ * the same memory, such as a file-backed segment (init_heap_segment_file)
+ * mapped again after a restart. The heap stores no absolute addresses, so
+ * it may be mapped at a different address this time. Returns false if the
+ * memory doesn't hold a heap of heap_size bytes, the heap was set up by a
+ * build with a different ALIGNMENT or MIN_BLOCK_SIZE, or it fails
+ * validate_heap, e.g. because the previous process died in the middle of
+ * a call.
+ */
+bool myattach(void *heap_start, size_t heap_size);
+
+/* Functions: myget_root, myset_root
+ * ---------------------------------
+ * A persistent heap keeps one root pointer (NULL until set) for finding
+ * the client's data again after myattach. The root should point at a
+ * block from this heap; it is stored relative to the heap, so it follows
+ * the heap to wherever it is mapped.
+ */
+void *myget_root(void);
+void myset_root(void *ptr);
+
+/* Function: myinit_shared
+ * -----------------------
+ * Sets up a heap, like myinit, that several processes use at the same
+ * time, e.g. over a segment from init_heap_segment_shm. The other
+ * processes join with myattach. Every call on the heap is then serialized
+ * by a robust process-shared lock. If a process dies holding the lock, the
+ * next caller rebuilds the free list from the block headers and carries
+ * on. Blocks the dead process held stay allocated.
+ */
+bool myinit_shared(void *heap_start, size_t heap_size);
+
+/* Functions: myoffset_of, myptr_at
+ * --------------------------------
+ * Convert a block to its offset in the heap and back. Processes sharing a
+ * heap may each map it at a different address, so they hand blocks to one
+ * another as offsets. NULL and offset 0 correspond.
+ */
+uint64_t myoffset_of(void *ptr);
+void *myptr_at(uint64_t offset);
+
+/* Functions: mymark_sampled, myis_sampled
+ * ---------------------------------------
+ * Mark an allocated block as sampled by a heap profiler (heapprof.h), and
+ * check for the mark. It is kept in the block's header and cleared when
+ * the block is freed; it stays with the block when myrealloc resizes it in
+ * place, but not when it moves the block.
+ */
+void mymark_sampled(void *ptr);
+bool myis_sampled(void *ptr);
+
+/* Functions: mystats, mypublish_stats, mysync_stats
+ * -------------------------------------------------
+ * The allocator keeps live counters about its heap (heap_stats.h).
+ * mystats returns them, up to date; the caller may add to the counters
+ * the allocator leaves to it (the lock's) while no call is running on the
+ * heap. mypublish_stats has them copied to page, such as a page of shared
+ * memory where other processes can read them at any time, every 1024
+ * calls from then on, and mysync_stats copies them there right away. The
+ * page must stay mapped for as long as the heap is in use.
+ */
+struct heap_stats;
+struct heap_stats *mystats(void);
+void mypublish_stats(struct heap_stats *page);
+void mysync_stats(void);
+
+/* Functions: mymaintain, mydefer_purging
+ * --------------------------------------
+ * mymaintain does a slice of upkeep that the other calls can put off:
+ * it coalesces runs of adjacent free blocks and hands the pages of large
+ * free blocks that have stayed stale for a while back to the OS. It works
+ * through the heap a little at a time, picking up where the last call
+ * stopped, and does at most budget units of work (one per block visited,
+ * more per purge or block moved). It also slides the blocks of unpinned
+ * handles (see myhandle_alloc) down over the free blocks before them.
+ * Meant to be called periodically, e.g. from a background thread, with
+ * mydefer_purging(true) so that myfree leaves purging to it. Returns how
+ * many blocks it coalesced, purged or moved. Like every other call, it
+ * takes no lock on a private heap: the caller must serialize it with all
+ * other calls on the heap, as the shim does with its own lock. Shared
+ * heaps are left alone.
+ */
+size_t mymaintain(size_t budget);
+void mydefer_purging(bool defer);
+
+/* Functions: myhandle_alloc, myhandle_pin, myhandle_unpin, myhandle_free
+ * ----------------------------------------------------------------------
+ * Movable blocks, for long-running processes whose heap fragments no
+ * matter how blocks are placed. myhandle_alloc returns a handle to a block
+ * of at least size bytes (0 if the request can't be satisfied), and
+ * myhandle_pin the block's current address. Pins nest, and the address
+ * stays valid until the matching myhandle_unpin. While a handle has no
+ * pins, mymaintain may move its block down the heap into the free block
+ * before it, so that free space gathers into large blocks without a
+ * restart. myhandle_free frees the block, pinned or not, and the handle
+ * must not be used after that. Handles are kept in the heap, so they stay
+ * valid across myattach. On a private heap these calls take no lock, so a
+ * thread that pins a handle while another runs mymaintain must serialize
+ * the two with the same lock; a pin only keeps the block in place for
+ * later calls. The shim doesn't export them.
+ */
+typedef uint64_t heap_handle;
+heap_handle myhandle_alloc(size_t size);
+void *myhandle_pin(heap_handle handle);
+void myhandle_unpin(heap_handle handle);
+void myhandle_free(heap_handle handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,110 @@
+/* File: heap_resource.hpp
+ * -----------------------
+ * C++ adapters for the explicit allocator: a std::pmr::memory_resource for
+ * pmr containers, and an STL-compatible Allocator<T> for everything else.
+ * Both allocate from the heap set up by myinit, so myinit must have been
+ * called before either is used. Deallocation hands the known size down to
+ * myfree_sized.
+ *
+ *     heap::explicit_resource resource;
+ *     std::pmr::vector<int> v(&resource);
+ *     std::vector<int, heap::Allocator<int>> w;
+ */
+
+#ifndef _HEAP_RESOURCE_HPP
+#define _HEAP_RESOURCE_HPP
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include "allocator.h"
+#include "explicit.h"
+
+namespace heap {
+
+/* Function: allocate_bytes
+ * ------------------------
+ * Allocates size bytes aligned to alignment from the heap, throwing
+ * std::bad_alloc if the heap cannot satisfy the request. Zero-byte
+ * requests still get a unique block.
+ */
+inline void *allocate_bytes(std::size_t size, std::size_t alignment) {
+    if (size == 0) {
+        size = 1;
+    }
+    void *ptr = alignment <= ALIGNMENT ? mymalloc(size) : myaligned_alloc(alignment, size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+/* Function: deallocate_bytes
+ * --------------------------
+ * Returns a block from allocate_bytes to the heap. The alignment a block
+ * was allocated with doesn't matter here, as its header always sits right
+ * in front of the payload.
+ */
+inline void deallocate_bytes(void *ptr, std::size_t size, std::size_t) {
+    myfree_sized(ptr, size == 0 ? 1 : size);
+}
+
+/* Class: explicit_resource
+ * ------------------------
+ * A memory_resource over the explicit allocator's heap. Every instance
+ * shares the same heap, so any two of them compare equal.
+ */
+class explicit_resource : public std::pmr::memory_resource {
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return allocate_bytes(bytes, alignment);
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) override {
+        deallocate_bytes(ptr, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const explicit_resource *>(&other) != nullptr;
+    }
+};
+
+/* Class: Allocator
+ * ----------------
+ * A stateless STL allocator over the explicit allocator's heap, for
+ * containers that take an allocator type rather than a memory_resource.
+ */
+template <class T>
+struct Allocator {
+    using value_type = T;
+
+    Allocator() noexcept = default;
+
+    template <class U>
+    Allocator(const Allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if (n > MAX_REQUEST_SIZE / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(allocate_bytes(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        deallocate_bytes(ptr, n * sizeof(T), alignof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const Allocator<T> &, const Allocator<U> &) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const Allocator<T> &, const Allocator<U> &) noexcept {
+    return false;
+}
+
+} // namespace heap
+
+#endif
@@ -0,0 +1,62 @@
+/* File: heap_snapshot.c
+ * ---------------------
+ * Buffered writer for the binary heap snapshots described in heap_snapshot.h.
+ */
+
+#include "heap_snapshot.h"
+#include <errno.h>
+#include <unistd.h>
+
+/* Function: write_all
+ * -------------------
+ * Writes all size bytes to fd, retrying short and interrupted writes.
+ * Returns false if the write fails.
+ */
+static bool write_all(int fd, const void *data, size_t size) {
+    const char *cur = data;
+    while (size > 0) {
+        ssize_t nwritten = write(fd, cur, size);
+        if (nwritten < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        cur += nwritten;
+        size -= nwritten;
+    }
+    return true;
+}
+
+static void flush_records(snapshot_writer *writer) {
+    if (!writer->failed && writer->nbuffered > 0) {
+        writer->failed = !write_all(writer->fd, writer->buffer, writer->nbuffered * sizeof(snapshot_record));
+    }
+    writer->nbuffered = 0;
+}
+
+bool snapshot_begin(snapshot_writer *writer, int fd, size_t heap_size) {
+    snapshot_header header = {
+        .magic = HEAP_SNAPSHOT_MAGIC,
+        .version = HEAP_SNAPSHOT_VERSION,
+        .record_size = sizeof(snapshot_record),
+        .heap_size = heap_size,
+    };
+    writer->fd = fd;
+    writer->nbuffered = 0;
+    writer->failed = !write_all(fd, &header, sizeof(header));
+    return !writer->failed;
+}
+
+void snapshot_block(snapshot_writer *writer, size_t offset, size_t size, bool allocated) {
+    if (writer->nbuffered == SNAPSHOT_BUFFER_RECORDS) {
+        flush_records(writer);
+    }
+    writer->buffer[writer->nbuffered++] = (snapshot_record){
+        .offset = offset,
+        .sizenstatus = size | (allocated ? SNAPSHOT_ALLOCATED : 0),
+    };
+}
+
+bool snapshot_end(snapshot_writer *writer) {
+    flush_records(writer);
+    return !writer->failed;
+}
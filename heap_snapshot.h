@@ -0,0 +1,71 @@
+/* File: heap_snapshot.h
+ * ---------------------
+ * Binary format written by heap_snapshot, and the buffered writer the
+ * allocators use to produce it. A snapshot is a snapshot_header followed by
+ * one snapshot_record per block, in address order, until the end of the
+ * file. The heapsnap tool reads them back for offline analysis.
+ *
+ * The writer never allocates, so a snapshot can be taken from inside the
+ * allocator (or from under the LD_PRELOAD shim) without touching the heap.
+ */
+
+#ifndef _HEAP_SNAPSHOT_H
+#define _HEAP_SNAPSHOT_H
+
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+#include <stdint.h>
+
+#define HEAP_SNAPSHOT_MAGIC 0x50414e5350414548ULL // "HEAPSNAP"
+#define HEAP_SNAPSHOT_VERSION 1
+
+// low bit of a record's sizenstatus, set for allocated blocks
+#define SNAPSHOT_ALLOCATED 0x1
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;   // sizeof(snapshot_record), so readers can skip fields they don't know
+    uint64_t heap_size;     // bytes of heap the records are laid out in
+} snapshot_header;
+
+typedef struct {
+    uint64_t offset;        // of the block's payload from the start of the heap
+    uint64_t sizenstatus;   // payload bytes, with SNAPSHOT_ALLOCATED in the low bit
+} snapshot_record;
+
+// records are collected this many at a time before being written out
+#define SNAPSHOT_BUFFER_RECORDS 256
+
+typedef struct {
+    int fd;
+    bool failed;
+    size_t nbuffered;
+    snapshot_record buffer[SNAPSHOT_BUFFER_RECORDS];
+} snapshot_writer;
+
+
+/* Function: snapshot_begin
+ * ------------------------
+ * Starts a snapshot of a heap_size-byte heap on fd by writing its header.
+ * Returns false if the write fails.
+ */
+bool snapshot_begin(snapshot_writer *writer, int fd, size_t heap_size);
+
+
+/* Function: snapshot_block
+ * ------------------------
+ * Adds the block whose payload starts offset bytes into the heap. Blocks
+ * must be added in address order.
+ */
+void snapshot_block(snapshot_writer *writer, size_t offset, size_t size, bool allocated);
+
+
+/* Function: snapshot_end
+ * ----------------------
+ * Writes out any buffered records. Returns false if any write along the
+ * way failed.
+ */
+bool snapshot_end(snapshot_writer *writer);
+
+#endif
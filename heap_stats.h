@@ -0,0 +1,95 @@
+/* File: heap_stats.h
+ * ------------------
+ * Live counters the explicit allocator keeps about its heap, laid out so
+ * they can be published in a page of shared memory and read by another
+ * process (the heaptop tool) while the allocator keeps running.
+ *
+ * The allocator is the only writer, and it only writes with its lock held.
+ * Readers never take that lock: the counters are guarded by a seqlock, so
+ * a reader copies them out and retries if the sequence number shows that
+ * the allocator was in the middle of an update.
+ */
+
+#ifndef _HEAP_STATS_H
+#define _HEAP_STATS_H
+
+#include <stdbool.h> // for bool
+#include <stdint.h>
+#include <string.h>
+
+#define HEAP_STATS_MAGIC 0x5354415450414548ULL // "HEAPSTAT"
+#define HEAP_STATS_VERSION 1
+
+// allocated blocks are counted by size class: class c holds payloads of 2^c up to 2^(c+1) bytes
+#define HEAP_STATS_CLASSES 64
+
+// the shim publishes a process's counters under this POSIX shared memory name, followed by its pid
+#define HEAP_STATS_SHM_PREFIX "/heapstats."
+
+typedef struct heap_stats {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size;                  // sizeof(heap_stats), so readers can tell a layout they don't know
+    uint64_t sequence;              // odd while the allocator is updating the counters below
+
+    uint64_t heap_bytes;            // bytes of heap the blocks are laid out in
+    uint64_t in_use_bytes;          // payload of the allocated blocks
+    uint64_t in_use_blocks;
+    uint64_t free_bytes;            // payload of the free blocks
+    uint64_t free_blocks;
+
+    uint64_t mallocs;               // calls that allocated a block (malloc, calloc and aligned alloc)
+    uint64_t frees;
+    uint64_t reallocs;
+
+    uint64_t purges;                // spans of free pages handed back to the OS
+    uint64_t purged_bytes;
+
+    uint64_t lock_acquisitions;     // of the lock serializing calls, by whoever publishes the page
+    uint64_t lock_contended;        // acquisitions that had to wait for another thread
+    uint64_t remote_frees;          // frees handed to the lock holder rather than waiting
+
+    uint64_t class_blocks[HEAP_STATS_CLASSES];
+} heap_stats;
+
+_Static_assert(sizeof(heap_stats) <= 4096, "the counters must fit in a page");
+
+
+/* Functions: heap_stats_begin, heap_stats_end
+ * -------------------------------------------
+ * Bracket every update of the counters. Between them the sequence number
+ * is odd, so readers know to retry.
+ */
+static inline void heap_stats_begin(heap_stats *stats) {
+    __atomic_store_n(&stats->sequence, stats->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void heap_stats_end(heap_stats *stats) {
+    __atomic_store_n(&stats->sequence, stats->sequence + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Function: heap_stats_read
+ * -------------------------
+ * Copies a consistent set of counters out of stats, which another process
+ * may be updating. Returns false if they don't settle after many tries
+ * (the writer died mid-update) or stats isn't a page of counters.
+ */
+static inline bool heap_stats_read(const heap_stats *stats, heap_stats *copy) {
+    for (int attempt = 0; attempt < 100000; attempt++) {
+        uint64_t before = __atomic_load_n(&stats->sequence, __ATOMIC_ACQUIRE);
+        if (before % 2 != 0) {
+            continue;
+        }
+        memcpy(copy, (const void *)stats, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&stats->sequence, __ATOMIC_RELAXED) == before) {
+            return copy->magic == HEAP_STATS_MAGIC && copy->version == HEAP_STATS_VERSION &&
+                copy->size == sizeof(heap_stats);
+        }
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,441 @@
+/* File: heapprof.c
+ * ----------------
+ * Sampling heap profiler described in heapprof.h.
+ *
+ * Two tables are kept in memory mapped for them: one bucket per distinct
+ * call stack, counting the samples taken and freed there, and the sampled
+ * blocks still alive, keyed by address (linear probing, with backward-shift
+ * deletion so no tombstones build up). Both are guarded by a spinlock that
+ * a signal handler can try to take; when it can't, the dump it asked for is
+ * written by whoever releases the lock.
+ */
+
+#define _GNU_SOURCE // for dl_iterate_phdr
+#include "heapprof.h"
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// frames kept per sampled stack, not counting those inside this library
+#define MAX_DEPTH 32
+
+// distinct call stacks, and sampled blocks alive at once, that the tables have room for
+#define MAX_STACKS 8192
+#define MAX_LIVE (1 << 16)
+
+typedef struct {
+    uint64_t hash;          // 0 for an unused bucket
+    int depth;
+    void *frames[MAX_DEPTH];
+    size_t allocs, alloc_bytes;
+    size_t frees, free_bytes;
+} stack_bucket;
+
+typedef struct {
+    void *ptr;              // NULL for an unused slot
+    size_t size;
+    stack_bucket *bucket;
+} live_sample;
+
+typedef struct {
+    stack_bucket stacks[MAX_STACKS];
+    live_sample live[MAX_LIVE];
+    size_t nlive;
+} profile_tables;
+
+__thread long heapprof_countdown __attribute__((tls_model("initial-exec")));
+static __thread uint64_t rng_state __attribute__((tls_model("initial-exec")));   // 0 until the thread's first sample is drawn
+static __thread bool in_profiler __attribute__((tls_model("initial-exec")));     // set while backtrace runs, as it may allocate
+
+static profile_tables *tables;
+static bool running = false;
+static size_t sample_interval;
+static char tables_locked;
+static bool dump_pending;
+
+// where signals and exit write their profiles: <prefix>.<pid>.<n>.heap
+static char profile_prefix[PATH_MAX - 32];
+static unsigned dump_count;
+
+// code of this library, whose frames are left out of the recorded stacks
+static uintptr_t own_text_start, own_text_end;
+
+static void write_profile_file(void);
+
+
+/* LOCKING */
+
+
+static bool try_lock_tables(void) {
+    return !__atomic_test_and_set(&tables_locked, __ATOMIC_ACQUIRE);
+}
+
+static void lock_tables(void) {
+    while (!try_lock_tables()) {
+        sched_yield();
+    }
+}
+
+// releases the tables, then writes any profile a signal asked for while they were held
+static void unlock_tables(void) {
+    __atomic_clear(&tables_locked, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&dump_pending, __ATOMIC_ACQUIRE) && try_lock_tables()) {
+        __atomic_store_n(&dump_pending, false, __ATOMIC_RELAXED);
+        write_profile_file();
+        __atomic_clear(&tables_locked, __ATOMIC_RELEASE);
+    }
+}
+
+static void on_dump_signal(int signo) {
+    (void)signo;
+    int saved_errno = errno;
+    __atomic_store_n(&dump_pending, true, __ATOMIC_RELEASE);
+    if (try_lock_tables()) {
+        unlock_tables();
+    }
+    errno = saved_errno;
+}
+
+
+/* SAMPLING */
+
+
+static int find_own_text(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    (void)data;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X) &&
+            (uintptr_t)&heapprof_start >= start && (uintptr_t)&heapprof_start < start + phdr->p_memsz) {
+            own_text_start = start;
+            own_text_end = start + phdr->p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool heapprof_start(const char *prefix, size_t interval, int signo) {
+    if (running || strlen(prefix) >= sizeof(profile_prefix)) {
+        return false;
+    }
+    tables = mmap(NULL, sizeof(profile_tables), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tables == MAP_FAILED) {
+        tables = NULL;
+        return false;
+    }
+    strcpy(profile_prefix, prefix);
+    sample_interval = interval > 0 ? interval : HEAPPROF_DEFAULT_INTERVAL;
+    dl_iterate_phdr(find_own_text, NULL);
+
+    // the first backtrace loads the unwinder, which allocates; get that over with before anything is sampled
+    void *frame;
+    in_profiler = true;
+    backtrace(&frame, 1);
+    in_profiler = false;
+
+    if (signo != 0) {
+        struct sigaction action = { .sa_handler = on_dump_signal, .sa_flags = SA_RESTART };
+        sigemptyset(&action.sa_mask);
+        sigaction(signo, &action, NULL);
+    }
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+// xorshift64*, seeded differently in every thread by the address of its state
+static uint64_t next_random(void) {
+    if (rng_state == 0) {
+        rng_state = (uintptr_t)&rng_state * 0x9e3779b97f4a7c15ULL | 1;
+    }
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+bool heapprof_next_sample(void) {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        // check back now and then, in case the profiler starts after this thread's first allocations
+        heapprof_countdown = HEAPPROF_DEFAULT_INTERVAL;
+        return false;
+    }
+
+    // a new thread only draws its first gap, so its first allocation isn't always the one sampled
+    bool first = rng_state == 0;
+
+    // exponentially distributed gaps, with u uniform in (0, 1]
+    double u = ((next_random() >> 11) + 1) * 0x1.0p-53;
+    double gap = -log(u) * sample_interval;
+    heapprof_countdown = gap < 1 ? 1 : gap >= LONG_MAX ? LONG_MAX : (long)gap;
+    return !first;
+}
+
+
+/* TABLES */
+
+
+// the bucket for a stack, added if it's new. NULL if the table is full
+static stack_bucket *find_bucket(void **frames, int depth) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)frames[i]) * 0x100000001b3ULL;
+    }
+    hash |= 1;
+
+    for (size_t probe = 0; probe < MAX_STACKS; probe++) {
+        stack_bucket *bucket = &tables->stacks[(hash + probe) % MAX_STACKS];
+        if (bucket->hash == 0) {
+            bucket->hash = hash;
+            bucket->depth = depth;
+            memcpy(bucket->frames, frames, depth * sizeof(void *));
+            return bucket;
+        }
+        if (bucket->hash == hash && bucket->depth == depth && memcmp(bucket->frames, frames, depth * sizeof(void *)) == 0) {
+            return bucket;
+        }
+    }
+    return NULL;
+}
+
+// the slot where a block's address would be found first
+static size_t live_home(void *ptr) {
+    return (((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL >> 16) & (MAX_LIVE - 1);
+}
+
+bool heapprof_record_alloc(void *ptr, size_t size) {
+    if (in_profiler || tables == NULL) {
+        return false;
+    }
+
+    void *frames[MAX_DEPTH + 8];
+    in_profiler = true;
+    int depth = backtrace(frames, MAX_DEPTH + 8);
+    in_profiler = false;
+
+    // leave out the frames of the malloc family and the profiler itself
+    int skip = 0;
+    while (skip < depth && (uintptr_t)frames[skip] >= own_text_start && (uintptr_t)frames[skip] < own_text_end) {
+        skip++;
+    }
+    depth = depth - skip < MAX_DEPTH ? depth - skip : MAX_DEPTH;
+
+    lock_tables();
+    stack_bucket *bucket = find_bucket(frames + skip, depth);
+
+    // the live table is kept at most 3/4 full so probes stay short
+    bool recorded = bucket != NULL && tables->nlive < MAX_LIVE / 4 * 3;
+    if (recorded) {
+        size_t slot = live_home(ptr);
+        while (tables->live[slot].ptr != NULL) {
+            slot = (slot + 1) & (MAX_LIVE - 1);
+        }
+        tables->live[slot] = (live_sample){ .ptr = ptr, .size = size, .bucket = bucket };
+        tables->nlive++;
+        bucket->allocs++;
+        bucket->alloc_bytes += size;
+    }
+    unlock_tables();
+    return recorded;
+}
+
+void heapprof_record_free(void *ptr) {
+    if (tables == NULL) {
+        return;
+    }
+    lock_tables();
+    size_t hole = live_home(ptr);
+    while (tables->live[hole].ptr != NULL && tables->live[hole].ptr != ptr) {
+        hole = (hole + 1) & (MAX_LIVE - 1);
+    }
+    if (tables->live[hole].ptr != NULL) {
+        tables->live[hole].bucket->frees++;
+        tables->live[hole].bucket->free_bytes += tables->live[hole].size;
+        tables->nlive--;
+
+        // pull back every later entry of the run that would no longer be found past the hole
+        for (size_t next = (hole + 1) & (MAX_LIVE - 1); tables->live[next].ptr != NULL; next = (next + 1) & (MAX_LIVE - 1)) {
+            size_t home = live_home(tables->live[next].ptr);
+            if (((next - home) & (MAX_LIVE - 1)) >= ((next - hole) & (MAX_LIVE - 1))) {
+                tables->live[hole] = tables->live[next];
+                hole = next;
+            }
+        }
+        tables->live[hole].ptr = NULL;
+    }
+    unlock_tables();
+}
+
+
+/* OUTPUT */
+
+
+// buffered writer formatting by hand, as stdio isn't safe to use from a signal handler
+typedef struct {
+    int fd;
+    bool failed;
+    size_t len;
+    char buffer[4096];
+} text_writer;
+
+static void flush_text(text_writer *writer) {
+    size_t done = 0;
+    while (!writer->failed && done < writer->len) {
+        ssize_t nwritten = write(writer->fd, writer->buffer + done, writer->len - done);
+        if (nwritten < 0 && errno != EINTR) {
+            writer->failed = true;
+        } else if (nwritten > 0) {
+            done += nwritten;
+        }
+    }
+    writer->len = 0;
+}
+
+static void put_text(text_writer *writer, const char *text, size_t len) {
+    while (len > 0) {
+        if (writer->len == sizeof(writer->buffer)) {
+            flush_text(writer);
+        }
+        size_t chunk = sizeof(writer->buffer) - writer->len < len ? sizeof(writer->buffer) - writer->len : len;
+        memcpy(writer->buffer + writer->len, text, chunk);
+        writer->len += chunk;
+        text += chunk;
+        len -= chunk;
+    }
+}
+
+static void put_str(text_writer *writer, const char *str) {
+    put_text(writer, str, strlen(str));
+}
+
+// value in the given base, right-aligned to width characters by padding with pad
+static void put_number(text_writer *writer, uint64_t value, unsigned base, int width, char pad) {
+    char digits[24];
+    int ndigits = 0;
+    do {
+        digits[sizeof(digits) - ++ndigits] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value > 0);
+    for (; width > ndigits; width--) {
+        put_text(writer, &pad, 1);
+    }
+    put_text(writer, digits + sizeof(digits) - ndigits, ndigits);
+}
+
+// "live: bytes [cumulative: bytes]", as each line of the profile starts
+static void put_counts(text_writer *writer, size_t live, size_t live_bytes, size_t allocs, size_t alloc_bytes) {
+    put_number(writer, live, 10, 6, ' ');
+    put_str(writer, ": ");
+    put_number(writer, live_bytes, 10, 8, ' ');
+    put_str(writer, " [");
+    put_number(writer, allocs, 10, 6, ' ');
+    put_str(writer, ": ");
+    put_number(writer, alloc_bytes, 10, 8, ' ');
+    put_str(writer, "] @");
+}
+
+// writes the profile with the tables held
+static bool dump_locked(int fd) {
+    text_writer writer = { .fd = fd };
+
+    size_t live = 0, live_bytes = 0, allocs = 0, alloc_bytes = 0;
+    for (size_t i = 0; i < MAX_STACKS; i++) {
+        stack_bucket *bucket = &tables->stacks[i];
+        live += bucket->allocs - bucket->frees;
+        live_bytes += bucket->alloc_bytes - bucket->free_bytes;
+        allocs += bucket->allocs;
+        alloc_bytes += bucket->alloc_bytes;
+    }
+
+    // heap_v2 tells pprof the counts are samples taken every sample_interval bytes on average, to scale back up
+    put_str(&writer, "heap profile: ");
+    put_counts(&writer, live, live_bytes, allocs, alloc_bytes);
+    put_str(&writer, " heap_v2/");
+    put_number(&writer, sample_interval, 10, 0, ' ');
+    put_str(&writer, "\n");
+
+    for (size_t i = 0; i < MAX_STACKS; i++) {
+        stack_bucket *bucket = &tables->stacks[i];
+        if (bucket->allocs == 0) {
+            continue;
+        }
+        put_counts(&writer, bucket->allocs - bucket->frees, bucket->alloc_bytes - bucket->free_bytes,
+            bucket->allocs, bucket->alloc_bytes);
+        for (int frame = 0; frame < bucket->depth; frame++) {
+            put_str(&writer, " 0x");
+            put_number(&writer, (uintptr_t)bucket->frames[frame], 16, 0, ' ');
+        }
+        put_str(&writer, "\n");
+    }
+
+    // the memory map lets pprof find the binary or library each address belongs to
+    put_str(&writer, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        char chunk[1024];
+        ssize_t nread;
+        while ((nread = read(maps, chunk, sizeof(chunk))) != 0) {
+            if (nread < 0 && errno == EINTR) continue;
+            if (nread < 0) break;
+            put_text(&writer, chunk, nread);
+        }
+        close(maps);
+    }
+    flush_text(&writer);
+    return !writer.failed;
+}
+
+bool heapprof_dump(int fd) {
+    if (tables == NULL) {
+        return false;
+    }
+    lock_tables();
+    bool written = dump_locked(fd);
+    unlock_tables();
+    return written;
+}
+
+// writes the next numbered profile file, with the tables held
+static void write_profile_file(void) {
+    text_writer path = { .fd = -1 };
+    put_str(&path, profile_prefix);
+    put_str(&path, ".");
+    put_number(&path, getpid(), 10, 0, ' ');
+    put_str(&path, ".");
+    put_number(&path, dump_count++, 10, 4, '0');
+    put_str(&path, ".heap");
+    put_text(&path, "", 1);
+
+    int fd = open(path.buffer, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        dump_locked(fd);
+        close(fd);
+    }
+}
+
+void heapprof_before_fork(void) {
+    lock_tables();
+}
+
+void heapprof_after_fork(void) {
+    unlock_tables();
+}
+
+__attribute__((destructor))
+static void dump_at_exit(void) {
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        lock_tables();
+        write_profile_file();
+        unlock_tables();
+    }
+}
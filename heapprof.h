@@ -0,0 +1,102 @@
+/* File: heapprof.h
+ * ----------------
+ * Sampling heap profiler for the LD_PRELOAD shim. On average one
+ * allocation per interval bytes is sampled: the gaps between samples are
+ * drawn from an exponential distribution, so every byte is equally likely
+ * to be picked no matter how the program sizes its requests. A sampled
+ * allocation has its call stack recorded, and the profile of which stacks
+ * hold memory (live) and which allocated it over the whole run
+ * (cumulative) is written in pprof's legacy heap format:
+ *
+ *     pprof --text ./program profile.heap
+ *
+ * An allocation that isn't sampled only pays for decrementing a
+ * thread-local countdown (heapprof_should_sample). On free, the allocator
+ * tells sampled blocks apart by a mark in their header (myis_sampled), so
+ * the profiler's tables are only consulted for those.
+ *
+ * Nothing here allocates from the heap: the tables are mapped on their own
+ * when profiling starts, and a profile can be written from a signal
+ * handler.
+ */
+
+#ifndef _HEAPPROF_H
+#define _HEAPPROF_H
+
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+
+// default mean number of bytes allocated between two samples
+#define HEAPPROF_DEFAULT_INTERVAL (512 * 1024)
+
+// bytes the calling thread has left to allocate before its next sample. Initial-exec TLS, so reading
+// it from inside malloc never has to allocate the thread's TLS block
+extern __thread long heapprof_countdown __attribute__((tls_model("initial-exec")));
+
+
+/* Function: heapprof_start
+ * ------------------------
+ * Starts sampling one allocation per interval bytes on average. Profiles
+ * are written to <prefix>.<pid>.<n>.heap each time signo (if not 0) is
+ * delivered, and once more at exit. Returns false if the profiler's tables
+ * couldn't be mapped, in which case nothing is sampled.
+ */
+bool heapprof_start(const char *prefix, size_t interval, int signo);
+
+
+/* Function: heapprof_next_sample
+ * ------------------------------
+ * Slow path of heapprof_should_sample, taken when the countdown runs out:
+ * draws the gap to the thread's next sample and returns whether the
+ * profiler is running.
+ */
+bool heapprof_next_sample(void);
+
+
+/* Function: heapprof_should_sample
+ * --------------------------------
+ * Returns whether an allocation of size bytes should be sampled, which
+ * the caller then does with heapprof_record_alloc.
+ */
+static inline bool heapprof_should_sample(size_t size) {
+    heapprof_countdown -= (long)size;
+    return heapprof_countdown < 0 && heapprof_next_sample();
+}
+
+
+/* Function: heapprof_record_alloc
+ * -------------------------------
+ * Records the call stack of the sampled allocation of size bytes at ptr.
+ * Returns false if it couldn't be recorded (the tables are full, or the
+ * stack unwinder itself allocated), in which case the block must not be
+ * marked sampled.
+ */
+bool heapprof_record_alloc(void *ptr, size_t size);
+
+
+/* Function: heapprof_record_free
+ * ------------------------------
+ * Records that the sampled block at ptr is about to be freed.
+ */
+void heapprof_record_free(void *ptr);
+
+
+/* Function: heapprof_dump
+ * -----------------------
+ * Writes the current profile to fd. Returns false if the profiler isn't
+ * running or a write fails.
+ */
+bool heapprof_dump(int fd);
+
+
+/* Functions: heapprof_before_fork, heapprof_after_fork
+ * ----------------------------------------------------
+ * Hold the profiler's tables across fork, in the parent and the child
+ * alike, so the child never inherits them half updated. The allocator's
+ * own lock has to be taken first, as frees record into the tables while
+ * holding it.
+ */
+void heapprof_before_fork(void);
+void heapprof_after_fork(void);
+
+#endif
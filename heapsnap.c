@@ -0,0 +1,294 @@
+/*
+ * File: heapsnap.c
+ * ----------------
+ * Offline analyzer for the binary heap snapshots written by heap_snapshot.
+ *
+ *     heapsnap [-w width] [-r rows] snapshot     summary, free-size histogram and fragmentation map
+ *     heapsnap -d before after                   what changed between two snapshots
+ *
+ * The fragmentation map covers the heap up to the end of its last allocated
+ * block, one character per cell: ' ' for all free, '#' for all allocated,
+ * and '.:-=+*' for the fractions in between.
+ */
+
+#include <error.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap_snapshot.h"
+
+// free blocks are bucketed by power of two, with the last bucket holding everything bigger
+#define NUM_BUCKETS 48
+
+// struct for one snapshot read back in
+typedef struct {
+    const char *name;
+    uint64_t heap_size;
+    snapshot_record *records;
+    size_t num_records;
+} snapshot_t;
+
+// struct for totals computed over one snapshot
+typedef struct {
+    size_t num_allocated, num_free;
+    uint64_t allocated_bytes, free_bytes, overhead_bytes;
+    uint64_t largest_free;      // largest request that can be satisfied without growing the heap
+    uint64_t used_extent;       // end of the last allocated block
+    size_t bucket_count[NUM_BUCKETS];
+    uint64_t bucket_bytes[NUM_BUCKETS];
+} stats_t;
+
+
+static snapshot_t read_snapshot(const char *filename);
+static stats_t compute_stats(const snapshot_t *snap);
+static void print_summary(const snapshot_t *snap, const stats_t *stats);
+static void print_histogram(const stats_t *stats);
+static void print_map(const snapshot_t *snap, const stats_t *stats, int width, int rows);
+static void print_diff(const snapshot_t *before, const snapshot_t *after);
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    bool diff = false;
+    int width = 64;
+    int rows = 16;
+    while ((c = getopt(argc, argv, "dw:r:")) != EOF) {
+        if (c == 'd') {
+            diff = true;
+        } else if (c == 'w') {
+            width = atoi(optarg);
+        } else if (c == 'r') {
+            rows = atoi(optarg);
+        }
+    }
+    if (argc - optind != (diff ? 2 : 1) || width <= 0 || rows <= 0) {
+        error(1, 0, "Usage: heapsnap [-w width] [-r rows] snapshot | heapsnap -d before after");
+    }
+
+    if (diff) {
+        snapshot_t before = read_snapshot(argv[optind]);
+        snapshot_t after = read_snapshot(argv[optind + 1]);
+        print_diff(&before, &after);
+        free(before.records);
+        free(after.records);
+    } else {
+        snapshot_t snap = read_snapshot(argv[optind]);
+        stats_t stats = compute_stats(&snap);
+        print_summary(&snap, &stats);
+        print_histogram(&stats);
+        print_map(&snap, &stats, width, rows);
+        free(snap.records);
+    }
+    return 0;
+}
+
+/* Function: read_snapshot
+ * -----------------------
+ * Reads a whole snapshot file into memory, exiting with an error if it
+ * isn't one.
+ */
+static snapshot_t read_snapshot(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        error(1, 0, "Could not open snapshot \"%s\"", filename);
+    }
+
+    snapshot_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != HEAP_SNAPSHOT_MAGIC) {
+        error(1, 0, "\"%s\" is not a heap snapshot", filename);
+    }
+    if (header.version != HEAP_SNAPSHOT_VERSION || header.record_size < sizeof(snapshot_record)) {
+        error(1, 0, "\"%s\" is a version %u snapshot, expected version %d", filename,
+              header.version, HEAP_SNAPSHOT_VERSION);
+    }
+
+    snapshot_t snap = { .name = filename, .heap_size = header.heap_size };
+    size_t capacity = 0;
+    char record[header.record_size];
+    while (fread(record, header.record_size, 1, fp) == 1) {
+        if (snap.num_records == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            snap.records = realloc(snap.records, capacity * sizeof(snapshot_record));
+            if (snap.records == NULL) {
+                error(1, 0, "Out of memory reading \"%s\"", filename);
+            }
+        }
+        memcpy(&snap.records[snap.num_records++], record, sizeof(snapshot_record));
+    }
+    fclose(fp);
+    return snap;
+}
+
+static uint64_t record_size(const snapshot_record *rec) {
+    return rec->sizenstatus & ~(uint64_t)SNAPSHOT_ALLOCATED;
+}
+
+static bool record_allocated(const snapshot_record *rec) {
+    return rec->sizenstatus & SNAPSHOT_ALLOCATED;
+}
+
+// power-of-two bucket for a free block: bucket b holds sizes in [2^b, 2^(b+1))
+static int bucket_of(uint64_t size) {
+    int bucket = size == 0 ? 0 : 63 - __builtin_clzll(size);
+    return bucket < NUM_BUCKETS ? bucket : NUM_BUCKETS - 1;
+}
+
+static stats_t compute_stats(const snapshot_t *snap) {
+    stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    for (size_t i = 0; i < snap->num_records; i++) {
+        const snapshot_record *rec = &snap->records[i];
+        uint64_t size = record_size(rec);
+        if (record_allocated(rec)) {
+            stats.num_allocated++;
+            stats.allocated_bytes += size;
+            if (rec->offset + size > stats.used_extent) {
+                stats.used_extent = rec->offset + size;
+            }
+        } else {
+            stats.num_free++;
+            stats.free_bytes += size;
+            if (size > stats.largest_free) {
+                stats.largest_free = size;
+            }
+            stats.bucket_count[bucket_of(size)]++;
+            stats.bucket_bytes[bucket_of(size)] += size;
+        }
+    }
+    stats.overhead_bytes = snap->heap_size - stats.allocated_bytes - stats.free_bytes;
+    return stats;
+}
+
+/* Function: print_summary
+ * -----------------------
+ * Prints block counts and byte totals. External fragmentation is the share
+ * of free memory that lies outside the largest free block, i.e. that can't
+ * serve the largest request the heap could otherwise satisfy.
+ */
+static void print_summary(const snapshot_t *snap, const stats_t *stats) {
+    printf("%s: %zu blocks in a %lu-byte heap\n", snap->name, snap->num_records, snap->heap_size);
+    printf("  allocated  %10zu blocks %14lu bytes\n", stats->num_allocated, stats->allocated_bytes);
+    printf("  free       %10zu blocks %14lu bytes\n", stats->num_free, stats->free_bytes);
+    printf("  overhead   %10s        %14lu bytes\n", "", stats->overhead_bytes);
+    printf("  used extent %lu bytes, largest allocatable %lu bytes\n", stats->used_extent, stats->largest_free);
+    if (stats->free_bytes > 0) {
+        printf("  external fragmentation %.1f%%\n",
+               100.0 * (stats->free_bytes - stats->largest_free) / stats->free_bytes);
+    }
+}
+
+static void print_histogram(const stats_t *stats) {
+    printf("\nFree block sizes:\n");
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+        if (stats->bucket_count[b] > 0) {
+            printf("  [%10lu, %10lu)  %10zu blocks %14lu bytes\n", 1UL << b, 1UL << (b + 1),
+                   stats->bucket_count[b], stats->bucket_bytes[b]);
+        }
+    }
+}
+
+/* Function: print_map
+ * -------------------
+ * Divides the used extent of the heap into width * rows cells and prints
+ * how much of each cell is allocated. Records are in address order, so
+ * one pass spreads each allocated block over the cells it overlaps.
+ */
+static void print_map(const snapshot_t *snap, const stats_t *stats, int width, int rows) {
+    static const char shades[] = " .:-=+*#";
+    size_t ncells = (size_t)width * rows;
+    if (stats->used_extent == 0) {
+        printf("\nNo allocated blocks to map.\n");
+        return;
+    }
+    double cell_size = (double)stats->used_extent / ncells;
+    double *allocated = calloc(ncells, sizeof(double));
+    if (allocated == NULL) {
+        error(1, 0, "Out of memory mapping \"%s\"", snap->name);
+    }
+
+    for (size_t i = 0; i < snap->num_records; i++) {
+        const snapshot_record *rec = &snap->records[i];
+        if (!record_allocated(rec)) continue;
+        double start = rec->offset;
+        double end = rec->offset + record_size(rec);
+        for (size_t cell = start / cell_size; cell < ncells && cell * cell_size < end; cell++) {
+            double lo = cell * cell_size > start ? cell * cell_size : start;
+            double hi = (cell + 1) * cell_size < end ? (cell + 1) * cell_size : end;
+            allocated[cell] += hi - lo;
+        }
+    }
+
+    printf("\nFragmentation map (%.0f bytes per cell, ' ' free to '#' allocated):\n", cell_size);
+    for (int row = 0; row < rows; row++) {
+        printf("  %12lu |", (uint64_t)(row * width * cell_size));
+        for (int col = 0; col < width; col++) {
+            double fraction = allocated[row * width + col] / cell_size;
+            int shade = fraction <= 0 ? 0 : fraction >= 1 ? 7 : 1 + (int)(fraction * 6);
+            putchar(shades[shade]);
+        }
+        printf("|\n");
+    }
+    free(allocated);
+}
+
+/* Function: print_diff
+ * --------------------
+ * Compares two snapshots of the same heap. Blocks are matched by offset:
+ * a block is unchanged if the other snapshot has one at the same offset
+ * with the same size and status, and counts as new or gone otherwise.
+ */
+static void print_diff(const snapshot_t *before, const snapshot_t *after) {
+    stats_t b = compute_stats(before);
+    stats_t a = compute_stats(after);
+
+    size_t unchanged = 0, allocated_new = 0, allocated_gone = 0, free_new = 0, free_gone = 0;
+    size_t i = 0, j = 0;
+    while (i < before->num_records || j < after->num_records) {
+        const snapshot_record *old = i < before->num_records ? &before->records[i] : NULL;
+        const snapshot_record *cur = j < after->num_records ? &after->records[j] : NULL;
+        if (old != NULL && cur != NULL && old->offset == cur->offset) {
+            if (old->sizenstatus == cur->sizenstatus) {
+                unchanged++;
+            } else {
+                *(record_allocated(old) ? &allocated_gone : &free_gone) += 1;
+                *(record_allocated(cur) ? &allocated_new : &free_new) += 1;
+            }
+            i++;
+            j++;
+        } else if (cur == NULL || (old != NULL && old->offset < cur->offset)) {
+            *(record_allocated(old) ? &allocated_gone : &free_gone) += 1;
+            i++;
+        } else {
+            *(record_allocated(cur) ? &allocated_new : &free_new) += 1;
+            j++;
+        }
+    }
+
+    printf("%s -> %s\n", before->name, after->name);
+    printf("  %-24s %14s %14s %14s\n", "", "before", "after", "change");
+    printf("  %-24s %14zu %14zu %+14ld\n", "allocated blocks", b.num_allocated, a.num_allocated,
+           (long)a.num_allocated - (long)b.num_allocated);
+    printf("  %-24s %14lu %14lu %+14ld\n", "allocated bytes", b.allocated_bytes, a.allocated_bytes,
+           (long)a.allocated_bytes - (long)b.allocated_bytes);
+    printf("  %-24s %14zu %14zu %+14ld\n", "free blocks", b.num_free, a.num_free,
+           (long)a.num_free - (long)b.num_free);
+    printf("  %-24s %14lu %14lu %+14ld\n", "free bytes", b.free_bytes, a.free_bytes,
+           (long)a.free_bytes - (long)b.free_bytes);
+    printf("  %-24s %14lu %14lu %+14ld\n", "used extent", b.used_extent, a.used_extent,
+           (long)a.used_extent - (long)b.used_extent);
+    printf("  %-24s %14lu %14lu %+14ld\n", "largest allocatable", b.largest_free, a.largest_free,
+           (long)a.largest_free - (long)b.largest_free);
+    printf("\n  %zu blocks unchanged; %zu allocated and %zu free blocks appeared, %zu allocated and %zu free blocks went away\n",
+           unchanged, allocated_new, free_new, allocated_gone, free_gone);
+
+    printf("\nFree block sizes (before -> after):\n");
+    for (int bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+        if (b.bucket_count[bucket] > 0 || a.bucket_count[bucket] > 0) {
+            printf("  [%10lu, %10lu)  %10zu -> %10zu blocks\n", 1UL << bucket, 1UL << (bucket + 1),
+                   b.bucket_count[bucket], a.bucket_count[bucket]);
+        }
+    }
+}
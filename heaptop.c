@@ -0,0 +1,230 @@
+/*
+ * File: heaptop.c
+ * ---------------
+ * Live monitor for processes running on the LD_PRELOAD shim with
+ * HEAP_STATS=1, which publishes the allocator's counters (heap_stats.h) in
+ * shared memory. The counters are only ever read, under their seqlock, so
+ * the monitored process is never stopped or slowed down. The shim copies
+ * them to the page at least every 100 ms, so they are at most that stale.
+ *
+ *     heaptop                        one line per process publishing counters
+ *     heaptop [-1] [-d secs] pid     counters of one process, refreshed every secs (1 by default)
+ *
+ * With -1 the counters are printed once instead of refreshed.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "heap_stats.h"
+
+// where POSIX shared memory objects show up as files
+#define SHM_DIR "/dev/shm"
+
+// widest bar of the size class histogram
+#define BAR_WIDTH 40
+
+
+static const heap_stats *map_stats(int pid);
+static void print_process_list(void);
+static void print_process(int pid, const heap_stats *now, const heap_stats *before, double seconds);
+static const char *format_bytes(uint64_t bytes, char *buffer, size_t size);
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    bool once = false;
+    double delay = 1;
+    while ((c = getopt(argc, argv, "1d:")) != EOF) {
+        if (c == '1') {
+            once = true;
+        } else if (c == 'd') {
+            delay = atof(optarg);
+        }
+    }
+    if (argc - optind > 1 || delay <= 0) {
+        error(1, 0, "Usage: heaptop | heaptop [-1] [-d secs] pid");
+    }
+
+    if (argc == optind) {
+        print_process_list();
+        return 0;
+    }
+
+    int pid = atoi(argv[optind]);
+    const heap_stats *stats = map_stats(pid);
+    if (stats == NULL) {
+        error(1, 0, "Process %d isn't publishing heap stats (run it with HEAP_STATS=1 under libexplicit.so)", pid);
+    }
+
+    heap_stats before, now;
+    if (!heap_stats_read(stats, &before)) {
+        error(1, 0, "Could not read the heap stats of process %d", pid);
+    }
+    if (once) {
+        print_process(pid, &before, NULL, 0);
+        return 0;
+    }
+
+    struct timespec pause = { .tv_sec = (time_t)delay, .tv_nsec = (long)((delay - (time_t)delay) * 1e9) };
+    while (kill(pid, 0) == 0 || errno != ESRCH) {
+        nanosleep(&pause, NULL);
+        if (!heap_stats_read(stats, &now)) {
+            error(1, 0, "Could not read the heap stats of process %d", pid);
+        }
+        // clear the terminal and print from the top
+        printf("\033[H\033[J");
+        print_process(pid, &now, &before, delay);
+        fflush(stdout);
+        before = now;
+    }
+    printf("Process %d has exited.\n", pid);
+    return 0;
+}
+
+/* Function: map_stats
+ * -------------------
+ * Maps the counters a process publishes, read-only. Returns NULL if it
+ * doesn't publish any.
+ */
+static const heap_stats *map_stats(int pid) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s%d", HEAP_STATS_SHM_PREFIX, pid);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    const heap_stats *stats = mmap(NULL, sizeof(heap_stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return stats == MAP_FAILED ? NULL : stats;
+}
+
+// name a process was started with, or "?" once it's gone
+static void read_command(int pid, char *command, size_t size) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL || fgets(command, size, fp) == NULL) {
+        snprintf(command, size, "?");
+    }
+    command[strcspn(command, "\n")] = '\0';
+    if (fp != NULL) {
+        fclose(fp);
+    }
+}
+
+/* Function: print_process_list
+ * ----------------------------
+ * Prints one line for every process that publishes counters. Processes
+ * killed before they could remove theirs are marked as exited.
+ */
+static void print_process_list(void) {
+    DIR *dir = opendir(SHM_DIR);
+    if (dir == NULL) {
+        error(1, errno, "Could not list %s", SHM_DIR);
+    }
+    printf("%8s  %-16s %10s %10s %10s %12s %10s\n", "PID", "COMMAND", "IN USE", "FREE", "BLOCKS", "MALLOCS", "CONTENDED");
+
+    struct dirent *entry;
+    const char *prefix = HEAP_STATS_SHM_PREFIX + 1;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) != 0) {
+            continue;
+        }
+        int pid = atoi(entry->d_name + strlen(prefix));
+        const heap_stats *stats = map_stats(pid);
+        heap_stats copy;
+        if (stats == NULL || !heap_stats_read(stats, &copy)) {
+            continue;
+        }
+
+        char command[32], in_use[16], free_bytes[16];
+        if (kill(pid, 0) != 0 && errno == ESRCH) {
+            snprintf(command, sizeof(command), "(exited)");
+        } else {
+            read_command(pid, command, sizeof(command));
+        }
+        double contended = copy.lock_acquisitions ? 100.0 * copy.lock_contended / copy.lock_acquisitions : 0;
+        printf("%8d  %-16s %10s %10s %10lu %12lu %9.1f%%\n", pid, command,
+               format_bytes(copy.in_use_bytes, in_use, sizeof(in_use)),
+               format_bytes(copy.free_bytes, free_bytes, sizeof(free_bytes)),
+               copy.in_use_blocks, copy.mallocs, contended);
+        munmap((void *)stats, sizeof(heap_stats));
+    }
+    closedir(dir);
+}
+
+/* Function: print_process
+ * -----------------------
+ * Prints the counters of one process. Given the counters from seconds
+ * earlier, rates are shown next to the totals.
+ */
+static void print_process(int pid, const heap_stats *now, const heap_stats *before, double seconds) {
+    char command[32], bytes[4][16];
+    read_command(pid, command, sizeof(command));
+    printf("pid %d (%s), heap of %s\n\n", pid, command, format_bytes(now->heap_bytes, bytes[0], sizeof(bytes[0])));
+
+    printf("in use     %10s in %lu blocks\n", format_bytes(now->in_use_bytes, bytes[0], sizeof(bytes[0])),
+           now->in_use_blocks);
+    printf("free       %10s in %lu blocks (%s on average)\n", format_bytes(now->free_bytes, bytes[1], sizeof(bytes[1])),
+           now->free_blocks, format_bytes(now->free_blocks ? now->free_bytes / now->free_blocks : 0, bytes[2], sizeof(bytes[2])));
+    printf("purged     %10s in %lu spans\n\n", format_bytes(now->purged_bytes, bytes[3], sizeof(bytes[3])), now->purges);
+
+    const char *names[] = { "mallocs", "frees", "reallocs", "remote frees" };
+    uint64_t totals[] = { now->mallocs, now->frees, now->reallocs, now->remote_frees };
+    uint64_t earlier[] = { 0, 0, 0, 0 };
+    if (before != NULL) {
+        uint64_t values[] = { before->mallocs, before->frees, before->reallocs, before->remote_frees };
+        memcpy(earlier, values, sizeof(earlier));
+    }
+    for (int i = 0; i < 4; i++) {
+        printf("%-12s %12lu", names[i], totals[i]);
+        if (before != NULL) {
+            printf("  %12.0f/s", (totals[i] - earlier[i]) / seconds);
+        }
+        printf("\n");
+    }
+    double contended = now->lock_acquisitions ? 100.0 * now->lock_contended / now->lock_acquisitions : 0;
+    printf("lock taken   %12lu  %.1f%% contended\n\n", now->lock_acquisitions, contended);
+
+    // histogram of the allocated blocks by size class, scaled to the biggest class
+    uint64_t most = 0;
+    for (int c = 0; c < HEAP_STATS_CLASSES; c++) {
+        most = now->class_blocks[c] > most ? now->class_blocks[c] : most;
+    }
+    printf("allocated blocks by size\n");
+    for (int c = 0; c < HEAP_STATS_CLASSES; c++) {
+        if (now->class_blocks[c] == 0) {
+            continue;
+        }
+        char bar[BAR_WIDTH + 1];
+        int length = (int)((now->class_blocks[c] * BAR_WIDTH + most - 1) / most);
+        memset(bar, '#', length);
+        bar[length] = '\0';
+        printf("  >= %8s %10lu %s\n", format_bytes(1ULL << c, bytes[0], sizeof(bytes[0])), now->class_blocks[c], bar);
+    }
+}
+
+// bytes with a binary unit suffix, written into buffer
+static const char *format_bytes(uint64_t bytes, char *buffer, size_t size) {
+    const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(buffer, size, unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+    return buffer;
+}
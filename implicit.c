@@ -3,41 +3,90 @@
  */
 #include "allocator.h"
 #include "debug_break.h"
+#include "heap_snapshot.h"
+#include "segment.h"
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+
+// the heap is summarized in chunks of this many bytes, and free blocks at least LARGE_FREE_SIZE
+// bytes big get a summary bit of their own so big requests can skip chunks of small leftovers
+#define CHUNK_SIZE 4096
+#define LARGE_FREE_SIZE 256
+
+#define PAGE_SIZE 4096
 
 // header struct
 typedef struct header {
     size_t sizenstatus;
 } header;
 
+// a block's header and payload together take a multiple of ALIGNMENT bytes, and the first payload starts aligned,
+// so every payload stays aligned behind a one-word header. This is the payload of such a block for size bytes
+#define BLOCK_ROUNDUP(size) ((((size) + sizeof(header) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1)) - sizeof(header))
+
 // variables
 static void *segment_begin;
 static size_t segment_size;
 static void *segment_end;
 static size_t free_blocks;
 
+// side tables past the end of the heap, one entry per chunk: whether a free block (of at least
+// LARGE_FREE_SIZE bytes) starts in the chunk, and where its first header is (offset + 1, 0 if none)
+static uint64_t *free_summary;
+static uint64_t *large_summary;
+static uint16_t *first_header;
+static size_t summary_words;
+
 // helper functions
 size_t roundup(size_t sz, size_t mult);
 size_t extract_size(header *hdr);
 void split_block_if_poss(header *hdr, size_t needed);
 bool is_free (header *hdr);
+header *find_fit(size_t needed, size_t alignment, size_t *leading);
+size_t leading_padding(header *hdr, size_t alignment);
+size_t chunk_of(header *hdr);
+header *chunk_first(size_t chunk);
+void note_header(header *hdr);
+void mark_free(header *hdr);
+void coalesce_right(header *hdr);
+void refresh_summary(size_t chunk);
+bool check_summary(size_t chunk, uint64_t any_free, uint64_t any_large);
+void zero_pages(void *start, size_t size);
 
 
 /* Function: mynit
  * -----------------
  * This function initializes a heap given a starting pointer and heap size,
- * which is guaranteed to be a multiple of ALIGNMENT. The intialized heap is
- * one free block with a header of length heap_size - sizeof(header). Returns
- * true if heap is able to be initialized.
+ * which is guaranteed to be a multiple of ALIGNMENT. The back of the segment
+ * holds the chunk summary tables, and the rest of it is one free block with a
+ * header. Returns true if heap is able to be initialized.
  */
 bool myinit(void *heap_start, size_t heap_size) {
 
-    // check if heap_size is larger than twice the alignment, as we need space for a header and a free space properly aligned
-    if (heap_size < (ALIGNMENT * 2)) {
+    // carve the summary tables off the back of the segment
+    size_t nchunks = (heap_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    summary_words = (nchunks + 63) / 64;
+    size_t tables_size = roundup(2 * summary_words * sizeof(uint64_t) + nchunks * sizeof(uint16_t), ALIGNMENT);
+
+    // check if heap_size is larger than twice the alignment past the tables, as we need space for a header and a free space properly aligned
+    if (heap_size < tables_size + (ALIGNMENT - sizeof(header)) + ALIGNMENT * 2) {
         return false;
     }
-    
+    heap_size -= tables_size;
+
+    free_summary = (uint64_t *)((char *)heap_start + heap_size);
+    large_summary = free_summary + summary_words;
+    first_header = (uint16_t *)(large_summary + summary_words);
+    zero_pages(free_summary, tables_size);
+
+    // the first header goes just far enough in for its payload to be aligned, and the blocks end on a whole block
+    size_t lead = ALIGNMENT - sizeof(header);
+    heap_start = (char *)heap_start + lead;
+    heap_size -= lead + (heap_size - lead) % ALIGNMENT;
+
     header *init_header = heap_start;
     segment_begin = heap_start;
 
@@ -51,14 +100,18 @@ bool myinit(void *heap_start, size_t heap_size) {
     init_header->sizenstatus = segment_size;
     
     segment_end = (char *)heap_start + heap_size;
+
+    note_header(init_header);
+    mark_free(init_header);
     
     return true;
 }
 
 /* Function: mymalloc
  * -----------------
- * Allocates new memory space with size of requested_size by iterating through every possible
- * block to see if a free block exists that is large enough to host the request.
+ * Allocates new memory space with size of requested_size by iterating through the blocks of every
+ * chunk that the summary bitmap says holds a free block, to see if a free block exists that is large
+ * enough to host the request.
  */
 void *mymalloc(size_t requested_size) {
 
@@ -68,34 +121,55 @@ void *mymalloc(size_t requested_size) {
     }
 
     // round up requested size to a properly aligned multiple
-    size_t needed = roundup(requested_size, ALIGNMENT);
-    
-    header *header_iterator = segment_begin;
-    
-    while ((char *)header_iterator < (char *)segment_end) {
-        if (is_free(header_iterator)) {
-            // if enough space exists for an allocation
-            if (extract_size(header_iterator) >= needed) {
-                // if enough space exists for another allocation after allocating current block
-                split_block_if_poss(header_iterator, needed);
-                
-                // allocate block
-                header_iterator->sizenstatus += 1;
-                free_blocks--;
-
-                // pointer to payload
-                char *return_ptr = (char *)header_iterator + sizeof(header);
-                return return_ptr;
-            }
-        }
+    size_t needed = BLOCK_ROUNDUP(requested_size);
 
-        // iterate
-        header_iterator = (header *)((char *)header_iterator +  sizeof(header) + extract_size(header_iterator));     
+    size_t leading;
+    header *header_iterator = find_fit(needed, ALIGNMENT, &leading);
+    if (header_iterator == NULL) {
+        return NULL;
     }
-                
-    
-    return NULL;
+
+    // if enough space exists for another allocation after allocating current block
+    split_block_if_poss(header_iterator, needed);
+
+    // allocate block
+    header_iterator->sizenstatus += 1;
+    free_blocks--;
+    refresh_summary(chunk_of(header_iterator));
+
+    // pointer to payload
+    char *return_ptr = (char *)header_iterator + sizeof(header);
+    return return_ptr;
+}
+
+/* Function: mymalloc_hint
+ * -----------------
+ * Ignores the lifetime hint and allocates with mymalloc.
+ */
+void *mymalloc_hint(size_t requested_size, lifetime_t lifetime) {
+    (void)lifetime;
+    return mymalloc(requested_size);
+}
+
+/* Function: mycalloc
+ * -----------------
+ * Allocates zeroed memory for nmemb elements of size bytes each by calling mymalloc and clearing
+ * the payload.
+ */
+void *mycalloc(size_t nmemb, size_t size) {
+
+    // nmemb * size must not overflow, and is bounded by the max request size
+    if (size != 0 && nmemb > MAX_REQUEST_SIZE / size) {
+        return NULL;
+    }
+
+    void *ptr = mymalloc(nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
 }
+
 /* Function: myfree
  * -----------------
  * When passed in a pointer to a specific spot in memory, frees that block.
@@ -113,11 +187,14 @@ void myfree(void *ptr) {
     // change status of block to free
     header *newptr = (header *)((char *)ptr - sizeof(header));
     newptr->sizenstatus -= 1;
+    mark_free(newptr);
 }
 
 /* Function: myrealloc
  * -----------------
- * Reallocates existing memory to new memory of a new size by calling mymalloc.
+ * Reallocates existing memory to a new size. Shrinking splits the block in place, and growing first
+ * coalesces the free blocks to its right into it; only if that still isn't enough space is a new
+ * block malloc'ed and the payload copied over.
  */
 void *myrealloc(void *old_ptr, size_t new_size) {
 
@@ -131,13 +208,103 @@ void *myrealloc(void *old_ptr, size_t new_size) {
         myfree(old_ptr);
     // otherwise reallocate as normal
     } else {
+        size_t needed = BLOCK_ROUNDUP(new_size);
+        header *hdr = (header *)((char *)old_ptr - sizeof(header));
+
+        // IN-PLACE REALLOC, growing into free right neighbors if necessary
+        if (extract_size(hdr) < needed) {
+            coalesce_right(hdr);
+        }
+        if (extract_size(hdr) >= needed) {
+            split_block_if_poss(hdr, needed);
+            return old_ptr;
+        }
+
+        // MOVE REALLOC
         reallocated = mymalloc(new_size);
-        memcpy(reallocated, old_ptr, new_size);
+        if (reallocated == NULL) {
+            return NULL;
+        }
+        memcpy(reallocated, old_ptr, extract_size(hdr) < new_size ? extract_size(hdr) : new_size);
         myfree(old_ptr);
     }
     return reallocated;
 }
 
+/* Function: myaligned_alloc
+ * -----------------
+ * Allocates a block whose payload starts at a multiple of alignment by iterating through the blocks
+ * of summarized chunks for a free one that can fit an aligned payload of the requested size. The leading padding
+ * in front of the aligned payload is left behind as its own free block (so it must either be empty
+ * or big enough to hold a header and a payload), and any trailing padding is split off as usual.
+ */
+void *myaligned_alloc(size_t alignment, size_t requested_size) {
+
+    // alignment has to be a power of 2
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+
+    // every block is already aligned to ALIGNMENT
+    if (alignment <= ALIGNMENT) {
+        return mymalloc(requested_size);
+    }
+
+    if (requested_size > MAX_REQUEST_SIZE || requested_size == 0) {
+        return NULL;
+    }
+
+    size_t needed = BLOCK_ROUNDUP(requested_size);
+
+    size_t leading;
+    header *header_iterator = find_fit(needed, alignment, &leading);
+    if (header_iterator == NULL) {
+        return NULL;
+    }
+    char *aligned = (char *)header_iterator + sizeof(header) + leading;
+
+    if (leading == 0) {
+        free_blocks--;
+    } else {
+        // carve the aligned block out of the free block, which keeps the leading padding
+        header *aligned_header = (header *)(aligned - sizeof(header));
+        aligned_header->sizenstatus = extract_size(header_iterator) - leading;
+        header_iterator->sizenstatus = leading - sizeof(header);
+        note_header(aligned_header);
+        refresh_summary(chunk_of(header_iterator));
+        header_iterator = aligned_header;
+    }
+
+    // split off trailing padding
+    split_block_if_poss(header_iterator, needed);
+
+    // allocate block
+    header_iterator->sizenstatus += 1;
+    refresh_summary(chunk_of(header_iterator));
+
+    return aligned;
+}
+
+/* Function: myposix_memalign
+ * -----------------
+ * Wrapper around myaligned_alloc with posix_memalign's argument checking and error reporting.
+ */
+int myposix_memalign(void **memptr, size_t alignment, size_t size) {
+
+    // alignment has to be a power of 2 and a multiple of sizeof(void *)
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+
+    void *ptr = myaligned_alloc(alignment, size);
+    if (ptr == NULL && size != 0) {
+        return ENOMEM;
+    }
+
+    *memptr = ptr;
+    return 0;
+}
+
 /* Function: validate_heap
  * -----------------
  * Validate heap implmenets multiple checks to see if the heap is valid. The first check
@@ -159,12 +326,42 @@ bool validate_heap() {
     // free block counter for sequential iteration
     size_t free_list = 0;
 
+    // summary bits expected for the chunk of the previous header, and the chunk after it left to check
+    size_t chunk = 0;
+    size_t next_unchecked = 0;
+    uint64_t any_free = 0;
+    uint64_t any_large = 0;
+
     // SEQUENTIAL ITERATION
     while ((char *)header_iterator < (char *)segment_end) {
 
+        // the first header in a chunk settles the summary of every chunk before it
+        if (chunk_of(header_iterator) >= next_unchecked) {
+            if (next_unchecked > 0 && !check_summary(chunk, any_free, any_large)) {
+                return false;
+            }
+            for (size_t skipped = next_unchecked; skipped < chunk_of(header_iterator); skipped++) {
+                if (chunk_first(skipped) != NULL || !check_summary(skipped, 0, 0)) {
+                    printf("Summary of chunk %zu doesn't match its blocks!\n", skipped);
+                    breakpoint();
+                    return false;
+                }
+            }
+            chunk = chunk_of(header_iterator);
+            next_unchecked = chunk + 1;
+            any_free = any_large = 0;
+            if (chunk_first(chunk) != header_iterator) {
+                printf("First header of chunk %zu is recorded at the wrong place!\n", chunk);
+                breakpoint();
+                return false;
+            }
+        }
+
         // if block is free, add to the free_list
         if (is_free(header_iterator)) {
             free_list++;
+            any_free = 1;
+            any_large |= extract_size(header_iterator) >= LARGE_FREE_SIZE;
         }
         
         // increment total_mem
@@ -180,6 +377,11 @@ bool validate_heap() {
         header_iterator = (header *)((char *)segment_begin + total_mem);
     }
 
+    // checks to see if the summary bitmap matches the free blocks of the last chunk
+    if (!check_summary(chunk, any_free, any_large)) {
+        return false;
+    }
+
     size_t heap_size = segment_size + sizeof(header);
 
     // checks to see if free block counter from sequential  iteration matches total number of free blocks from commands
@@ -222,6 +424,26 @@ void dump_heap() {
     }      
 }
 
+/* Function: heap_snapshot
+ * -----------------
+ * Streams every block of the heap, in address order, to fd in the binary format of heap_snapshot.h.
+ * The chunk summary tables past the end of the heap are not part of the snapshot.
+ */
+bool heap_snapshot(int fd) {
+
+    snapshot_writer writer;
+    if (!snapshot_begin(&writer, fd, (char *)segment_end - (char *)segment_begin)) {
+        return false;
+    }
+    header *header_iterator = segment_begin;
+    while ((char *)header_iterator < (char *)segment_end) {
+        size_t offset = (char *)header_iterator + sizeof(header) - (char *)segment_begin;
+        snapshot_block(&writer, offset, extract_size(header_iterator), !is_free(header_iterator));
+        header_iterator = (header *)((char *)(header_iterator) + sizeof(header) + extract_size(header_iterator));
+    }
+    return snapshot_end(&writer);
+}
+
 // HELPER FUNCTIONS
 
 /* Function: roundup
@@ -245,11 +467,173 @@ bool is_free (header *hdr) {
 
 // if block is large enough to host an allocation and another free block, splits block into two, with rightmost block being free block
 void split_block_if_poss(header *hdr, size_t needed) {
-    if (hdr->sizenstatus - needed >= sizeof(header) + ALIGNMENT) {
-        size_t remaining = hdr->sizenstatus;
+    if (extract_size(hdr) - needed >= sizeof(header) + ALIGNMENT) {
+        size_t remaining = extract_size(hdr);
         hdr->sizenstatus = needed + (hdr->sizenstatus & 0x1);
         header *chopped_block = (header *)((char *)hdr + sizeof(header) + needed);
         chopped_block->sizenstatus = remaining - needed - sizeof(header);
         free_blocks++;
+        note_header(chopped_block);
+        mark_free(chopped_block);
+    }
+}
+
+// returns the leading padding a free block needs in front of a payload aligned to alignment, given that the
+// padding must either be empty or big enough to become a free block of its own
+size_t leading_padding(header *hdr, size_t alignment) {
+    uintptr_t payload = (uintptr_t)hdr + sizeof(header);
+    uintptr_t aligned = roundup(payload, alignment);
+
+    // a leading gap too small to become a free block pushes the payload to the next aligned address
+    if (aligned != payload && aligned - payload < sizeof(header) + ALIGNMENT) {
+        aligned = roundup(payload + sizeof(header) + ALIGNMENT, alignment);
+    }
+    return aligned - payload;
+}
+
+// finds the first free block that fits needed bytes at the given alignment (storing the leading padding that
+// takes), scanning the summary bitmap a word at a time so chunks without a suitable free block are skipped,
+// and coalescing every run of free blocks it passes
+header *find_fit(size_t needed, size_t alignment, size_t *leading) {
+
+    // any free block that fits a large request is itself large
+    uint64_t *summary = needed >= LARGE_FREE_SIZE ? large_summary : free_summary;
+
+    for (size_t word = 0; word < summary_words; word++) {
+        uint64_t bits = summary[word];
+        while (bits != 0) {
+            size_t chunk = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            // walk the blocks starting in this chunk
+            char *chunk_end = (char *)segment_begin + (chunk + 1) * CHUNK_SIZE;
+            header *header_iterator = chunk_first(chunk);
+            while (header_iterator != NULL && (char *)header_iterator < chunk_end &&
+                   (char *)header_iterator < (char *)segment_end) {
+                if (is_free(header_iterator)) {
+                    // merge the run of free blocks after this one while we're passing by
+                    coalesce_right(header_iterator);
+
+                    *leading = leading_padding(header_iterator, alignment);
+                    if (extract_size(header_iterator) >= *leading + needed) {
+                        return header_iterator;
+                    }
+                }
+                header_iterator = (header *)((char *)header_iterator + sizeof(header) + extract_size(header_iterator));
+            }
+        }
     }
+
+    return NULL;
+}
+
+// index of the chunk a header starts in
+size_t chunk_of(header *hdr) {
+    return ((char *)hdr - (char *)segment_begin) / CHUNK_SIZE;
+}
+
+// first header starting in a chunk, or NULL if a block from an earlier chunk covers all of it
+header *chunk_first(size_t chunk) {
+    if (first_header[chunk] == 0) {
+        return NULL;
+    }
+    return (header *)((char *)segment_begin + chunk * CHUNK_SIZE + first_header[chunk] - 1);
+}
+
+// records a new header, keeping first_header pointing at the earliest header in its chunk
+void note_header(header *hdr) {
+    size_t chunk = chunk_of(hdr);
+    uint16_t offset = ((char *)hdr - (char *)segment_begin) % CHUNK_SIZE + 1;
+    if (first_header[chunk] == 0 || offset < first_header[chunk]) {
+        first_header[chunk] = offset;
+    }
+}
+
+// merges the run of free blocks following hdr into it, dropping their headers from the chunk tables
+void coalesce_right(header *hdr) {
+    header *next = (header *)((char *)hdr + sizeof(header) + extract_size(hdr));
+    if ((char *)next >= (char *)segment_end || !is_free(next)) {
+        return;
+    }
+
+    header *last_swallowed = next;
+    while ((char *)next < (char *)segment_end && is_free(next)) {
+        last_swallowed = next;
+        hdr->sizenstatus += sizeof(header) + extract_size(next);
+        free_blocks--;
+        next = (header *)((char *)hdr + sizeof(header) + extract_size(hdr));
+    }
+
+    // chunks up to the last header swallowed lose their headers; the chunks past it lie inside a block that was
+    // already free, so they hold none. next (if any) is the first header left
+    size_t hdr_chunk = chunk_of(hdr);
+    size_t last_chunk = chunk_of(last_swallowed);
+    for (size_t chunk = hdr_chunk + 1; chunk <= last_chunk; chunk++) {
+        first_header[chunk] = 0;
+        free_summary[chunk / 64] &= ~(1ULL << (chunk % 64));
+        large_summary[chunk / 64] &= ~(1ULL << (chunk % 64));
+    }
+    if ((char *)next < (char *)segment_end && chunk_of(next) != hdr_chunk) {
+        first_header[chunk_of(next)] = ((char *)next - (char *)segment_begin) % CHUNK_SIZE + 1;
+        refresh_summary(chunk_of(next));
+    }
+    refresh_summary(hdr_chunk);
+}
+
+// sets the summary bits of the chunk a free block starts in
+void mark_free(header *hdr) {
+    size_t chunk = chunk_of(hdr);
+    free_summary[chunk / 64] |= 1ULL << (chunk % 64);
+    if (extract_size(hdr) >= LARGE_FREE_SIZE) {
+        large_summary[chunk / 64] |= 1ULL << (chunk % 64);
+    }
+}
+
+// recomputes a chunk's summary bits from the headers that start in it, after a free block in it shrank or went away
+void refresh_summary(size_t chunk) {
+    uint64_t any_free = 0;
+    uint64_t any_large = 0;
+
+    char *chunk_end = (char *)segment_begin + (chunk + 1) * CHUNK_SIZE;
+    header *header_iterator = chunk_first(chunk);
+    while (header_iterator != NULL && (char *)header_iterator < chunk_end &&
+           (char *)header_iterator < (char *)segment_end) {
+        if (is_free(header_iterator)) {
+            any_free = 1;
+            any_large |= extract_size(header_iterator) >= LARGE_FREE_SIZE;
+        }
+        header_iterator = (header *)((char *)header_iterator + sizeof(header) + extract_size(header_iterator));
+    }
+
+    uint64_t bit = 1ULL << (chunk % 64);
+    free_summary[chunk / 64] = (free_summary[chunk / 64] & ~bit) | (any_free << (chunk % 64));
+    large_summary[chunk / 64] = (large_summary[chunk / 64] & ~bit) | (any_large << (chunk % 64));
+}
+
+// zeroes size bytes at start, handing the whole pages among them back to the OS rather than writing them, so the
+// parts of the tables that cover heap never used take no memory
+void zero_pages(void *start, size_t size) {
+    char *page_start = (char *)roundup((uintptr_t)start, PAGE_SIZE);
+    char *page_end = (char *)(((uintptr_t)start + size) & ~(uintptr_t)(PAGE_SIZE - 1));
+    // pages of a shared mapping are only zeroed by punching them out of it
+    char *segment = heap_segment_start();
+    bool in_segment = segment != NULL && (char *)start >= segment && (char *)start < segment + heap_segment_size();
+    int advice = in_segment && heap_segment_shared() ? MADV_REMOVE : MADV_DONTNEED;
+    if (page_end <= page_start || madvise(page_start, page_end - page_start, advice) != 0) {
+        memset(start, 0, size);
+        return;
+    }
+    memset(start, 0, page_start - (char *)start);
+    memset(page_end, 0, (char *)start + size - page_end);
+}
+
+// checks a chunk's summary bits against whether a free (and large free) block starts in it
+bool check_summary(size_t chunk, uint64_t any_free, uint64_t any_large) {
+    if (((free_summary[chunk / 64] >> (chunk % 64)) & 1) != any_free ||
+        ((large_summary[chunk / 64] >> (chunk % 64)) & 1) != any_large) {
+        printf("Summary of chunk %zu doesn't match its blocks!\n", chunk);
+        breakpoint();
+        return false;
+    }
+    return true;
 }
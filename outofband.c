@@ -0,0 +1,654 @@
+/* File: outofband.c
+ * -----------------
+ * An allocator that keeps all of its block metadata out of band.  Instead
+ * of headers and freelist nodes inside the heap, dense bitmaps at the back
+ * of the segment describe it: the heap is divided into 16-byte granules (ALIGNMENT-byte ones in builds aligned to more),
+ * and one bit per granule says whether it is in use, another whether an
+ * allocated block starts there.  Free space is just the runs of unused
+ * granules, so neighboring free blocks are coalesced without any work, and
+ * searching, splitting and growing blocks only ever read and write the
+ * bitmaps (one 64-bit word covers 1 KiB of heap).  Payload pages are never
+ * touched by the allocator, so they stay cold until the caller uses them.
+ *
+ * A summary bit per bitmap word records that the word is entirely in use,
+ * so a search skips crowded stretches of the heap 64 KiB at a time.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "allocator.h"
+#include "debug_break.h"
+#include "heap_snapshot.h"
+#include "segment.h"
+
+// every block is a whole number of granules, and starts on a granule boundary
+#define GRANULE (ALIGNMENT > 16 ? ALIGNMENT : 16)
+#define WORD_BITS 64
+
+#define PAGE_SIZE 4096
+
+// requests of up to this many granules remember where their last search ended
+#define HINTED_GRANULES 128
+
+static char *heap_base;             // first granule
+static size_t ngranules;            // granules in the heap
+static size_t nwords;               // words in each of used_bits and start_bits
+static size_t nsummary_words;       // words in full_summary
+static uint64_t *used_bits;         // granule is part of an allocated block
+static uint64_t *start_bits;        // an allocated block starts at this granule
+static uint64_t *full_summary;      // every granule of this word of used_bits is in use
+static size_t search_from;          // no granule below this one is free
+static size_t fit_hint[HINTED_GRANULES + 1]; // where the last search for this many granules found its fit
+static size_t high_water;           // no granule from here on has been handed out since myinit, so it reads as zero
+static size_t allocated_granules;   // granules of allocated blocks
+
+
+/* Function: roundup
+ * -----------------
+ * This function rounds up the given number to the given multiple, which
+ * must be a power of 2, and returns the result.  (you saw this code in lab1!).
+ */
+size_t roundup(size_t sz, size_t mult) {
+    return (sz + mult - 1) & ~(mult - 1);
+}
+
+// mask of the bits of a word from bit `from` (less than WORD_BITS) up
+static uint64_t bits_from(size_t from) {
+    return ~(uint64_t)0 << from;
+}
+
+/* Function: tables_size
+ * ---------------------
+ * This function returns the bytes of side tables needed for a heap of the
+ * given number of granules.
+ */
+static size_t tables_size(size_t granules) {
+    size_t words = (granules + WORD_BITS - 1) / WORD_BITS;
+    size_t summary_words = (words + WORD_BITS - 1) / WORD_BITS;
+    return (2 * words + summary_words) * sizeof(uint64_t);
+}
+
+/* Function: update_summary
+ * ------------------------
+ * This function refreshes the summary bit of one word of used_bits.
+ */
+static void update_summary(size_t word) {
+    uint64_t bit = (uint64_t)1 << (word % WORD_BITS);
+    if (used_bits[word] == ~(uint64_t)0) {
+        full_summary[word / WORD_BITS] |= bit;
+    } else {
+        full_summary[word / WORD_BITS] &= ~bit;
+    }
+}
+
+/* Function: mark_range
+ * --------------------
+ * This function marks count granules from the given one as used (or as
+ * unused), a word at a time.
+ */
+static void mark_range(size_t from, size_t count, bool used) {
+    size_t end = from + count;
+    while (from < end) {
+        size_t word = from / WORD_BITS;
+        size_t nbits = WORD_BITS - from % WORD_BITS;
+        if (nbits > end - from) {
+            nbits = end - from;
+        }
+        uint64_t mask = (nbits == WORD_BITS ? ~(uint64_t)0 : (((uint64_t)1 << nbits) - 1)) << (from % WORD_BITS);
+        if (used) {
+            used_bits[word] |= mask;
+        } else {
+            used_bits[word] &= ~mask;
+        }
+        update_summary(word);
+        from += nbits;
+    }
+}
+
+/* Function: next_unfull_word
+ * --------------------------
+ * This function returns the first word of used_bits at or after the given
+ * one that has an unused granule, or nwords if there is none.
+ */
+static size_t next_unfull_word(size_t word) {
+    size_t s = word / WORD_BITS;
+    if (s >= nsummary_words) {
+        return nwords;
+    }
+    uint64_t bits = ~full_summary[s] & bits_from(word % WORD_BITS);
+    while (bits == 0) {
+        if (++s >= nsummary_words) {
+            return nwords;
+        }
+        bits = ~full_summary[s];
+    }
+    size_t found = s * WORD_BITS + __builtin_ctzll(bits);
+    return found < nwords ? found : nwords;
+}
+
+/* Function: next_free
+ * -------------------
+ * This function returns the first unused granule at or after the given
+ * one, or ngranules if there is none.
+ */
+static size_t next_free(size_t from) {
+    size_t word = from / WORD_BITS;
+    if (word >= nwords) {
+        return ngranules;
+    }
+    uint64_t bits = ~used_bits[word] & bits_from(from % WORD_BITS);
+    while (bits == 0) {
+        word = next_unfull_word(word + 1);
+        if (word >= nwords) {
+            return ngranules;
+        }
+        bits = ~used_bits[word];
+    }
+    size_t found = word * WORD_BITS + __builtin_ctzll(bits);
+    return found < ngranules ? found : ngranules;
+}
+
+/* Function: run_end
+ * -----------------
+ * This function returns the first used granule in [from, limit), or limit
+ * if they are all unused.  It reads no further than limit, so checking for
+ * a fit costs time in proportion to the request, not to the free run.
+ */
+static size_t run_end(size_t from, size_t limit) {
+    for (size_t word = from / WORD_BITS; word * WORD_BITS < limit; word++) {
+        uint64_t bits = used_bits[word];
+        if (word == from / WORD_BITS) {
+            bits &= bits_from(from % WORD_BITS);
+        }
+        if (bits != 0) {
+            size_t found = word * WORD_BITS + __builtin_ctzll(bits);
+            return found < limit ? found : limit;
+        }
+    }
+    return limit;
+}
+
+/* Function: block_end
+ * -------------------
+ * This function returns the granule just past the allocated block that
+ * starts at the given one: the next granule that is unused or starts
+ * another block.
+ */
+static size_t block_end(size_t start) {
+    size_t from = start + 1;
+    for (size_t word = from / WORD_BITS; word < nwords; word++) {
+        uint64_t bits = start_bits[word] | ~used_bits[word];
+        if (word == from / WORD_BITS) {
+            bits &= bits_from(from % WORD_BITS);
+        }
+        if (bits != 0) {
+            size_t found = word * WORD_BITS + __builtin_ctzll(bits);
+            return found < ngranules ? found : ngranules;
+        }
+    }
+    return ngranules;
+}
+
+/* Function: aligned_granule
+ * -------------------------
+ * This function returns the first granule at or after the given one whose
+ * address is a multiple of alignment.
+ */
+static size_t aligned_granule(size_t granule, size_t alignment) {
+    uintptr_t addr = (uintptr_t)(heap_base + granule * GRANULE);
+    return (roundup(addr, alignment) - (uintptr_t)heap_base) / GRANULE;
+}
+
+/* Function: search_fit
+ * --------------------
+ * This function finds the lowest run of needed unused granules at or after
+ * from that starts at a multiple of alignment, jumping from one free run
+ * to the next.  Returns ngranules if there is none.
+ */
+static size_t search_fit(size_t from, size_t needed, size_t alignment) {
+    size_t free_start = next_free(from);
+    while (free_start < ngranules) {
+        size_t start = alignment > GRANULE ? aligned_granule(free_start, alignment) : free_start;
+        if (start >= ngranules || needed > ngranules - start) {
+            return ngranules;
+        }
+        size_t end = run_end(free_start, start + needed);
+        if (end == start + needed) {
+            return start;
+        }
+        free_start = next_free(end);
+    }
+    return ngranules;
+}
+
+/* Function: find_fit
+ * ------------------
+ * This function finds the lowest run of needed unused granules that starts
+ * at a multiple of alignment.  A small request starts searching at the
+ * hint for its size, as no run that big starts before it.
+ */
+static size_t find_fit(size_t needed, size_t alignment) {
+    if (alignment > GRANULE || needed > HINTED_GRANULES) {
+        return search_fit(search_from, needed, alignment);
+    }
+    size_t from = fit_hint[needed] > search_from ? fit_hint[needed] : search_from;
+    fit_hint[needed] = search_fit(from, needed, alignment);
+    return fit_hint[needed];
+}
+
+/* Function: free_before
+ * ---------------------
+ * This function returns how many unused granules lie right before the
+ * given one, counting no further back than limit.
+ */
+static size_t free_before(size_t granule, size_t limit) {
+    size_t nfree = 0;
+    while (nfree < limit && granule > 0) {
+        size_t word = (granule - 1) / WORD_BITS;
+        size_t nbits = (granule - 1) % WORD_BITS + 1;
+        uint64_t bits = used_bits[word] << (WORD_BITS - nbits);
+        if (bits != 0) {
+            nfree += __builtin_clzll(bits);
+            break;
+        }
+        nfree += nbits;
+        granule -= nbits;
+    }
+    return nfree < limit ? nfree : limit;
+}
+
+/* Function: release_range
+ * -----------------------
+ * This function frees count granules from the given one.  The free run
+ * they end up in is the only one that has grown, so only the hints of sizes
+ * it can now hold but its part in front of the freed granules could not
+ * have to move back to its start.
+ */
+static void release_range(size_t from, size_t count) {
+    mark_range(from, count, false);
+    allocated_granules -= count;
+    if (from < search_from) {
+        search_from = from;
+    }
+
+    size_t before = free_before(from, HINTED_GRANULES);
+    size_t limit = from + HINTED_GRANULES < ngranules ? from + HINTED_GRANULES : ngranules;
+    size_t after = from + count >= limit ? 0 : run_end(from + count, limit) - (from + count);
+    size_t run = before + count + after;
+    for (size_t needed = before + 1; needed <= HINTED_GRANULES && needed <= run; needed++) {
+        if (fit_hint[needed] > from - before) {
+            fit_hint[needed] = from - before;
+        }
+    }
+}
+
+/* Function: place_block
+ * ---------------------
+ * This function records an allocated block of needed granules at start and
+ * returns its payload.
+ */
+static void *place_block(size_t start, size_t needed) {
+    mark_range(start, needed, true);
+    start_bits[start / WORD_BITS] |= (uint64_t)1 << (start % WORD_BITS);
+    allocated_granules += needed;
+
+    // search_from was the first free granule if the block went there
+    if (start <= search_from) {
+        search_from = start + needed;
+    }
+    if (start + needed > high_water) {
+        high_water = start + needed;
+    }
+    return heap_base + start * GRANULE;
+}
+
+/* Function: granules_for
+ * ----------------------
+ * This function returns the number of granules needed for a request, or 0
+ * if the request is empty or too large.
+ */
+static size_t granules_for(size_t requestedsz) {
+    if (requestedsz == 0 || requestedsz > MAX_REQUEST_SIZE) {
+        return 0;
+    }
+    return roundup(requestedsz, GRANULE) / GRANULE;
+}
+
+/* Function: granule_of
+ * --------------------
+ * This function returns the granule a payload pointer starts at.
+ */
+static size_t granule_of(void *ptr) {
+    return ((char *)ptr - heap_base) / GRANULE;
+}
+
+/* Function: discard_advice
+ * -------------------------
+ * This function returns the madvise advice that makes the pages at start
+ * read back as zero. MADV_DONTNEED only does that for private mappings;
+ * pages of a shared one (a file or shm segment) are punched out of it.
+ */
+static int discard_advice(void *start) {
+    char *segment = heap_segment_start();
+    bool in_segment = segment != NULL && (char *)start >= segment && (char *)start < segment + heap_segment_size();
+    return in_segment && heap_segment_shared() ? MADV_REMOVE : MADV_DONTNEED;
+}
+
+/* Function: zero_pages
+ * ---------------------
+ * This function zeroes size bytes at start, handing the whole pages among
+ * them back to the OS rather than writing them, so the parts of the tables
+ * that cover granules never handed out take no memory.
+ */
+static void zero_pages(void *start, size_t size) {
+    char *page_start = (char *)roundup((uintptr_t)start, PAGE_SIZE);
+    char *page_end = (char *)(((uintptr_t)start + size) & ~(uintptr_t)(PAGE_SIZE - 1));
+
+    if (page_end <= page_start || madvise(page_start, page_end - page_start, discard_advice(start)) != 0) {
+        memset(start, 0, size);
+        return;
+    }
+    memset(start, 0, page_start - (char *)start);
+    memset(page_end, 0, (char *)start + size - page_end);
+}
+
+/* Function: myinit
+ * ----------------
+ * This function lays the heap out as granules followed by the side tables,
+ * all clear.  When the heap is page aligned its pages are handed back to
+ * the OS, so they are known to read as zero until they are handed out.
+ */
+bool myinit(void *heap_start, size_t heap_size) {
+    char *start = (char *)roundup((uintptr_t)heap_start, GRANULE);
+    if ((size_t)(start - (char *)heap_start) >= heap_size) {
+        return false;
+    }
+    heap_size -= start - (char *)heap_start;
+
+    // pick the most granules that still leave room for their tables
+    size_t granules = heap_size / (GRANULE + 1);
+    while (granules > 0 && granules * GRANULE + tables_size(granules) > heap_size) {
+        granules--;
+    }
+    if (granules == 0) {
+        return false;
+    }
+
+    // discard stale contents from a previous run, so untouched granules read back as zero
+    bool zeroed = (uintptr_t)heap_start % PAGE_SIZE == 0 &&
+        madvise(heap_start, start - (char *)heap_start + granules * GRANULE, discard_advice(heap_start)) == 0;
+
+    heap_base = start;
+    ngranules = granules;
+    nwords = (ngranules + WORD_BITS - 1) / WORD_BITS;
+    nsummary_words = (nwords + WORD_BITS - 1) / WORD_BITS;
+    used_bits = (uint64_t *)(heap_base + ngranules * GRANULE);
+    start_bits = used_bits + nwords;
+    full_summary = start_bits + nwords;
+    zero_pages(used_bits, tables_size(ngranules));
+
+    // the bits past the last granule are a block that is never freed, so no search ever lands on them
+    if (ngranules % WORD_BITS != 0) {
+        used_bits[nwords - 1] = bits_from(ngranules % WORD_BITS);
+        start_bits[nwords - 1] = (uint64_t)1 << (ngranules % WORD_BITS);
+    }
+    for (size_t word = nwords; word < nsummary_words * WORD_BITS; word++) {
+        full_summary[word / WORD_BITS] |= (uint64_t)1 << (word % WORD_BITS);
+    }
+
+    search_from = 0;
+    memset(fit_hint, 0, sizeof(fit_hint));
+    allocated_granules = 0;
+    high_water = zeroed ? 0 : ngranules;
+    return true;
+}
+
+/* Function: mymalloc
+ * ------------------
+ * This function places the request at the lowest run of free granules
+ * that fits it, found by scanning the bitmaps alone.
+ */
+void *mymalloc(size_t requestedsz) {
+    size_t needed = granules_for(requestedsz);
+    if (needed == 0) {
+        return NULL;
+    }
+    size_t start = find_fit(needed, GRANULE);
+    if (start == ngranules) {
+        return NULL;
+    }
+    return place_block(start, needed);
+}
+
+/* Function: mymalloc_hint
+ * -----------------------
+ * This function ignores the lifetime hint and allocates with mymalloc.
+ */
+void *mymalloc_hint(size_t requestedsz, lifetime_t lifetime) {
+    (void)lifetime;
+    return mymalloc(requestedsz);
+}
+
+/* Function: mycalloc
+ * ------------------
+ * This function allocates with the usual search, and only clears the part
+ * of the block below the high water mark; granules past it have never
+ * been handed out, so they are still zero.
+ */
+void *mycalloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > MAX_REQUEST_SIZE / size) {
+        return NULL;
+    }
+    size_t needed = granules_for(nmemb * size);
+    if (needed == 0) {
+        return NULL;
+    }
+    size_t start = find_fit(needed, GRANULE);
+    if (start == ngranules) {
+        return NULL;
+    }
+    size_t dirty = start < high_water ? (high_water - start) * GRANULE : 0;
+    void *ptr = place_block(start, needed);
+    memset(ptr, 0, dirty < nmemb * size ? dirty : nmemb * size);
+    return ptr;
+}
+
+/* Function: myfree
+ * ----------------
+ * This function clears the block's bits.  Whatever free granules surround
+ * it join up with it by themselves.
+ */
+void myfree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    size_t start = granule_of(ptr);
+    size_t end = block_end(start);
+    start_bits[start / WORD_BITS] &= ~((uint64_t)1 << (start % WORD_BITS));
+    release_range(start, end - start);
+}
+
+/* Function: myrealloc
+ * -------------------
+ * This function shrinks a block by freeing its tail granules, and grows it
+ * in place when enough granules right after it are free.  Otherwise the
+ * block is moved to a new allocation.
+ */
+void *myrealloc(void *oldptr, size_t newsz) {
+    if (oldptr == NULL) {
+        return mymalloc(newsz);
+    }
+    if (newsz == 0) {
+        myfree(oldptr);
+        return NULL;
+    }
+    size_t needed = granules_for(newsz);
+    if (needed == 0) {
+        return NULL;
+    }
+
+    size_t start = granule_of(oldptr);
+    size_t end = block_end(start);
+    size_t current = end - start;
+    if (needed <= current) {
+        release_range(start + needed, current - needed);
+        return oldptr;
+    }
+    if (needed - current <= ngranules - end && run_end(end, start + needed) == start + needed) {
+        mark_range(end, needed - current, true);
+        allocated_granules += needed - current;
+        if (start + needed > high_water) {
+            high_water = start + needed;
+        }
+        return oldptr;
+    }
+
+    void *newptr = mymalloc(newsz);
+    if (newptr == NULL) {
+        return NULL;
+    }
+    memcpy(newptr, oldptr, current * GRANULE);
+    myfree(oldptr);
+    return newptr;
+}
+
+/* Function: myaligned_alloc
+ * -------------------------
+ * This function searches the free runs for one that holds the request at
+ * an aligned granule.  Unlike with in-band headers, the skipped granules
+ * in front of the block need no bookkeeping: they simply stay free.
+ */
+void *myaligned_alloc(size_t alignment, size_t requestedsz) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    size_t needed = granules_for(requestedsz);
+    if (needed == 0) {
+        return NULL;
+    }
+    size_t start = find_fit(needed, alignment);
+    if (start == ngranules) {
+        return NULL;
+    }
+    return place_block(start, needed);
+}
+
+/* Function: myposix_memalign
+ * --------------------------
+ * This function wraps myaligned_alloc with posix_memalign's argument
+ * checking and error codes.
+ */
+int myposix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+    void *ptr = myaligned_alloc(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+/* Function: validate_heap
+ * -----------------------
+ * This function checks for potential errors/inconsistencies in the heap data
+ * structures and returns false if there were issues, or true otherwise.
+ * Only the words up to the high water mark can have changed since myinit,
+ * so those are checked: every block start is in use, every run of used
+ * granules begins with a block start, the summary matches, the count of
+ * used granules adds up, and no granule below search_from is free.
+ */
+bool validate_heap() {
+    size_t used = 0;
+    size_t words = (high_water + WORD_BITS - 1) / WORD_BITS;
+    uint64_t carry = 0; // top bit of the previous word of used_bits
+    for (size_t word = 0; word < words; word++) {
+        if ((start_bits[word] & ~used_bits[word]) != 0) {
+            printf("Block starts at an unused granule in word %zu!\n", word);
+            breakpoint();   // call this function to stop in gdb to poke around
+            return false;
+        }
+        uint64_t run_starts = used_bits[word] & ~((used_bits[word] << 1) | carry);
+        if ((run_starts & ~start_bits[word]) != 0) {
+            printf("Used granules without a block start in word %zu!\n", word);
+            breakpoint();
+            return false;
+        }
+        bool full = (full_summary[word / WORD_BITS] >> (word % WORD_BITS)) & 1;
+        if (full != (used_bits[word] == ~(uint64_t)0)) {
+            printf("Summary of word %zu doesn't match its granules!\n", word);
+            breakpoint();
+            return false;
+        }
+        carry = used_bits[word] >> (WORD_BITS - 1);
+        used += __builtin_popcountll(used_bits[word]);
+    }
+
+    // the padding past the last granule is counted if the last word was checked
+    if (words == nwords && ngranules % WORD_BITS != 0) {
+        used -= WORD_BITS - ngranules % WORD_BITS;
+    }
+    if (used != allocated_granules) {
+        printf("Used granules don't add up: %zu counted, %zu allocated!\n", used, allocated_granules);
+        breakpoint();
+        return false;
+    }
+    if (search_from > next_free(0)) {
+        printf("Free granule below the search start!\n");
+        breakpoint();
+        return false;
+    }
+    return true;
+}
+
+/* Function: heap_snapshot
+ * -----------------------
+ * This function writes every block (allocated blocks and runs of free
+ * granules) to fd in the binary format of heap_snapshot.h.  Nothing past
+ * the high water mark is in use, so the heap past it is one free block.
+ */
+bool heap_snapshot(int fd) {
+    snapshot_writer writer;
+    if (!snapshot_begin(&writer, fd, ngranules * GRANULE)) {
+        return false;
+    }
+    size_t granule = 0;
+    while (granule < ngranules) {
+        size_t end;
+        bool allocated = (used_bits[granule / WORD_BITS] >> (granule % WORD_BITS)) & 1;
+        if (allocated) {
+            end = block_end(granule);
+        } else {
+            end = granule < high_water ? run_end(granule, high_water) : ngranules;
+            if (end == high_water) {
+                end = ngranules;
+            }
+        }
+        snapshot_block(&writer, granule * GRANULE, (end - granule) * GRANULE, allocated);
+        granule = end;
+    }
+    return snapshot_end(&writer);
+}
+
+/* Function: dump_heap
+ * -------------------
+ * This function prints every block up to the high water mark.
+ * This function is not called from anywhere, it is just here to
+ * demonstrate how such a function might be a useful debugging aid.
+ */
+void dump_heap() {
+    printf("Heap has %zu granules of %d bytes at %p, %zu allocated, high water at granule %zu.\n",
+        ngranules, GRANULE, heap_base, allocated_granules, high_water);
+    size_t granule = 0;
+    while (granule < high_water) {
+        bool allocated = (used_bits[granule / WORD_BITS] >> (granule % WORD_BITS)) & 1;
+        size_t end = allocated ? block_end(granule) : run_end(granule, high_water);
+        printf("%p: %s, %zu bytes\n", heap_base + granule * GRANULE, allocated ? "allocated" : "free",
+            (end - granule) * GRANULE);
+        granule = end;
+    }
+}
@@ -0,0 +1,110 @@
+/* File: perf_counters.c
+ * ---------------------
+ * Opens and reads the counters described in perf_counters.h.
+ */
+
+#include "perf_counters.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// the cache counters are encoded as cache | operation << 8 | result << 16
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} COUNTERS[PERF_NUM_COUNTERS] = {
+    [PERF_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PERF_CYCLES] = { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PERF_L1D_MISSES] = { "L1d misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    [PERF_LLC_MISSES] = { "LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [PERF_DTLB_MISSES] = { "dTLB misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    [PERF_PAGE_FAULTS] = { "page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+// glibc has no wrapper for it
+static int perf_event_open(struct perf_event_attr *attr, int group_fd) {
+    return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+bool perf_counters_open(perf_counters *counters) {
+    counters->leader = -1;
+    counters->num_open = 0;
+    counters->error = 0;
+
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = COUNTERS[i].type;
+        attr.config = COUNTERS[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        // the group is started all at once through its leader
+        attr.disabled = counters->leader < 0;
+
+        counters->fds[i] = perf_event_open(&attr, counters->leader);
+        counters->slot[i] = -1;
+        if (counters->fds[i] < 0) {
+            if (counters->error == 0) {
+                counters->error = errno;
+            }
+            continue;
+        }
+        if (counters->leader < 0) {
+            counters->leader = counters->fds[i];
+        }
+        counters->slot[i] = counters->num_open++;
+    }
+
+    if (counters->leader < 0) {
+        return false;
+    }
+    ioctl(counters->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+void perf_counters_read(const perf_counters *counters, perf_sample *sample) {
+    memset(sample, 0, sizeof(*sample));
+    if (counters->leader < 0) {
+        return;
+    }
+
+    // a group read is the number of counters followed by their values
+    uint64_t values[1 + PERF_NUM_COUNTERS];
+    if (read(counters->leader, values, sizeof(values)) < (ssize_t)sizeof(uint64_t)) {
+        return;
+    }
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (counters->slot[i] >= 0 && (uint64_t)counters->slot[i] < values[0]) {
+            sample->value[i] = values[1 + counters->slot[i]];
+        }
+    }
+}
+
+void perf_counters_close(perf_counters *counters) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (counters->fds[i] >= 0) {
+            close(counters->fds[i]);
+            counters->fds[i] = -1;
+        }
+    }
+    counters->leader = -1;
+    counters->num_open = 0;
+}
+
+bool perf_counter_available(const perf_counters *counters, perf_counter_id counter) {
+    return counters->leader >= 0 && counters->fds[counter] >= 0;
+}
+
+const char *perf_counter_name(perf_counter_id counter) {
+    return COUNTERS[counter].name;
+}
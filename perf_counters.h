@@ -0,0 +1,73 @@
+/* File: perf_counters.h
+ * ---------------------
+ * Hardware and software performance counters of the calling thread, read
+ * through perf_event_open(2), so the test harness can attribute cycles and
+ * misses to individual allocator calls. Only user-space activity is
+ * counted, which perf_event_paranoid levels up to 2 allow.
+ *
+ * Containers and VMs often expose only some counters (or none, if the
+ * syscall is filtered), so each counter is opened on its own terms and the
+ * ones that can't be are simply reported as unavailable.
+ */
+
+#ifndef _PERF_COUNTERS_H
+#define _PERF_COUNTERS_H
+
+#include <stdbool.h> // for bool
+#include <stdint.h>
+
+// the counters that are tried, in the order they are reported
+typedef enum {
+    PERF_INSTRUCTIONS,
+    PERF_CYCLES,
+    PERF_L1D_MISSES,    // L1 data cache read misses
+    PERF_LLC_MISSES,    // last-level cache misses
+    PERF_DTLB_MISSES,   // data TLB read misses
+    PERF_PAGE_FAULTS,   // a software counter, so usually there when the hardware ones aren't
+    PERF_NUM_COUNTERS
+} perf_counter_id;
+
+typedef struct {
+    int leader;                         // fd all the counters are read through, -1 if none could be opened
+    int fds[PERF_NUM_COUNTERS];         // -1 for the counters that couldn't be opened
+    int slot[PERF_NUM_COUNTERS];        // where each counter's value comes in a group read
+    int num_open;
+    int error;                          // errno of the first counter that failed to open
+} perf_counters;
+
+typedef struct {
+    uint64_t value[PERF_NUM_COUNTERS];  // 0 for counters that aren't open
+} perf_sample;
+
+
+/* Function: perf_counters_open
+ * ----------------------------
+ * Opens and starts as many of the counters as the system allows, as one
+ * group so they are read together. Returns false if none could be opened.
+ */
+bool perf_counters_open(perf_counters *counters);
+
+
+/* Function: perf_counters_read
+ * ----------------------------
+ * Reads the current values of the open counters into sample. Differences
+ * between two samples count what happened in between.
+ */
+void perf_counters_read(const perf_counters *counters, perf_sample *sample);
+
+
+/* Function: perf_counters_close
+ * -----------------------------
+ * Closes whatever counters are open.
+ */
+void perf_counters_close(perf_counters *counters);
+
+
+/* Functions: perf_counter_available, perf_counter_name
+ * ----------------------------------------------------
+ * Whether counter could be opened, and a short name for it.
+ */
+bool perf_counter_available(const perf_counters *counters, perf_counter_id counter);
+const char *perf_counter_name(perf_counter_id counter);
+
+#endif
@@ -0,0 +1,545 @@
+/* File: preload.c
+ * ---------------
+ * Exports the standard malloc family on top of the explicit allocator, so
+ * it can be slid underneath unmodified binaries:
+ *
+ *     LD_PRELOAD=./libexplicit.so ./some_program
+ *
+ * The heap segment is reserved and initialized lazily on the first call.
+ * A single lock serializes every call into the allocator, and it is held
+ * across fork() so the child never inherits a heap that another thread was
+ * in the middle of changing.
+ *
+ * free() never waits for that lock: if another thread holds it, the block
+ * is pushed onto a lock-free list of remote frees with a single CAS, and
+ * whichever thread takes the lock next frees the whole list in one batch.
+ *
+ * HEAP_PROFILE=prefix turns on the sampling heap profiler (heapprof.h),
+ * which samples one allocation per HEAP_PROFILE_INTERVAL bytes (512 KiB by
+ * default) and writes a pprof profile to prefix.<pid>.<n>.heap whenever
+ * the process gets HEAP_PROFILE_SIGNAL (SIGUSR2 by default) and at exit.
+ * Programs can also write one themselves with heap_profile_dump(path).
+ *
+ * HEAP_STATS=1 publishes the allocator's live counters (heap_stats.h) in
+ * the shared memory object /heapstats.<pid>, together with how often the
+ * heap lock was contended, for the heaptop tool to read. The allocator
+ * copies them there every 1024 calls, and a background thread every
+ * STATS_SYNC_MS milliseconds (the maintenance thread below, if it runs),
+ * so the page is never more than that far behind an idle process. A
+ * forked child has no such thread, so its page only follows its calls.
+ *
+ * HEAP_MAINTENANCE=ms starts a background thread that wakes up every ms
+ * milliseconds, frees whatever is waiting on the remote free list, and
+ * runs mymaintain for up to HEAP_MAINTENANCE_BUDGET units of work (4096
+ * by default). myfree then leaves purging pages to the thread, so the
+ * madvise calls move off the allocating threads. The thread is stopped
+ * and joined at exit, and doesn't carry over into a forked child. With
+ * HEAP_STATS and no HEAP_MAINTENANCE, the same thread runs with no budget,
+ * only to refresh the counters.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "explicit.h"
+#include "heap_stats.h"
+#include "heapprof.h"
+#include "segment.h"
+
+// the library is built with hidden visibility, so only these entry points are exported
+#define EXPORT __attribute__((visibility("default")))
+
+// segment size reserved on first use, unless overridden by the HEAP_SEGMENT_SIZE environment variable
+#define DEFAULT_SEGMENT_SIZE (1L << 32)
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool heap_ready = false;
+
+// blocks freed while the lock was held elsewhere, linked through their first word
+static void *remote_frees = NULL;
+
+// background maintenance thread started by HEAP_MAINTENANCE (or HEAP_STATS), and what it waits on between passes
+#define DEFAULT_MAINTENANCE_BUDGET 4096
+#define STATS_SYNC_MS 100
+static pthread_t maintenance_thread;
+static bool maintenance_running = false;
+static bool maintenance_stop = false;
+static pthread_mutex_t maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maintenance_wakeup = PTHREAD_COND_INITIALIZER;
+static long maintenance_interval_ms;
+static size_t maintenance_budget;
+
+// page the allocator's counters are published in with HEAP_STATS, and the name it's shared under
+static heap_stats *published = NULL;
+static char published_name[64];
+
+
+/* Function: publish_stats
+ * -----------------------
+ * Creates this process's shared memory page for the allocator's counters
+ * and moves them there. Must be called with heap_lock held, after the heap
+ * is set up. Does nothing if the page can't be created.
+ */
+static void publish_stats(void) {
+    char name[sizeof(published_name)];
+    snprintf(name, sizeof(name), "%s%d", HEAP_STATS_SHM_PREFIX, (int)getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    heap_stats *page = NULL;
+    if (ftruncate(fd, sizeof(heap_stats)) == 0) {
+        page = mmap(NULL, sizeof(heap_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (page == NULL || page == MAP_FAILED) {
+        shm_unlink(name);
+        return;
+    }
+    mypublish_stats(page);
+    published = page;
+    strcpy(published_name, name);
+}
+
+__attribute__((destructor))
+static void unpublish_stats(void) {
+    if (published != NULL) {
+        shm_unlink(published_name);
+    }
+}
+
+
+/* Function: init_heap
+ * -------------------
+ * Reserves the heap segment and initializes the allocator over it, if this
+ * has not happened yet. Must be called with heap_lock held. Returns false
+ * if the heap could not be set up.
+ */
+static bool init_heap(void) {
+    if (heap_ready) {
+        return true;
+    }
+
+    size_t size = DEFAULT_SEGMENT_SIZE;
+    const char *size_env = getenv("HEAP_SEGMENT_SIZE");
+    if (size_env != NULL && strtoull(size_env, NULL, 0) != 0) {
+        size = strtoull(size_env, NULL, 0);
+    }
+
+    // HEAP_HUGE_PAGES puts the segment on huge pages
+    const char *huge_env = getenv("HEAP_HUGE_PAGES");
+    bool huge = huge_env != NULL && strcmp(huge_env, "0") != 0;
+
+    void *start = huge ? init_heap_segment_huge(size) : init_heap_segment(size);
+    if (start == NULL || !myinit(start, heap_segment_size())) {
+        return false;
+    }
+    heap_ready = true;
+
+    const char *stats_env = getenv("HEAP_STATS");
+    if (stats_env != NULL && strcmp(stats_env, "0") != 0) {
+        publish_stats();
+    }
+    return true;
+}
+
+/* Function: owns
+ * --------------
+ * Returns whether ptr points into the heap segment. Anything else was not
+ * handed out by this library and is left alone.
+ */
+static bool owns(void *ptr) {
+    return heap_ready && (char *)ptr >= (char *)heap_segment_start() &&
+        (char *)ptr < (char *)heap_segment_start() + heap_segment_size();
+}
+
+/* Function: free_locked
+ * ---------------------
+ * Frees a block with heap_lock held, first taking it out of the heap
+ * profile if it was sampled.
+ */
+static void free_locked(void *ptr) {
+    if (myis_sampled(ptr)) {
+        heapprof_record_free(ptr);
+    }
+    myfree(ptr);
+}
+
+/* Function: record_sample
+ * -----------------------
+ * Adds the block of size bytes at ptr to the heap profile. Must be called
+ * without heap_lock, since capturing the stack may allocate.
+ */
+static void record_sample(void *ptr, size_t size) {
+    if (heapprof_record_alloc(ptr, size)) {
+        pthread_mutex_lock(&heap_lock);
+        mymark_sampled(ptr);
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+/* Function: sampled
+ * -----------------
+ * Gives the heap profiler its chance to sample a new block of size bytes,
+ * and returns the block.
+ */
+static void *sampled(void *ptr, size_t size) {
+    if (ptr != NULL && heapprof_should_sample(size)) {
+        record_sample(ptr, size);
+    }
+    return ptr;
+}
+
+/* Function: push_remote_free
+ * ---------------------------
+ * Hands a block to whoever holds the heap lock. Any number of threads can
+ * push at once; the only consumer is the lock holder, which takes the whole
+ * list at a time, so a plain CAS loop is safe from ABA.
+ */
+static void push_remote_free(void *ptr) {
+    void *head = __atomic_load_n(&remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&remote_frees, &head, ptr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Function: drain_remote_frees
+ * ----------------------------
+ * Frees every block pushed by push_remote_free so far. Must be called with
+ * heap_lock held.
+ */
+static void drain_remote_frees(void) {
+    if (__atomic_load_n(&remote_frees, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    void *batch = __atomic_exchange_n(&remote_frees, NULL, __ATOMIC_ACQUIRE);
+    size_t nfreed = 0;
+    while (batch != NULL) {
+        void *next = *(void **)batch;
+        free_locked(batch);
+        batch = next;
+        nfreed++;
+    }
+    if (published != NULL) {
+        mystats()->remote_frees += nfreed;
+    }
+}
+
+/* Function: lock_heap
+ * -------------------
+ * Takes the heap lock and frees anything left on the remote free list
+ * before the caller touches the heap. With HEAP_STATS, it also counts the
+ * times it had to wait for the lock.
+ */
+static void lock_heap(void) {
+    bool contended = pthread_mutex_trylock(&heap_lock) != 0;
+    if (contended) {
+        pthread_mutex_lock(&heap_lock);
+    }
+    if (published != NULL) {
+        heap_stats *stats = mystats();
+        stats->lock_acquisitions++;
+        stats->lock_contended += contended;
+    }
+    drain_remote_frees();
+}
+
+// fork handlers: hold the locks across fork so the child's copy of the heap (and its profile) is consistent
+static void before_fork(void) {
+    pthread_mutex_lock(&heap_lock);
+    heapprof_before_fork();
+}
+
+static void after_fork(void) {
+    heapprof_after_fork();
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void after_fork_child(void) {
+    heapprof_after_fork();
+    pthread_mutex_init(&heap_lock, NULL);
+
+    // only the forking thread lives on in the child, so its frees go back to purging for themselves
+    if (maintenance_running) {
+        maintenance_running = false;
+        mydefer_purging(false);
+    }
+
+    // the child's counters go in a page of its own, not on over the parent's
+    if (published != NULL) {
+        heap_stats *parent_page = published;
+        published = NULL;
+        pthread_mutex_lock(&heap_lock);
+        publish_stats();
+        if (published == NULL) {
+            // failing that, in private memory, so the parent's page can still be let go of
+            heap_stats *page = mmap(NULL, sizeof(heap_stats), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (page != MAP_FAILED) {
+                mypublish_stats(page);
+            } else {
+                parent_page = NULL;
+            }
+        }
+        pthread_mutex_unlock(&heap_lock);
+        if (parent_page != NULL) {
+            munmap(parent_page, sizeof(heap_stats));
+        }
+    }
+}
+
+__attribute__((constructor))
+static void register_fork_handlers(void) {
+    pthread_atfork(before_fork, after_fork, after_fork_child);
+}
+
+/* Function: maintain
+ * ------------------
+ * Body of the maintenance thread: every maintenance_interval_ms, one
+ * budgeted pass of mymaintain (none with no budget) with the heap locked,
+ * and a refresh of the published counters, until stop_maintenance.
+ */
+static void *maintain(void *arg) {
+    pthread_mutex_lock(&maintenance_lock);
+    while (!maintenance_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += maintenance_interval_ms / 1000;
+        deadline.tv_nsec += maintenance_interval_ms % 1000 * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&maintenance_wakeup, &maintenance_lock, &deadline);
+        if (maintenance_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&maintenance_lock);
+
+        // taking the lock also frees whatever is on the remote free list
+        lock_heap();
+        if (heap_ready) {
+            if (maintenance_budget > 0) {
+                mymaintain(maintenance_budget);
+            }
+            mysync_stats();
+        }
+        pthread_mutex_unlock(&heap_lock);
+
+        pthread_mutex_lock(&maintenance_lock);
+    }
+    pthread_mutex_unlock(&maintenance_lock);
+    return arg;
+}
+
+__attribute__((constructor))
+static void start_maintenance(void) {
+    const char *interval_env = getenv("HEAP_MAINTENANCE");
+    const char *stats_env = getenv("HEAP_STATS");
+    if (interval_env != NULL && atol(interval_env) > 0) {
+        maintenance_interval_ms = atol(interval_env);
+        const char *budget_env = getenv("HEAP_MAINTENANCE_BUDGET");
+        maintenance_budget = budget_env != NULL && atol(budget_env) > 0 ? (size_t)atol(budget_env) :
+            DEFAULT_MAINTENANCE_BUDGET;
+    } else if (stats_env != NULL && strcmp(stats_env, "0") != 0) {
+        // just keeping the published counters current
+        maintenance_interval_ms = STATS_SYNC_MS;
+        maintenance_budget = 0;
+    } else {
+        return;
+    }
+
+    mydefer_purging(maintenance_budget > 0);
+    maintenance_running = pthread_create(&maintenance_thread, NULL, maintain, NULL) == 0;
+    if (!maintenance_running) {
+        mydefer_purging(false);
+    }
+}
+
+__attribute__((destructor))
+static void stop_maintenance(void) {
+    if (!maintenance_running) {
+        return;
+    }
+    pthread_mutex_lock(&maintenance_lock);
+    maintenance_stop = true;
+    pthread_cond_signal(&maintenance_wakeup);
+    pthread_mutex_unlock(&maintenance_lock);
+    pthread_join(maintenance_thread, NULL);
+    maintenance_running = false;
+    mydefer_purging(false);
+}
+
+__attribute__((constructor))
+static void start_heap_profile(void) {
+    const char *prefix = getenv("HEAP_PROFILE");
+    if (prefix == NULL || *prefix == '\0') {
+        return;
+    }
+    const char *interval_env = getenv("HEAP_PROFILE_INTERVAL");
+    size_t interval = interval_env != NULL ? strtoull(interval_env, NULL, 0) : HEAPPROF_DEFAULT_INTERVAL;
+    const char *signal_env = getenv("HEAP_PROFILE_SIGNAL");
+    int signo = signal_env != NULL ? atoi(signal_env) : SIGUSR2;
+    heapprof_start(prefix, interval, signo);
+}
+
+
+/* MALLOC FAMILY */
+
+
+/* Function: malloc
+ * ----------------
+ * Zero-byte requests still get a unique block, as callers expect from malloc.
+ */
+EXPORT void *malloc(size_t size) {
+    lock_heap();
+    void *ptr = init_heap() ? mymalloc(size == 0 ? 1 : size) : NULL;
+    pthread_mutex_unlock(&heap_lock);
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return sampled(ptr, size);
+}
+
+/* Function: free
+ * --------------
+ * Frees directly if the heap lock is free, and otherwise leaves the block
+ * on the remote free list for the current lock holder to pick up.
+ */
+EXPORT void free(void *ptr) {
+    if (ptr == NULL || !owns(ptr)) {
+        return;
+    }
+
+    if (pthread_mutex_trylock(&heap_lock) != 0) {
+        push_remote_free(ptr);
+        return;
+    }
+    drain_remote_frees();
+    free_locked(ptr);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+    if (nmemb == 0 || size == 0) {
+        nmemb = size = 1;
+    }
+
+    lock_heap();
+    void *ptr = init_heap() ? mycalloc(nmemb, size) : NULL;
+    pthread_mutex_unlock(&heap_lock);
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return sampled(ptr, nmemb * size);
+}
+
+/* Function: realloc
+ * -----------------
+ * Follows glibc: a NULL pointer behaves like malloc, and a zero size frees
+ * the block and returns NULL. On failure the old block is left intact.
+ * To the heap profiler, a block that moves is freed and allocated anew. A
+ * block that grows in place only has the bytes it grew by count toward
+ * the next sample, and one that is already sampled keeps its original
+ * size in the profile.
+ */
+EXPORT void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+
+    lock_heap();
+    void *newptr = NULL;
+    bool moved = false;
+    bool was_sampled = false;
+    size_t old_size = 0;
+    if (owns(ptr)) {
+        was_sampled = myis_sampled(ptr);
+        old_size = myusable_size(ptr);
+        newptr = myrealloc(ptr, size);
+        moved = newptr != ptr && (newptr != NULL || size == 0);
+        if (moved && was_sampled) {
+            heapprof_record_free(ptr);
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    if (newptr == NULL && size != 0) {
+        errno = ENOMEM;
+    }
+    if (moved) {
+        return sampled(newptr, size);
+    }
+    if (newptr != NULL && !was_sampled && size > old_size && heapprof_should_sample(size - old_size)) {
+        record_sample(newptr, size);
+    }
+    return newptr;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    lock_heap();
+    int result = init_heap() ? myposix_memalign(memptr, alignment, size == 0 ? 1 : size) : ENOMEM;
+    pthread_mutex_unlock(&heap_lock);
+
+    if (result == 0) {
+        sampled(*memptr, size);
+    }
+    return result;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    lock_heap();
+    void *ptr = init_heap() ? myaligned_alloc(alignment, size == 0 ? 1 : size) : NULL;
+    pthread_mutex_unlock(&heap_lock);
+
+    if (ptr == NULL) {
+        errno = (alignment == 0 || (alignment & (alignment - 1)) != 0) ? EINVAL : ENOMEM;
+    }
+    return sampled(ptr, size);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    return aligned_alloc(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    lock_heap();
+    size_t size = owns(ptr) ? myusable_size(ptr) : 0;
+    pthread_mutex_unlock(&heap_lock);
+    return size;
+}
+
+/* Function: heap_profile_dump
+ * ---------------------------
+ * Writes the heap profile to path, for programs that want one at a point
+ * of their choosing. Returns false if profiling isn't on (HEAP_PROFILE) or
+ * the file can't be written.
+ */
+EXPORT bool heap_profile_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = heapprof_dump(fd);
+    return close(fd) == 0 && written;
+}
@@ -1,21 +1,31 @@
 /* File: segment.c
  * ---------------
  * Handles low-level storage underneath the heap allocator. It reserves
- * the large memory segment using the OS-level mmap facility.
+ * the large memory segment using the OS-level mmap facility, optionally
+ * backed by huge pages, or maps it from a file so it outlives the process.
  */
 
 #include "segment.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /* Place segment at fixed address, as default addresses are quite high
  * and easily mistaken for stack addresses.
  */
 #define HEAP_START_HINT (void *)0x107000000L
 
+#define PAGE_SIZE 4096
+
 // Static means these variables are only visible within this file
 static void *segment_start = NULL;
 static size_t segment_size = 0;
+static segment_page_mode page_mode = SEGMENT_SMALL_PAGES;
+static bool segment_shared = false;
 
 void *heap_segment_start() {
     return segment_start;
@@ -25,17 +35,169 @@ size_t heap_segment_size() {
     return segment_size;
 }
 
-void *init_heap_segment(size_t total_size) {
-    // Discard any previous segment via munmap
+segment_page_mode heap_segment_page_mode() {
+    return page_mode;
+}
+
+size_t heap_segment_page_size() {
+    return page_mode == SEGMENT_SMALL_PAGES ? PAGE_SIZE : HUGE_PAGE_SIZE;
+}
+
+bool heap_segment_shared() {
+    return segment_shared;
+}
+
+/* Function: discard_segment
+ * -------------------------
+ * Unmaps the current segment, if any. Returns false if munmap fails.
+ */
+static bool discard_segment() {
     if (segment_start != NULL) {
-        if (munmap(segment_start, total_size) == -1) return NULL;
+        if (munmap(segment_start, segment_size) == -1) return false;
         segment_start = NULL;
         segment_size = 0;
+        page_mode = SEGMENT_SMALL_PAGES;
+        segment_shared = false;
     }
-    
+    return true;
+}
+
+void *init_heap_segment(size_t total_size) {
+    // Discard any previous segment via munmap
+    if (!discard_segment()) return NULL;
+
     // Re-initialize by reserving entire segment with mmap
     segment_start = mmap(HEAP_START_HINT, total_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
     assert(segment_start != MAP_FAILED);
     segment_size = total_size;
     return segment_start;
 }
+
+void *init_heap_segment_huge(size_t total_size) {
+    if (!discard_segment()) return NULL;
+    total_size = (total_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+    // Explicit huge pages come from the reserved pool, so this fails unless the pool is big enough
+    void *start = mmap(HEAP_START_HINT, total_size, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (start != MAP_FAILED) {
+        segment_start = start;
+        segment_size = total_size;
+        page_mode = SEGMENT_HUGETLB_PAGES;
+        return segment_start;
+    }
+
+    // Otherwise over-reserve so the segment can be trimmed to a huge page boundary at both ends
+    char *reserved = mmap(HEAP_START_HINT, total_size + HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    assert(reserved != MAP_FAILED);
+    char *aligned = (char *)(((uintptr_t)reserved + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > reserved) {
+        munmap(reserved, aligned - reserved);
+    }
+    if (reserved + HUGE_PAGE_SIZE > aligned) {
+        munmap(aligned + total_size, reserved + HUGE_PAGE_SIZE - aligned);
+    }
+
+    segment_start = aligned;
+    segment_size = total_size;
+
+    // Ask for transparent huge pages; if the kernel refuses, it is still a usable segment of small pages
+    if (madvise(segment_start, segment_size, MADV_HUGEPAGE) == 0) {
+        page_mode = SEGMENT_TRANSPARENT_HUGE_PAGES;
+    }
+    return segment_start;
+}
+
+/* Function: map_shared_segment
+ * ----------------------------
+ * Makes the file open on fd the segment, mapped with MAP_SHARED, and closes
+ * fd. An empty file is first sized to total_size; anything else is mapped
+ * at its own size. Returns NULL on failure.
+ */
+static void *map_shared_segment(int fd, size_t total_size) {
+    // An existing heap file keeps its size, a new one is sized (sparsely) to total_size
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size == 0 && ftruncate(fd, total_size) == -1)) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size != 0) {
+        total_size = st.st_size;
+    }
+
+    // The mapping keeps the file open, so the descriptor isn't needed past this
+    void *start = mmap(HEAP_START_HINT, total_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (start == MAP_FAILED) return NULL;
+
+    segment_start = start;
+    segment_size = total_size;
+    segment_shared = true;
+    return segment_start;
+}
+
+void *init_heap_segment_file(const char *path, size_t total_size) {
+    if (!discard_segment()) return NULL;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) return NULL;
+    return map_shared_segment(fd, total_size);
+}
+
+void *init_heap_segment_shm(const char *name, size_t total_size) {
+    if (!discard_segment()) return NULL;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) return NULL;
+    return map_shared_segment(fd, total_size);
+}
+
+bool heap_segment_sync() {
+    return segment_start != NULL && msync(segment_start, segment_size, MS_SYNC) == 0;
+}
+
+size_t heap_segment_huge_bytes() {
+    if (segment_start == NULL || page_mode == SEGMENT_SMALL_PAGES) return 0;
+
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if (fp == NULL) return 0;
+
+    // Sum the huge page counters of every mapping that falls within the segment
+    uintptr_t begin = (uintptr_t)segment_start;
+    uintptr_t end = begin + segment_size;
+    bool in_segment = false;
+    size_t huge_kb = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        uintptr_t map_start, map_end;
+        size_t kb;
+        if (sscanf(line, "%lx-%lx ", &map_start, &map_end) == 2) {
+            in_segment = map_start >= begin && map_end <= end;
+        } else if (in_segment && (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1 ||
+                                  sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1 ||
+                                  sscanf(line, "Shared_Hugetlb: %zu kB", &kb) == 1)) {
+            huge_kb += kb;
+        }
+    }
+    fclose(fp);
+    return huge_kb * 1024;
+}
+
+size_t heap_segment_resident_bytes() {
+    if (segment_start == NULL) return 0;
+
+    // mincore fills in one byte per page, so the segment is checked a chunk at a time with a fixed buffer
+    // (this can run underneath the LD_PRELOAD shim, where calling malloc would come back into the heap)
+    unsigned char resident[4096];
+    size_t chunk = sizeof(resident) * PAGE_SIZE;
+    size_t pages = 0;
+    for (size_t offset = 0; offset < segment_size; offset += chunk) {
+        size_t length = segment_size - offset < chunk ? segment_size - offset : chunk;
+        if (mincore((char *)segment_start + offset, length, resident) != 0) return 0;
+        for (size_t i = 0; i < (length + PAGE_SIZE - 1) / PAGE_SIZE; i++) {
+            pages += resident[i] & 1;
+        }
+    }
+    return pages * PAGE_SIZE;
+}
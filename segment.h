@@ -6,8 +6,19 @@
 
 #ifndef _SEGMENT_H_
 #define _SEGMENT_H_
+#include <stdbool.h> // for bool
 #include <stddef.h> // for size_t
 
+// size of the huge pages a huge-page segment is aligned to and backed by
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+// how the pages of the current segment are backed
+typedef enum {
+    SEGMENT_SMALL_PAGES,            // regular 4096-byte pages
+    SEGMENT_TRANSPARENT_HUGE_PAGES, // madvise(MADV_HUGEPAGE) accepted; the kernel backs it as it can
+    SEGMENT_HUGETLB_PAGES           // explicit MAP_HUGETLB pages from the reserved pool
+} segment_page_mode;
+
 
 /* Function: init_heap_segment
  * ---------------------------
@@ -21,6 +32,52 @@
 void *init_heap_segment(size_t total_size);
 
 
+/* Function: init_heap_segment_huge
+ * --------------------------------
+ * Like init_heap_segment, but rounds total_size up to a multiple of
+ * HUGE_PAGE_SIZE, aligns the segment on a HUGE_PAGE_SIZE boundary and
+ * backs it with huge pages where possible: MAP_HUGETLB pages if the pool
+ * has enough of them, otherwise transparent huge pages, otherwise regular
+ * pages. heap_segment_page_mode reports which one it got.
+ */
+void *init_heap_segment_huge(size_t total_size);
+
+
+
+/* Function: init_heap_segment_file
+ * --------------------------------
+ * Like init_heap_segment, but maps the segment from the file at path with
+ * MAP_SHARED, so whatever the heap holds is still there for the next
+ * process to map the same file. A new (or empty) file is created and sized
+ * to total_size; an existing file keeps its own size, which
+ * heap_segment_size reports. Returns NULL if the file can't be opened,
+ * sized or mapped. The allocator over a reopened file is picked up with
+ * myattach (explicit.h) rather than myinit, which would wipe it.
+ */
+void *init_heap_segment_file(const char *path, size_t total_size);
+
+
+/* Function: init_heap_segment_shm
+ * -------------------------------
+ * Like init_heap_segment_file, but for the POSIX shared memory object
+ * name (as passed to shm_open, e.g. "/myheap"), so that co-located
+ * processes can all map the same heap. Each process may get it at a
+ * different address. The first process sets the heap up with
+ * myinit_shared, the rest join with myattach (explicit.h). The object
+ * lives until shm_unlink.
+ */
+void *init_heap_segment_shm(const char *name, size_t total_size);
+
+
+/* Function: heap_segment_sync
+ * ---------------------------
+ * Flushes a file-backed segment to its file, so it survives a crash of
+ * the machine and not just of the process. Returns false if that fails or
+ * there is no segment.
+ */
+bool heap_segment_sync();
+
+
 
 /* Functions: heap_segment_start, heap_segment_size
  * ------------------------------------------------
@@ -32,4 +89,43 @@ void *heap_segment_start();
 size_t heap_segment_size();
 
 
+/* Functions: heap_segment_page_mode, heap_segment_page_size
+ * ---------------------------------------------------------
+ * heap_segment_page_mode returns how the current segment's pages are
+ * backed. heap_segment_page_size returns the granularity pages should be
+ * returned to the OS at so huge pages are never split: HUGE_PAGE_SIZE for
+ * huge-page segments, 4096 otherwise.
+ */
+segment_page_mode heap_segment_page_mode();
+size_t heap_segment_page_size();
+
+
+/* Function: heap_segment_shared
+ * -----------------------------
+ * Returns whether the current segment is a shared mapping (as from
+ * init_heap_segment_file), whose pages madvise(MADV_DONTNEED) does not zero.
+ */
+bool heap_segment_shared();
+
+
+/* Function: heap_segment_huge_bytes
+ * ---------------------------------
+ * Returns how many bytes of the current segment are actually backed by
+ * huge pages right now, as reported by /proc/self/smaps (0 if that can't
+ * be read). With transparent huge pages this can be anywhere from none of
+ * the touched memory to all of it.
+ */
+size_t heap_segment_huge_bytes();
+
+
+/* Function: heap_segment_resident_bytes
+ * -------------------------------------
+ * Returns how many bytes of the current segment are resident in memory
+ * right now, checked a page at a time with mincore (0 if there is no
+ * segment or that fails). Unlike the extent of the heap, this leaves out
+ * pages that were never touched or that the allocator gave back to the OS.
+ */
+size_t heap_segment_resident_bytes();
+
+
 #endif
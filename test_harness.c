@@ -11,16 +11,35 @@
  */
 
 #include <error.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "allocator.h"
+#include "bump.h"
+#include "explicit.h"
+#include "perf_counters.h"
 #include "segment.h"
 
+// extensions only some allocators have. They are weak, so they are NULL in a harness linked with an allocator
+// that lacks them, and the harness makes do with the standard calls
+#pragma weak mymark
+#pragma weak myrelease
+#pragma weak mymaintain
+#pragma weak mydefer_purging
+#pragma weak myhandle_alloc
+#pragma weak myhandle_pin
+#pragma weak myhandle_unpin
+#pragma weak myhandle_free
+
 
 /* TYPE DECLARATIONS */
 
@@ -29,21 +48,72 @@
 enum request_type {
     ALLOC = 1,
     FREE,
-    REALLOC
+    REALLOC,
+    ALIGNED_ALLOC,
+    CALLOC,
+    MARK,
+    RELEASE,
+    MAINTAIN,
+    HANDLE_ALLOC,
+    PIN,
+    UNPIN
 };
 typedef struct {
     enum request_type op;   // type of request
     int id;                 // id for free() to use later
     size_t size;            // num bytes for alloc/realloc request
+    size_t alignment;       // requested alignment for aligned alloc request
+    size_t changed;         // fewest blocks a maintain request must report changed
+    char lifetime;          // 's' or 'l' for an alloc request hinted short- or long-lived, else 0
     int lineno;             // which line in file
 } request_t;
 
+// kinds of requests the performance counters are totaled by
+enum counted_op {
+    COUNT_MALLOC,   // malloc, aligned alloc and calloc requests
+    COUNT_REALLOC,
+    COUNT_FREE,
+    NUM_COUNTED_OPS
+};
+typedef struct {
+    long num_calls;
+    uint64_t totals[PERF_NUM_COUNTERS];
+} op_counts;
+
 // struct for facts about a single malloc'ed block
 typedef struct {
     void *ptr;
     size_t size;
+    unsigned long serial;   // when it was last allocated or realloc'ed, counting up from 1
+    heap_handle handle;     // its handle if it came from myhandle_alloc, else 0
+    int pins;               // pins the script holds on that handle
 } block_t;
 
+// marks can be nested this deep
+#define MAX_MARKS 64
+
+// struct for a mark taken by the script, which releasing frees every block allocated since
+typedef struct {
+    unsigned long serial;   // serial of the last block allocated before it
+    region_mark region;     // the allocator's own mark, if it has mymark
+} mark_t;
+
+// number of parsed requests the parser thread can get ahead of the replay by when streaming
+#define RING_SIZE 4096
+
+// struct for a bounded single-producer, single-consumer queue of requests. When streaming (-s), a parser
+// thread fills it from the script file while the allocator runs on the requests parsed so far
+typedef struct {
+    request_t slots[RING_SIZE];
+    unsigned long head;     // requests the parser has added
+    unsigned long tail;     // requests the replay has taken
+    bool done;              // the parser has reached the end of the script
+    bool stop;              // the replay has given up, so the parser should too
+    FILE *fp;
+    char *script_name;
+    pthread_t parser;
+} request_ring;
+
 // struct for info for one script file
 typedef struct {
     char name[128];     // short name of script
@@ -52,8 +122,28 @@ typedef struct {
     int num_ids;        // number of distinct block ids
     block_t *blocks;    // array of memory blocks malloc returns when executing
     size_t peak_size;   // total payload bytes at peak in-use
+    request_ring *ring; // where the requests come from instead of ops when streaming, else NULL
+    op_counts counts[NUM_COUNTED_OPS];  // performance counter totals by kind of request (-P)
+    size_t peak_resident;   // bytes of the segment resident at peak in-use (-R)
+    size_t resident_payload;    // payload bytes in use when peak_resident was counted
+    size_t exit_resident;   // and after the last request
+    double fragmentation;   // share of the resident bytes not holding payload, averaged over the run
+    unsigned long serial;   // blocks allocated or realloc'ed so far
+    mark_t marks[MAX_MARKS];    // marks taken and not released yet, innermost last
+    int num_marks;
 } script_t;
 
+// struct for the command-line options that shape how scripts are run
+typedef struct {
+    bool quiet;                     // skip validate_heap between requests
+    bool huge;                      // put the heap on huge pages
+    bool stream;                    // parse scripts while they run instead of up front
+    bool count;                     // count hardware events per kind of request
+    bool resident;                  // count the resident pages of the segment as the script runs
+    const char *snapshot_prefix;    // write heap snapshots to files starting with this, if set
+    const char *heap_file;          // map the heap from this file, if set
+} options_t;
+
 // Amount by which we resize ops when needed when reading in from file
 const int OPS_RESIZE_AMOUNT = 500;
 
@@ -61,20 +151,39 @@ const int MAX_SCRIPT_LINE_LEN = 1024;
 
 const long HEAP_SIZE = 1L << 32;
 
+// resident pages are counted every this many requests, for the fragmentation over time
+const int RESIDENT_SAMPLE_INTERVAL = 256;
+
+// performance counters of the allocator calls, open with -P if the system has any
+static perf_counters counters = { .leader = -1 };
+
 
 /* FUNCTION PROTOTYPES */
 
 
-static int test_scripts(char *script_names[], int num_script_names, bool quiet);
+static int test_scripts(char *script_names[], int num_script_names, const options_t *options);
 static bool read_line(char buffer[], size_t buffer_size, FILE *fp, int *pnread);
 static script_t parse_script(const char *filename);
+static script_t open_script_stream(const char *path);
+static void *parse_script_stream(void *arg);
+static void close_script_stream(script_t *script);
+static bool next_request(script_t *script, int req, request_t *request);
 static request_t parse_script_line(char *buffer, int i, int lineno, char *script_name);
-static size_t eval_correctness(script_t *script, bool quiet, bool *success);
-static void *eval_malloc(int req, size_t requested_size, script_t *script, bool *failptr);
-static void *eval_realloc(int req, size_t requested_size, script_t *script, bool *failptr);
+static size_t eval_correctness(script_t *script, const options_t *options, bool *success);
+static int find_peak_request(script_t *script);
+static void write_snapshot(script_t *script, const char *snapshot_prefix, const char *suffix);
+static void *eval_malloc(const request_t *request, script_t *script, bool *failptr);
+static void *eval_realloc(const request_t *request, script_t *script, bool *failptr);
 static bool verify_block(void *ptr, size_t size, script_t *script, int lineno);
+static bool release_mark(script_t *script, int lineno, size_t *cur_size);
+static bool eval_maintain(const request_t *request, script_t *script);
+static bool eval_pin(const request_t *request, script_t *script);
+static void free_block(block_t *block);
 static bool verify_payload(void *ptr, size_t size, int id, script_t *script, int lineno, char *op);
 static void allocator_error(script_t *script, int lineno, char* format, ...);
+static void start_counting(perf_sample *before);
+static void stop_counting(script_t *script, enum counted_op op, const perf_sample *before);
+static void print_counts(const script_t *script);
 
 
 /* CORRECTNESS EVALUATION IMPLEMENTATION */
@@ -82,18 +191,35 @@ static void allocator_error(script_t *script, int lineno, char* format, ...);
 
 /* Function: main
  * --------------
- * The main function parses command-line arguments (currently only -q for quiet)
- * and any script files that follow and runs the heap allocator on the specified
+ * The main function parses command-line arguments (-q for quiet, -H to put the
+ * heap on huge pages, -F file to map the heap from a file, -S prefix to write
+ * heap snapshots of each script to prefix<script>.peak.snap and
+ * prefix<script>.snap, -s to stream scripts rather than read them in whole,
+ * -P to report performance counters per kind of request, -R to count the
+ * resident pages of the heap segment) and any script
+ * files that follow and runs the heap allocator on the specified
  * script files.  It outputs statistics about the run of each script, such as
  * the number of successful runs, number of failures, and average utilization.
  */
 int main(int argc, char *argv[]) {
     // Parse command line arguments
     char c;
-    bool quiet = false;
-    while ((c = getopt(argc, argv, "q")) != EOF) {
+    options_t options = { .quiet = false };
+    while ((c = getopt(argc, argv, "qHsPRF:S:")) != EOF) {
         if (c == 'q') {
-            quiet = true;
+            options.quiet = true;
+        } else if (c == 'P') {
+            options.count = true;
+        } else if (c == 'R') {
+            options.resident = true;
+        } else if (c == 's') {
+            options.stream = true;
+        } else if (c == 'H') {
+            options.huge = true;
+        } else if (c == 'F') {
+            options.heap_file = optarg;
+        } else if (c == 'S') {
+            options.snapshot_prefix = optarg;
         }
     }
     if (optind >= argc) {
@@ -102,46 +228,82 @@ int main(int argc, char *argv[]) {
 
     // disable stdout buffering, all printfs display to terminal immediately
     setvbuf(stdout, NULL, _IONBF, 0);
-    
-    return test_scripts(argv + optind, argc - optind, quiet);
+
+    // without counters (as in many containers) the scripts still run, just without the counts
+    if (options.count) {
+        if (!perf_counters_open(&counters)) {
+            printf("Performance counters are unavailable (%s), so none will be reported.\n",
+                strerror(counters.error));
+            options.count = false;
+        } else if (counters.num_open < PERF_NUM_COUNTERS) {
+            printf("Some performance counters are unavailable (%s) and are shown as -.\n",
+                strerror(counters.error));
+        }
+    }
+
+    int nfailures = test_scripts(argv + optind, argc - optind, &options);
+    perf_counters_close(&counters);
+    return nfailures;
 }
 
 /* Function: test_scripts
  * ----------------------
  * Runs the scripts with names in the specified array, with more or less output
- * depending on the value of `quiet`.  Returns the number of failures during all
- * the tests.
+ * and on whichever kind of segment the options ask for.
+ * Returns the number of failures during all the tests.
  */
-static int test_scripts(char *script_names[], int num_script_names, bool quiet) {
+static int test_scripts(char *script_names[], int num_script_names, const options_t *options) {
     int nsuccesses = 0;
     int nfailures = 0;
 
     // Utilization summed across all successful script runs (each is % out of 100)
     int total_util = 0;
+    int total_resident_util = 0;
 
     for (int i = 0; i < num_script_names; i++) {
-        script_t script = parse_script(script_names[i]);
+        script_t script = options->stream ? open_script_stream(script_names[i]) : parse_script(script_names[i]);
 
         // Evaluate this script and record the results
         printf("\nEvaluating allocator on %s...", script.name);
         bool success;
-        size_t used_segment = eval_correctness(&script, quiet, &success);
+        size_t used_segment = eval_correctness(&script, options, &success);
         if (success) {
             printf("successfully serviced %d requests. (payload/segment = %zu/%zu)", 
                 script.num_ops, script.peak_size, used_segment);
+            if (options->huge) {
+                // report what the kernel actually backed the segment with
+                const char *mode_names[] = { "no huge pages", "transparent huge pages", "hugetlb pages" };
+                printf(" [%s, %zu KiB on huge pages]", mode_names[heap_segment_page_mode()],
+                    heap_segment_huge_bytes() / 1024);
+            }
+            if (script.peak_resident > 0) {
+                printf(" [resident: %zu KiB at peak (%zu%% payload), %zu KiB at exit; %.0f%% fragmentation over time]",
+                    script.peak_resident / 1024, 100 * script.resident_payload / script.peak_resident,
+                    script.exit_resident / 1024, 100 * script.fragmentation);
+                total_resident_util += (100 * script.resident_payload) / script.peak_resident;
+            }
             if (used_segment > 0) {
                 total_util += (100 * script.peak_size) / used_segment;
             }
+            if (options->count) {
+                print_counts(&script);
+            }
             nsuccesses++;
         } else {
             nfailures++;
         }
 
+        if (script.ring != NULL) {
+            close_script_stream(&script);
+        }
         free(script.ops);
         free(script.blocks);
     }
 
-    if (nsuccesses) {
+    if (nsuccesses && options->resident) {
+        printf("\nUtilization averaged %d%%, or %d%% of resident memory\n", total_util / nsuccesses,
+            total_resident_util / nsuccesses);
+    } else if (nsuccesses) {
         printf("\nUtilization averaged %d%%\n", total_util / nsuccesses);
     }
     return nfailures;
@@ -152,18 +314,39 @@ static int test_scripts(char *script_names[], int num_script_names, bool quiet)
  * Check the allocator for correctness on given script. Interprets the
  * script operation-by-operation and reports if it detects any "obvious"
  * errors (returning blocks outside the heap, unaligned, 
- * overlapping blocks, etc.)
+ * overlapping blocks, etc.) With a snapshot prefix, the heap is written out
+ * for heapsnap at the script's peak and again as the script left it. A
+ * streamed script's peak isn't known in advance, so it only gets the latter.
+ *
+ * Besides the extent of the heap, which this returns, with -R the pages of
+ * the segment that are actually resident are counted at the peak and at
+ * exit, and every RESIDENT_SAMPLE_INTERVAL requests for the share of them
+ * that isn't payload. A streamed script's peak is the fullest of those
+ * samples. Each count walks the page table of the whole segment, so it is
+ * left off by default.
  */
-static size_t eval_correctness(script_t *script, bool quiet, bool *success) {
+static size_t eval_correctness(script_t *script, const options_t *options, bool *success) {
     *success = false;
     
-    init_heap_segment(HEAP_SIZE);
+    if (options->heap_file != NULL) {
+        if (init_heap_segment_file(options->heap_file, HEAP_SIZE) == NULL) {
+            allocator_error(script, 0, "could not map the heap from %s", options->heap_file);
+            return -1;
+        }
+    } else if (options->huge) {
+        init_heap_segment_huge(HEAP_SIZE);
+    } else {
+        init_heap_segment(HEAP_SIZE);
+    }
     if (!myinit(heap_segment_start(), heap_segment_size())) {
         allocator_error(script, 0, "myinit() returned false");
         return -1;
     }
+    if (mydefer_purging != NULL) {
+        mydefer_purging(false);
+    }
 
-    if (!quiet && !validate_heap()) {
+    if (!options->quiet && !validate_heap()) {
         allocator_error(script, 0, "validate_heap() after myinit returned false");
         return -1;
     }
@@ -174,14 +357,24 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success) {
     // Track the current amount of memory allocated on the heap
     size_t cur_size = 0;
 
+    // request after which to snapshot the heap at its fullest
+    int peak_req = script->ring == NULL ? find_peak_request(script) : -1;
+
+    // payload at the fullest sample taken, and the fragmentation summed over the samples
+    size_t sampled_peak = 0;
+    double fragmentation = 0;
+    int nsamples = 0;
+
     // Send each request to the heap allocator and check the resulting behavior
-    for (int req = 0; req < script->num_ops; req++) {
-        int id = script->ops[req].id;
-        size_t requested_size = script->ops[req].size;
+    request_t request;
+    for (int req = 0; next_request(script, req, &request); req++) {
+        int id = request.id;
+        size_t requested_size = request.size;
 
-        if (script->ops[req].op == ALLOC) {
+        if (request.op == ALLOC || request.op == ALIGNED_ALLOC ||
+            request.op == CALLOC || request.op == HANDLE_ALLOC) {
             bool fail = false;
-            void *p = eval_malloc(req, requested_size, script, &fail);
+            void *p = eval_malloc(&request, script, &fail);
             if (fail) {
                 return -1;
             }
@@ -190,10 +383,10 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success) {
             if ((char *)p + requested_size > (char *)heap_end) {
                 heap_end = (char *)p + requested_size;
             }
-        } else if (script->ops[req].op == REALLOC) {
+        } else if (request.op == REALLOC) {
             size_t old_size = script->blocks[id].size;
             bool fail = false;
-            void *p = eval_realloc(req, requested_size, script, &fail);
+            void *p = eval_realloc(&request, script, &fail);
             if (fail) {
                 return -1;
             }
@@ -202,23 +395,51 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success) {
             if ((char *)p + requested_size > (char *)heap_end) {
                 heap_end = (char *)p + requested_size;
             }
-        } else if (script->ops[req].op == FREE) {
+        } else if (request.op == FREE) {
             size_t old_size = script->blocks[id].size;
             void *p = script->blocks[id].ptr;
 
             // verify payload intact before free
             if (!verify_payload(p, old_size, id, script, 
-                script->ops[req].lineno, "freeing")) {
+                request.lineno, "freeing")) {
                 return -1;
             }
-            script->blocks[id] = (block_t){.ptr = NULL, .size = 0};
-            myfree(p);
+            perf_sample before;
+            start_counting(&before);
+            free_block(&script->blocks[id]);
+            stop_counting(script, COUNT_FREE, &before);
             cur_size -= old_size;
+        } else if (request.op == MARK) {
+            if (script->num_marks == MAX_MARKS) {
+                error(1, 0, "Line %d of script file '%s' nests marks more than %d deep.",
+                    request.lineno, script->name, MAX_MARKS);
+            }
+            mark_t *mark = &script->marks[script->num_marks++];
+            mark->serial = script->serial;
+            if (mymark != NULL) {
+                mark->region = mymark();
+            }
+        } else if (request.op == RELEASE) {
+            if (script->num_marks == 0) {
+                error(1, 0, "Line %d of script file '%s' releases a mark it never took.",
+                    request.lineno, script->name);
+            }
+            if (!release_mark(script, request.lineno, &cur_size)) {
+                return -1;
+            }
+        } else if (request.op == MAINTAIN) {
+            if (!eval_maintain(&request, script)) {
+                return -1;
+            }
+        } else if (request.op == PIN || request.op == UNPIN) {
+            if (!eval_pin(&request, script)) {
+                return -1;
+            }
         }
 
         // check heap consistency after each request and stop if any error
-        if (!quiet && !validate_heap()) {
-            allocator_error(script, script->ops[req].lineno, 
+        if (!options->quiet && !validate_heap()) {
+            allocator_error(script, request.lineno, 
                 "validate_heap() returned false, called in-between requests");
             return -1;
         }
@@ -226,7 +447,28 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success) {
         if (cur_size > script->peak_size) {
             script->peak_size = cur_size;
         }
+
+        if (options->resident && (req == peak_req || req % RESIDENT_SAMPLE_INTERVAL == 0)) {
+            size_t resident = heap_segment_resident_bytes();
+            if (req % RESIDENT_SAMPLE_INTERVAL == 0 && resident > 0) {
+                fragmentation += cur_size < resident ? 1 - (double)cur_size / resident : 0;
+                nsamples++;
+            }
+            if (req == peak_req || (peak_req < 0 && cur_size >= sampled_peak)) {
+                script->peak_resident = resident;
+                script->resident_payload = cur_size;
+                sampled_peak = cur_size;
+            }
+        }
+
+        if (req == peak_req && options->snapshot_prefix != NULL) {
+            write_snapshot(script, options->snapshot_prefix, ".peak.snap");
+        }
+    }
+    if (options->resident) {
+        script->exit_resident = heap_segment_resident_bytes();
     }
+    script->fragmentation = nsamples > 0 ? fragmentation / nsamples : 0;
 
     // verify payload is still intact for any block still allocated
     for (int id = 0; id < script->num_ids; id++) {
@@ -236,103 +478,402 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success) {
         }
     }
 
+    if (options->snapshot_prefix != NULL) {
+        write_snapshot(script, options->snapshot_prefix, ".snap");
+    }
+
     *success = true;
     return (char *)heap_end - (char *)heap_segment_start();
 }
 
+/* Function: find_peak_request
+ * ----------------------------
+ * Replays the sizes of the script's requests to find the one after which
+ * the most payload bytes are in use (the first such one on ties).
+ */
+static int find_peak_request(script_t *script) {
+    size_t *sizes = calloc(script->num_ids, sizeof(size_t));
+    unsigned long *serials = calloc(script->num_ids, sizeof(unsigned long));
+    unsigned long serial = 0, marks[MAX_MARKS];
+    int num_marks = 0;
+    size_t cur_size = 0, peak_size = 0;
+    int peak_req = -1;
+    for (int req = 0; req < script->num_ops; req++) {
+        int id = script->ops[req].id;
+        if (script->ops[req].op == MARK) {
+            marks[num_marks < MAX_MARKS ? num_marks++ : MAX_MARKS - 1] = serial;
+            continue;
+        } else if (script->ops[req].op == RELEASE) {
+            // a script that releases more than it marks fails when it runs
+            unsigned long since = num_marks > 0 ? marks[--num_marks] : 0;
+            for (int other = 0; other < script->num_ids; other++) {
+                if (serials[other] > since) {
+                    cur_size -= sizes[other];
+                    sizes[other] = 0;
+                    serials[other] = 0;
+                }
+            }
+            continue;
+        } else if (script->ops[req].op == MAINTAIN || script->ops[req].op == PIN || script->ops[req].op == UNPIN) {
+            continue;
+        }
+        cur_size -= sizes[id];
+        sizes[id] = script->ops[req].op == FREE ? 0 : script->ops[req].size;
+        serials[id] = script->ops[req].op == FREE ? 0 : ++serial;
+        cur_size += sizes[id];
+        if (cur_size > peak_size) {
+            peak_size = cur_size;
+            peak_req = req;
+        }
+    }
+    free(sizes);
+    free(serials);
+    return peak_req;
+}
+
+/* Function: write_snapshot
+ * ------------------------
+ * Writes a heap snapshot to snapshot_prefix<script name><suffix>.
+ */
+static void write_snapshot(script_t *script, const char *snapshot_prefix, const char *suffix) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s%s", snapshot_prefix, script->name, suffix);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || !heap_snapshot(fd)) {
+        allocator_error(script, -1, "could not write heap snapshot to %s", path);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
 /* Function: eval_malloc
  * ---------------------
- * Performs a test of a call to mymalloc of the given size.  The req number
- * specifies the operation's index within the script.  This function verifies
+ * Performs a test of a call to mymalloc (or myaligned_alloc for an aligned
+ * request, mycalloc for a zeroed one, mymalloc_hint for a hinted one, myhandle_alloc
+ * for a handle's block if the allocator has handles) for the given request of the script.
+ * This function verifies
  * the entire malloc'ed block and fills in the payload with a low-order byte
  * of the request id.  If the request fails, the boolean pointed to by
  * failptr is set to true - otherwise, it is set to false.  If it is set to
  * true this function returns NULL; otherwise, it returns what was returned
  * by mymalloc.
  */
-static void *eval_malloc(int req, size_t requested_size, script_t *script, 
-    bool *failptr) {
+static void *eval_malloc(const request_t *request, script_t *script, bool *failptr) {
 
-    int id = script->ops[req].id;
+    int id = request->id;
+    size_t requested_size = request->size;
+    size_t alignment = request->alignment;
 
     void *p;
-    if ((p = mymalloc(requested_size)) == NULL && requested_size != 0) {
-        allocator_error(script, script->ops[req].lineno, 
+    heap_handle handle = 0;
+    perf_sample before;
+    start_counting(&before);
+    if (request->op == HANDLE_ALLOC && myhandle_alloc != NULL) {
+        // the handle is pinned just long enough to fill the block in
+        handle = myhandle_alloc(requested_size);
+        p = handle != 0 ? myhandle_pin(handle) : NULL;
+    } else if (request->op == ALIGNED_ALLOC) {
+        p = myaligned_alloc(alignment, requested_size);
+    } else if (request->op == CALLOC) {
+        p = mycalloc(requested_size, 1);
+    } else if (request->lifetime) {
+        p = mymalloc_hint(requested_size, request->lifetime == 's' ? LIFETIME_SHORT : LIFETIME_LONG);
+    } else {
+        p = mymalloc(requested_size);
+    }
+    stop_counting(script, COUNT_MALLOC, &before);
+    if (p == NULL && requested_size != 0) {
+        allocator_error(script, request->lineno, 
             "heap exhausted, malloc returned NULL");
         *failptr = true;
         return NULL;
     }
 
+    // aligned requests must honor the requested alignment on top of ALIGNMENT
+    if (request->op == ALIGNED_ALLOC && ((uintptr_t)p) % alignment != 0) {
+        allocator_error(script, request->lineno,
+            "New block (%p) not aligned to requested %zu bytes", p, alignment);
+        *failptr = true;
+        return NULL;
+    }
+
     /* Test new block for correctness: must be properly aligned
      * and must not overlap any currently allocated block.
      */
-    if (!verify_block(p, requested_size, script, script->ops[req].lineno)) {
+    if (!verify_block(p, requested_size, script, request->lineno)) {
         *failptr = true;
         return NULL;
     }
 
+    // zeroed requests must come back all zero
+    if (request->op == CALLOC) {
+        for (size_t i = 0; i < requested_size; i++) {
+            if (*((unsigned char *)p + i) != 0) {
+                allocator_error(script, request->lineno,
+                    "calloc'ed block (%p) not zeroed at offset %zu", p, i);
+                *failptr = true;
+                return NULL;
+            }
+        }
+    }
+
     /* Fill new block with the low-order byte of new id
      * can be used later to verify data copied when realloc'ing.
      */
     memset(p, id & 0xFF, requested_size);
-    script->blocks[id] = (block_t){.ptr = p, .size = requested_size};
+    if (handle != 0) {
+        myhandle_unpin(handle);
+    }
+    script->blocks[id] = (block_t){.ptr = p, .size = requested_size, .serial = ++script->serial, .handle = handle};
     *failptr = false;
     return p;
 }
 
 /* Function: eval_realloc
  * ---------------------
- * Performs a test of a call to myrealloc of the given size.  The req number
- * specifies the operation's index within the script.  This function verifies
+ * Performs a test of a call to myrealloc for the given request of the
+ * script.  This function verifies
  * the entire realloc'ed block and fills in the payload with a low-order byte
  * of the request id.  If the request fails, the boolean pointed to by
  * failptr is set to true - otherwise, it is set to false.  If it is set to true
  * this function returns NULL; otherwise, it returns what was returned by
  * myrealloc.
  */
-static void *eval_realloc(int req, size_t requested_size, script_t *script, 
-    bool *failptr) {
+static void *eval_realloc(const request_t *request, script_t *script, bool *failptr) {
 
-    int id = script->ops[req].id;
+    int id = request->id;
+    size_t requested_size = request->size;
     size_t old_size = script->blocks[id].size;
+    if (script->blocks[id].handle != 0) {
+        error(1, 0, "Line %d of script file '%s' reallocs a handle's block.", request->lineno, script->name);
+    }
 
     void *oldp = script->blocks[id].ptr;
     if (!verify_payload(oldp, old_size, id, script, 
-        script->ops[req].lineno, "pre-realloc-ing")) {
+        request->lineno, "pre-realloc-ing")) {
         *failptr = true;
         return NULL;
     }
 
-    void *newp;
-    if ((newp = myrealloc(oldp, requested_size)) == NULL && requested_size != 0) {
-        allocator_error(script, script->ops[req].lineno, 
+    perf_sample before;
+    start_counting(&before);
+    void *newp = myrealloc(oldp, requested_size);
+    stop_counting(script, COUNT_REALLOC, &before);
+    if (newp == NULL && requested_size != 0) {
+        allocator_error(script, request->lineno, 
             "heap exhausted, realloc returned NULL");
         *failptr = true;
         return NULL;
     }
 
     script->blocks[id].size = 0;
-    if (!verify_block(newp, requested_size, script, script->ops[req].lineno)) {
+    if (!verify_block(newp, requested_size, script, request->lineno)) {
         *failptr = true;
         return NULL;
     }
 
     // Verify new block contains the data from the old block
     if (!verify_payload(newp, (old_size < requested_size ? old_size : requested_size), 
-        id, script, script->ops[req].lineno, "post-realloc-ing (preserving data)")) {
+        id, script, request->lineno, "post-realloc-ing (preserving data)")) {
         *failptr = true;
         return NULL;
     }
 
     // Fill new block with the low-order byte of new id
     memset(newp, id & 0xFF, requested_size);
-    script->blocks[id] = (block_t){.ptr = newp, .size = requested_size};
+    script->blocks[id] = (block_t){.ptr = newp, .size = requested_size, .serial = ++script->serial};
 
     *failptr = false;
     return newp;
 }
 
 
+/* Function: release_mark
+ * -----------------------
+ * Releases the script's innermost mark: every block allocated or
+ * realloc'ed since it was taken is checked and then freed, all at once
+ * with myrelease if the allocator has it, or one at a time with myfree.
+ */
+static bool release_mark(script_t *script, int lineno, size_t *cur_size) {
+    mark_t *mark = &script->marks[--script->num_marks];
+    for (int id = 0; id < script->num_ids; id++) {
+        block_t *block = &script->blocks[id];
+        if (block->ptr == NULL || block->serial <= mark->serial) {
+            continue;
+        }
+        if (!verify_payload(block->ptr, block->size, id, script, lineno, "releasing")) {
+            return false;
+        }
+        *cur_size -= block->size;
+        if (myrelease == NULL) {
+            free_block(block);
+        } else {
+            *block = (block_t){.ptr = NULL, .size = 0};
+        }
+    }
+    if (myrelease != NULL) {
+        myrelease(mark->region);
+    }
+    return true;
+}
+
+/* Function: eval_maintain
+ * ------------------------
+ * Runs a slice of heap upkeep with mymaintain, if the allocator has it,
+ * and fails if it reports fewer blocks coalesced, purged or moved than the
+ * request expects. A script that maintains the heap runs from then on the
+ * way the shim's maintenance thread has it, with myfree leaving purging to
+ * mymaintain. It may have moved the blocks of handles the script holds no
+ * pins on, so each handle's block is looked up again (and checked like a
+ * new block where it moved), and the pinned ones must not have moved.
+ * Every block is checked afterwards, as upkeep must not touch a payload.
+ */
+static bool eval_maintain(const request_t *request, script_t *script) {
+    if (mymaintain == NULL) {
+        return true;
+    }
+    mydefer_purging(true);
+    size_t changed = mymaintain(request->size);
+    if (changed < request->changed) {
+        allocator_error(script, request->lineno, "mymaintain changed %zu blocks, expected at least %zu",
+            changed, request->changed);
+        return false;
+    }
+
+    // every block has to be where it is now before the moved ones are checked against the others
+    bool *moved = calloc(script->num_ids, sizeof(bool));
+    for (int id = 0; id < script->num_ids; id++) {
+        block_t *block = &script->blocks[id];
+        if (block->handle == 0) {
+            continue;
+        }
+        void *p = myhandle_pin(block->handle);
+        myhandle_unpin(block->handle);
+        if (p != block->ptr && block->pins > 0) {
+            allocator_error(script, request->lineno, "mymaintain moved pinned block (%p) to %p", block->ptr, p);
+            free(moved);
+            return false;
+        }
+        moved[id] = p != block->ptr;
+        block->ptr = p;
+    }
+    for (int id = 0; id < script->num_ids; id++) {
+        if (!moved[id]) {
+            continue;
+        }
+        size_t size = script->blocks[id].size;
+        script->blocks[id].size = 0;
+        bool valid = verify_block(script->blocks[id].ptr, size, script, request->lineno);
+        script->blocks[id].size = size;
+        if (!valid) {
+            free(moved);
+            return false;
+        }
+    }
+    free(moved);
+
+    for (int id = 0; id < script->num_ids; id++) {
+        if (!verify_payload(script->blocks[id].ptr, script->blocks[id].size, id, script, request->lineno,
+            "after maintaining")) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Function: eval_pin
+ * -------------------
+ * Pins or unpins the handle of a block from an "h" request. Pinning must
+ * give back the address the block has had since it was allocated or the
+ * last maintain request. Allocators without handles have nothing to pin.
+ */
+static bool eval_pin(const request_t *request, script_t *script) {
+    block_t *block = &script->blocks[request->id];
+    if (block->ptr == NULL || (request->op == UNPIN && block->pins == 0)) {
+        error(1, 0, "Line %d of script file '%s' %s a block that isn't there or isn't pinned.", request->lineno,
+            script->name, request->op == PIN ? "pins" : "unpins");
+    }
+    block->pins += request->op == PIN ? 1 : -1;
+    if (block->handle == 0) {
+        return true;
+    }
+    if (request->op == UNPIN) {
+        myhandle_unpin(block->handle);
+        return true;
+    }
+    void *p = myhandle_pin(block->handle);
+    if (p != block->ptr) {
+        allocator_error(script, request->lineno, "myhandle_pin returned %p for the block at %p", p, block->ptr);
+        return false;
+    }
+    return true;
+}
+
+/* Function: free_block
+ * --------------------
+ * Frees a block of the script with myfree, or with myhandle_free if it
+ * came from myhandle_alloc, and forgets it.
+ */
+static void free_block(block_t *block) {
+    if (block->handle != 0) {
+        myhandle_free(block->handle);
+    } else {
+        myfree(block->ptr);
+    }
+    *block = (block_t){.ptr = NULL, .size = 0};
+}
+
+/* Functions: start_counting, stop_counting
+ * ----------------------------------------
+ * Bracket an allocator call to add what the performance counters counted
+ * during it to the script's totals for its kind of request. Neither does
+ * anything unless the counters are open.
+ */
+static void start_counting(perf_sample *before) {
+    if (counters.leader >= 0) {
+        perf_counters_read(&counters, before);
+    }
+}
+
+static void stop_counting(script_t *script, enum counted_op op, const perf_sample *before) {
+    if (counters.leader < 0) {
+        return;
+    }
+    perf_sample after;
+    perf_counters_read(&counters, &after);
+    script->counts[op].num_calls++;
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        script->counts[op].totals[i] += after.value[i] - before->value[i];
+    }
+}
+
+/* Function: print_counts
+ * ----------------------
+ * Prints the average of each performance counter per call, for each kind of
+ * request in the script. The counts include the few hundred instructions it
+ * takes to read the counters around each call.
+ */
+static void print_counts(const script_t *script) {
+    const char *op_names[NUM_COUNTED_OPS] = { "malloc", "realloc", "free" };
+
+    printf("\n    %-10s %10s", "per call", "calls");
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        printf(" %12s", perf_counter_name(i));
+    }
+    for (int op = 0; op < NUM_COUNTED_OPS; op++) {
+        const op_counts *counts = &script->counts[op];
+        printf("\n    %-10s %10ld", op_names[op], counts->num_calls);
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+            if (perf_counter_available(&counters, i) && counts->num_calls > 0) {
+                printf(" %12.2f", (double)counts->totals[i] / counts->num_calls);
+            } else {
+                printf(" %12s", "-");
+            }
+        }
+    }
+}
+
 /* Function: verify_block
  * ----------------------
  * Does some checks on the block returned by allocator to try to
@@ -480,6 +1021,116 @@ static script_t parse_script(const char *path) {
     return script;
 }
 
+/* Function: open_script_stream
+ * -----------------------------
+ * Opens the script file at path for streaming, and starts a parser thread
+ * that decodes its requests into the script's ring as the replay takes them
+ * (see next_request). Only RING_SIZE requests are held at a time, so a
+ * script of any length runs in memory bounded by its number of block ids,
+ * and parsing overlaps with running the allocator.
+ */
+static script_t open_script_stream(const char *path) {
+    script_t script = { .ops = NULL, .blocks = NULL, .num_ops = 0, .num_ids = 0, .peak_size = 0 };
+    const char *basename = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    strncpy(script.name, basename, sizeof(script.name) - 1);
+    script.name[sizeof(script.name) - 1] = '\0';
+
+    script.ring = calloc(1, sizeof(request_ring));
+    if (!script.ring) {
+        error(1, 0, "Libc heap exhausted. Cannot continue.");
+    }
+    script.ring->fp = fopen(path, "r");
+    if (script.ring->fp == NULL) {
+        error(1, 0, "Could not open script file \"%s\".", path);
+    }
+    script.ring->script_name = strdup(script.name);
+    if (pthread_create(&script.ring->parser, NULL, parse_script_stream, script.ring) != 0) {
+        error(1, 0, "Could not start the parser thread for \"%s\".", path);
+    }
+    return script;
+}
+
+/* Function: parse_script_stream
+ * -----------------------------
+ * Body of the parser thread: adds each request of the script to the ring,
+ * waiting whenever it is full, until the file ends or the replay stops.
+ */
+static void *parse_script_stream(void *arg) {
+    request_ring *ring = arg;
+    char buffer[MAX_SCRIPT_LINE_LEN];
+    int lineno = 0;
+
+    for (int i = 0; read_line(buffer, sizeof(buffer), ring->fp, &lineno); i++) {
+        request_t request = parse_script_line(buffer, i, lineno, ring->script_name);
+
+        // only the parser writes head, so it can read its own without ordering
+        unsigned long head = ring->head;
+        while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            if (__atomic_load_n(&ring->stop, __ATOMIC_RELAXED)) {
+                return NULL;
+            }
+            sched_yield();
+        }
+        ring->slots[head % RING_SIZE] = request;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&ring->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// stops the parser thread, if it is still going, and releases the script's ring
+static void close_script_stream(script_t *script) {
+    __atomic_store_n(&script->ring->stop, true, __ATOMIC_RELAXED);
+    pthread_join(script->ring->parser, NULL);
+    fclose(script->ring->fp);
+    free(script->ring->script_name);
+    free(script->ring);
+    script->ring = NULL;
+}
+
+/* Function: next_request
+ * ----------------------
+ * Stores the script's request number req in request, and returns false once
+ * the script has no more. A streamed script's requests are taken from its
+ * ring in order, waiting for the parser to catch up, and its blocks array
+ * grows to cover each new block id.
+ */
+static bool next_request(script_t *script, int req, request_t *request) {
+    request_ring *ring = script->ring;
+    if (ring == NULL) {
+        if (req >= script->num_ops) {
+            return false;
+        }
+        *request = script->ops[req];
+        return true;
+    }
+
+    unsigned long tail = ring->tail;
+    while (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        // the parser may have added its last requests right before it finished
+        if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) && tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        sched_yield();
+    }
+    *request = ring->slots[tail % RING_SIZE];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    script->num_ops = req + 1;
+
+    if (request->id >= script->num_ids) {
+        int num_ids = script->num_ids * 2 > request->id ? script->num_ids * 2 : request->id + 1;
+        block_t *blocks = realloc(script->blocks, num_ids * sizeof(block_t));
+        if (!blocks) {
+            error(1, 0, "Libc heap exhausted. Cannot continue.");
+        }
+        memset(blocks + script->num_ids, 0, (num_ids - script->num_ids) * sizeof(block_t));
+        script->blocks = blocks;
+        script->num_ids = num_ids;
+    }
+    return true;
+}
+
 /* Function: read_line
  * --------------------
  * This function reads one line from the specified file and stores at most
@@ -524,20 +1175,43 @@ static bool read_line(char buffer[], size_t buffer_size, FILE *fp,
 static request_t parse_script_line(char *buffer, int i, int lineno, 
     char *script_name) {
 
-    request_t request = { .lineno = lineno, .op = 0, .size = 0};
+    request_t request = { .lineno = lineno, .op = 0, .size = 0, .alignment = ALIGNMENT};
 
     char request_char;
-    int nscanned = sscanf(buffer, " %c %d %zu", &request_char, 
-        &request.id, &request.size);
+    int nscanned = sscanf(buffer, " %c %d %zu %zu", &request_char, 
+        &request.id, &request.size, &request.alignment);
     if (request_char == 'a' && nscanned == 3) {
         request.op = ALLOC;
+        // an optional lifetime hint follows the size
+        if (sscanf(buffer, " %*c %*d %*s %c", &request.lifetime) == 1 &&
+            request.lifetime != 's' && request.lifetime != 'l') {
+            request.op = 0;
+        }
+    } else if (request_char == 'm' && nscanned == 4) {
+        request.op = ALIGNED_ALLOC;
+    } else if (request_char == 'c' && nscanned == 3) {
+        request.op = CALLOC;
     } else if (request_char == 'r' && nscanned == 3) {
         request.op = REALLOC;
     } else if (request_char == 'f' && nscanned == 2) {
         request.op = FREE;
+    } else if (request_char == 'k' && nscanned == 1) {
+        request.op = MARK;
+    } else if (request_char == 'x' && nscanned == 1) {
+        request.op = RELEASE;
+    } else if (request_char == 'h' && nscanned == 3) {
+        request.op = HANDLE_ALLOC;
+    } else if (request_char == 'p' && nscanned == 2) {
+        request.op = PIN;
+    } else if (request_char == 'u' && nscanned == 2) {
+        request.op = UNPIN;
+    } else if (request_char == 'M' && sscanf(buffer, " %*c %zu %zu", &request.size, &request.changed) == 2) {
+        request.op = MAINTAIN;
+        request.id = 0;
     }
 
-    if (!request.op || request.id < 0 || request.size > MAX_REQUEST_SIZE) {
+    if (!request.op || request.id < 0 || request.size > MAX_REQUEST_SIZE ||
+        request.alignment == 0 || (request.alignment & (request.alignment - 1)) != 0) {
         error(1, 0, "Line %d of script file '%s' is malformed.", 
             lineno, script_name);
     }